@@ -1,19 +1,67 @@
+#include "ppmio.h"
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 #include <iostream>
+#include <iomanip>
 #include <algorithm>
 #include <cmath>
+#include <cctype>
 #include <limits>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <memory>
+#include <iterator>
+#include <csignal>
+#include <chrono>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-// Structure to represent an RGB pixel
-struct RGB
+static_assert(sizeof(RGB) == 3, "RGB rows are processed as packed byte arrays");
+
+// Function to parse a binary PNM header with parsePNMHeader, the parser the probe and the
+// mapped readers use, so every path agrees on where the pixels start. Leaves the stream at
+// the first pixel byte.
+static PPMInfo readPNMHeader(std::ifstream &file, const std::string &filename)
 {
-    unsigned char r, g, b;
-};
+    PPMInfo info;
+    std::vector<unsigned char> buffer;
+    for (size_t want = 512; want <= 65536; want *= 8)
+    {
+        buffer.resize(want);
+        file.clear();
+        file.seekg(0);
+        file.read(reinterpret_cast<char *>(buffer.data()), want);
+        size_t got = static_cast<size_t>(file.gcount());
+        if (parsePNMHeader(buffer.data(), got, info))
+        {
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(info.headerSize));
+            return info;
+        }
+        if (got < want)
+            break;
+    }
+    throw std::runtime_error("Error reading header of " + filename + ": " + info.error);
+}
 
 std::vector<std::vector<RGB>> readPPM(const std::string &filename)
 {
@@ -30,40 +78,13 @@ std::vector<std::vector<RGB>> readPPM(const std::string &filename)
         throw std::runtime_error("Invalid PPM format: " + magic);
     }
 
-    int width, height, max_val;
-    std::string line;
-
-    // Read width and height, skipping comments and empty lines
-    while (true)
-    {
-        std::getline(file, line);
-        if (!file) throw std::runtime_error("Error reading PPM header.");
-        if (line.empty() || line[0] == '#') continue;
-        std::istringstream iss(line);
-        if (iss >> width >> height) break;
-    }
-
-    // Read max color value, skipping comments and empty lines
-    while (true)
-    {
-        std::getline(file, line);
-        if (!file) throw std::runtime_error("Error reading max color value.");
-        if (line.empty() || line[0] == '#') continue;
-        std::istringstream iss(line);
-        if (iss >> max_val) break;
-    }
-
+    PPMInfo header = readPNMHeader(file, filename);
+    int width = header.width, height = header.height, max_val = header.maxVal;
     if (max_val != 255)
     {
         throw std::runtime_error("Unsupported max value: " + std::to_string(max_val));
     }
 
-    // Consume any additional whitespace (e.g., newline) before binary data.
-    while (std::isspace(file.peek()))
-    {
-        file.get();
-    }
-
     std::cout << "PPM File: " << filename << "\n";
     std::cout << "Width: " << width << ", Height: " << height << ", Max Value: " << max_val << "\n";
 
@@ -152,315 +173,6861 @@ void writePPM(const std::string &filename, const std::vector<std::vector<RGB>> &
     std::cout << "PPM file successfully written: " << filename << "\n";
 }
 
+// Function to read a PAM (P7) header up to ENDHDR; depth is the number of channels per tuple
+static void readPAMHeader(std::istream &file, const std::string &filename, int &width, int &height, int &depth)
+{
+    std::string magic;
+    std::getline(file, magic);
+    if (magic != "P7")
+    {
+        throw std::runtime_error("Invalid PAM format: " + magic);
+    }
 
-// Function to convert image to grayscale
-void grayscale(std::vector<std::vector<RGB>> &image)
+    width = height = depth = 0;
+    int max_val = 0;
+    std::string tupleType, line;
+    while (true)
+    {
+        std::getline(file, line);
+        if (!file) throw std::runtime_error("Error reading PAM header: " + filename);
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream iss(line);
+        std::string key;
+        iss >> key;
+        if (key == "ENDHDR") break;
+        else if (key == "WIDTH") iss >> width;
+        else if (key == "HEIGHT") iss >> height;
+        else if (key == "DEPTH") iss >> depth;
+        else if (key == "MAXVAL") iss >> max_val;
+        else if (key == "TUPLTYPE") iss >> tupleType;
+        else throw std::runtime_error("Unknown PAM header field: " + key);
+    }
+
+    if (width <= 0 || height <= 0 || depth < 1 || depth > 4)
+    {
+        throw std::runtime_error("Unsupported PAM dimensions or depth in " + filename);
+    }
+    if (max_val != 255)
+    {
+        throw std::runtime_error("Unsupported max value: " + std::to_string(max_val));
+    }
+    std::cout << "PAM File: " << filename << "\n";
+    std::cout << "Width: " << width << ", Height: " << height << ", Depth: " << depth
+              << (tupleType.empty() ? "" : ", Tuple Type: " + tupleType) << "\n";
+}
+
+// Function to widen one row of PAM tuples (1 to 4 channels) to RGBA
+static void tuplesToRGBA(const unsigned char *in, int depth, RGBA *out, int width)
 {
-    for (auto &row : image)
+    for (int j = 0; j < width; ++j, in += depth)
     {
-        for (auto &pixel : row)
+        switch (depth)
         {
-            unsigned char gray = (pixel.r + pixel.g + pixel.b) / 3;
-            pixel.r = pixel.g = pixel.b = gray;
+        case 1: out[j] = {in[0], in[0], in[0], 255}; break;
+        case 2: out[j] = {in[0], in[0], in[0], in[1]}; break;
+        case 3: out[j] = {in[0], in[1], in[2], 255}; break;
+        default: out[j] = {in[0], in[1], in[2], in[3]}; break;
         }
     }
 }
 
-// Function to invert colors of the image
-void invert(std::vector<std::vector<RGB>> &image)
+std::vector<std::vector<RGBA>> readPAM(const std::string &filename)
 {
-    for (auto &row : image)
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
     {
-        for (auto &pixel : row)
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    int width, height, depth;
+    readPAMHeader(file, filename, width, height, depth);
+
+    std::vector<std::vector<RGBA>> image(height, std::vector<RGBA>(width));
+    std::vector<unsigned char> tuples(static_cast<size_t>(width) * depth);
+    for (int i = 0; i < height; ++i)
+    {
+        if (depth == 4)
+            file.read(reinterpret_cast<char *>(image[i].data()), tuples.size());
+        else
+            file.read(reinterpret_cast<char *>(tuples.data()), tuples.size());
+        if (file.gcount() != static_cast<std::streamsize>(tuples.size()))
         {
-            pixel.r = 255 - pixel.r;
-            pixel.g = 255 - pixel.g;
-            pixel.b = 255 - pixel.b;
+            throw std::runtime_error("Error reading pixel data at row " + std::to_string(i));
         }
+        if (depth != 4)
+            tuplesToRGBA(tuples.data(), depth, image[i].data(), width);
     }
+    return image;
 }
 
-// Function to adjust contrast
-
-/*
-void contrast(std::vector<std::vector<RGB>> &image, float factor)
+void writePAM(const std::string &filename, const std::vector<std::vector<RGBA>> &image)
 {
-    for (auto &row : image)
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open())
     {
-        for (auto &pixel : row)
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    int height = image.size();
+    int width = (height > 0) ? image[0].size() : 0;
+    if (width == 0 || height == 0)
+    {
+        throw std::runtime_error("Empty image data.");
+    }
+
+    file << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+    std::cout << "Writing PAM file: " << filename << "\n";
+    for (int i = 0; i < height; ++i)
+    {
+        file.write(reinterpret_cast<const char *>(image[i].data()), static_cast<std::streamsize>(width) * 4);
+        if (!file)
         {
-            pixel.r = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
-            pixel.g = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
-            pixel.b = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
+            throw std::runtime_error("Error writing pixel data at row " + std::to_string(i));
         }
     }
+    std::cout << "PAM file successfully written: " << filename << "\n";
 }
-*/
-/*
-void contrast(std::vector<std::vector<RGB>> &image, float factor)
+
+// Function to convert between the RGB working image and RGBA. A P7 image is split into
+// straight colors and an alpha plane, which is left empty when every pixel is opaque;
+// joining them again treats an empty plane as opaque.
+std::vector<std::vector<RGB>> splitRGBA(const std::vector<std::vector<RGBA>> &image,
+                                        std::vector<std::vector<unsigned char>> &alpha)
 {
-    for (auto &row : image)
+    std::vector<std::vector<RGB>> out(image.size());
+    alpha.assign(image.size(), std::vector<unsigned char>());
+    bool opaque = true;
+    for (size_t i = 0; i < image.size(); ++i)
     {
-        for (auto &pixel : row)
+        out[i].resize(image[i].size());
+        alpha[i].resize(image[i].size());
+        for (size_t j = 0; j < image[i].size(); ++j)
         {
-            int newR = static_cast<int>(std::round((pixel.r - 128) * factor + 128));
-            int newG = static_cast<int>(std::round((pixel.g - 128) * factor + 128));
-            int newB = static_cast<int>(std::round((pixel.b - 128) * factor + 128));
-
-            // Clamp each channel between 0 and 255
-            pixel.r = std::min(255, std::max(0, newR));
-            pixel.g = std::min(255, std::max(0, newG));
-            pixel.b = std::min(255, std::max(0, newB));
+            const RGBA &p = image[i][j];
+            out[i][j] = {p.r, p.g, p.b};
+            alpha[i][j] = p.a;
+            opaque &= p.a == 255;
         }
     }
+    if (opaque)
+        alpha.clear();
+    return out;
 }
-*/
-/*
-void contrast(std::vector<std::vector<RGB>> &image, double factor)
+
+std::vector<std::vector<RGBA>> toRGBA(const std::vector<std::vector<RGB>> &image,
+                                      const std::vector<std::vector<unsigned char>> &alpha)
 {
-    for (auto &row : image)
+    std::vector<std::vector<RGBA>> out(image.size());
+    for (size_t i = 0; i < image.size(); ++i)
     {
-        for (auto &pixel : row)
+        out[i].resize(image[i].size());
+        for (size_t j = 0; j < image[i].size(); ++j)
         {
-            double newR = std::round((pixel.r - 128) * factor + 128);
-            double newG = std::round((pixel.g - 128) * factor + 128);
-            double newB = std::round((pixel.b - 128) * factor + 128);
-
-            pixel.r = std::min(255, std::max(0, static_cast<int>(newR)));
-            pixel.g = std::min(255, std::max(0, static_cast<int>(newG)));
-            pixel.b = std::min(255, std::max(0, static_cast<int>(newB)));
+            unsigned char a = alpha.empty() ? 255 : alpha[i][j];
+            out[i][j] = {image[i][j].r, image[i][j].g, image[i][j].b, a};
         }
     }
+    return out;
 }
-*/
-void contrast(std::vector<std::vector<RGB>> &image, float factor)
+
+// Function to flatten straight colors onto black by their alpha, leaving an opaque image
+void flattenAlpha(std::vector<std::vector<RGB>> &image, const std::vector<std::vector<unsigned char>> &alpha)
 {
-    for (auto &row : image)
+    for (size_t i = 0; i < image.size(); ++i)
     {
-        for (auto &pixel : row)
+        for (size_t j = 0; j < image[i].size(); ++j)
         {
-            // Truncate instead of rounding
-            int newR = static_cast<int>((pixel.r - 128) * factor + 128);
-            int newG = static_cast<int>((pixel.g - 128) * factor + 128);
-            int newB = static_cast<int>((pixel.b - 128) * factor + 128);
-
-            // Clamp each channel to [0,255]
-            pixel.r = std::min(255, std::max(0, newR));
-            pixel.g = std::min(255, std::max(0, newG));
-            pixel.b = std::min(255, std::max(0, newB));
+            RGB &p = image[i][j];
+            int a = alpha[i][j];
+            p = {static_cast<unsigned char>((p.r * a + 127) / 255), static_cast<unsigned char>((p.g * a + 127) / 255),
+                 static_cast<unsigned char>((p.b * a + 127) / 255)};
         }
     }
 }
 
-// Function to apply box blur
-void blur(std::vector<std::vector<RGB>> &image)
+// A P6 file mapped read-only; rows are read straight from the page cache, so an
+// input is never copied into a vector<vector<RGB>> just to be streamed through once.
+struct MappedPPM
 {
-    std::vector<std::vector<RGB>> temp = image;
-    int height = image.size();
-    int width = image[0].size();
+    int width = 0, height = 0;
+    size_t rowBytes = 0;
+    const unsigned char *pixels = nullptr;
+    void *base = MAP_FAILED;
+    size_t length = 0;
 
-    for (int i = 1; i < height - 1; ++i)
+    // magic is "P6", or "P4" for a packed bitmap
+    explicit MappedPPM(const std::string &filename, const std::string &magic = "P6")
     {
-        for (int j = 1; j < width - 1; ++j)
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
         {
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-            for (int x = -1; x <= 1; ++x)
-            {
-                for (int y = -1; y <= 1; ++y)
-                {
-                    sum_r += temp[i + x][j + y].r;
-                    sum_g += temp[i + x][j + y].g;
-                    sum_b += temp[i + x][j + y].b;
-                }
-            }
-            image[i][j].r = sum_r / 9;
-            image[i][j].g = sum_g / 9;
-            image[i][j].b = sum_b / 9;
+            throw std::runtime_error("Cannot open file: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot stat file: " + filename);
+        }
+        length = static_cast<size_t>(st.st_size);
+        base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map file: " + filename);
         }
+
+        const unsigned char *data = static_cast<const unsigned char *>(base);
+        PPMInfo header;
+        if (!parsePNMHeader(data, length, header))
+        {
+            munmap(base, length);
+            throw std::runtime_error(header.error + ": " + filename);
+        }
+        if (header.magic != magic || (magic == "P6" && header.maxVal != 255))
+        {
+            munmap(base, length);
+            throw std::runtime_error((magic == "P6" ? "Only 8-bit P6 files can be mapped: " : "Not a P4 file: ") +
+                                     filename);
+        }
+        width = header.width;
+        height = header.height;
+        rowBytes = magic == "P6" ? static_cast<size_t>(width) * 3 : (static_cast<size_t>(width) + 7) / 8;
+        pixels = data + header.headerSize;
+        if (header.expectedSize > length)
+        {
+            munmap(base, length);
+            throw std::runtime_error("Pixel data is incomplete: " + filename);
+        }
+        madvise(base, length, MADV_SEQUENTIAL);
     }
-}
 
-// Function to mirror the image horizontally
-void mirror(std::vector<std::vector<RGB>> &image) {
-    int height = image.size();
-    int width = image[0].size();
+    ~MappedPPM()
+    {
+        if (base != MAP_FAILED)
+            munmap(base, length);
+    }
 
-    std::cout << "Applying mirroring using std::reverse...\n";
+    MappedPPM(const MappedPPM &) = delete;
+    MappedPPM &operator=(const MappedPPM &) = delete;
 
-    // Print the first and last few pixels before mirroring for better visibility
-    std::cout << "Before Mirroring (First and Last 5 pixels of first row):\n";
-    for (int j = 0; j < std::min(5, width); ++j) {
-        std::cout << "(" << (int)image[0][j].r << ", " 
-                  << (int)image[0][j].g << ", " 
-                  << (int)image[0][j].b << ") ";
-    }
-    std::cout << " ... ";
-    for (int j = width - 5; j < width; ++j) {
-        std::cout << "(" << (int)image[0][j].r << ", " 
-                  << (int)image[0][j].g << ", " 
-                  << (int)image[0][j].b << ") ";
+    const unsigned char *row(int i) const
+    {
+        return pixels + rowBytes * i;
     }
-    std::cout << "\n";
+};
 
-    // Reverse each row to flip the image horizontally
-    for (int i = 0; i < height; ++i) {
-        std::reverse(image[i].begin(), image[i].end());
+// Function to continue a 64-bit FNV-1a checksum over n bytes; checkpoints use it to
+// verify finished work before it is skipped
+uint64_t checksumBytes(const unsigned char *data, size_t n, uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        hash = (hash ^ data[k]) * 1099511628211ull;
     }
+    return hash;
+}
 
-    // Print the first and last few pixels after mirroring
-    std::cout << "After Mirroring (First and Last 5 pixels of first row):\n";
-    for (int j = 0; j < std::min(5, width); ++j) {
-        std::cout << "(" << (int)image[0][j].r << ", " 
-                  << (int)image[0][j].g << ", " 
-                  << (int)image[0][j].b << ") ";
-    }
-    std::cout << " ... ";
-    for (int j = width - 5; j < width; ++j) {
-        std::cout << "(" << (int)image[0][j].r << ", " 
-                  << (int)image[0][j].g << ", " 
-                  << (int)image[0][j].b << ") ";
+// Function to checksum `length` bytes of a file from `offset`. Returns false if the file
+// is missing or shorter than the range.
+bool checksumFile(const std::string &filename, uint64_t offset, uint64_t length, uint64_t &hash)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    std::vector<unsigned char> buffer(1 << 20);
+    hash = checksumBytes(nullptr, 0);
+    while (length > 0)
+    {
+        ssize_t got = pread(fd, buffer.data(), std::min<uint64_t>(length, buffer.size()), offset);
+        if (got <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        hash = checksumBytes(buffer.data(), got, hash);
+        offset += got;
+        length -= got;
     }
-    std::cout << "\n";
+    close(fd);
+    return true;
 }
 
-
-// Function to compress the image
-void compress(std::vector<std::vector<RGB>> &image)
+// Function to describe a file's identity for checkpoints: size and modification time
+std::string fileStamp(const std::string &filename)
 {
-    int height = image.size();
-    int width = image[0].size();
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return "missing";
+    return std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec);
+}
 
-    // Number of kept rows/columns is roughly half
-    // If the image height/width is odd, integer division will floor it,
-    // leaving room for the "odd" indices to be kept.
-    int new_height = height / 2;
-    int new_width = width / 2;
+// Append-only record of finished work. The first line names the job (options and input
+// stamps); each later line is one finished unit with the checksum of what it wrote. A line
+// is appended with a single write and synced, so concurrent threads and worker processes
+// can record into the same file and a kill leaves at most a partial last line.
+struct Checkpoint
+{
+    std::string path;
+    std::vector<std::string> records;  // finished units loaded by --resume
 
-    std::vector<std::vector<RGB>> compressed(new_height, std::vector<RGB>(new_width));
+    // Starts a fresh checkpoint, or with resume keeps the records of a matching one
+    Checkpoint(const std::string &filename, const std::string &signature, bool resume) : path(filename)
+    {
+        std::string header = "proj02-checkpoint " + signature;
+        std::ifstream in(path);
+        std::string line;
+        if (resume && std::getline(in, line))
+        {
+            if (line == header)
+            {
+                while (std::getline(in, line))
+                    records.push_back(line);
+                std::cout << "Resuming from " << path << " (" << records.size() << " recorded units)\n";
+                return;
+            }
+            std::cout << "Checkpoint " << path << " is for a different job; starting over\n";
+        }
+        in.close();
+        std::ofstream out(path, std::ios::trunc);
+        out << header << "\n";
+        if (!out)
+            throw std::runtime_error("Cannot write checkpoint: " + path);
+    }
 
-    // Skip even row/column indices => keep odd row/column indices
-    for (int i = 0; i < new_height; ++i)
+    void record(const std::string &line) const
     {
-        for (int j = 0; j < new_width; ++j)
+        std::string text = line + "\n";
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        if (fd < 0 || write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size()) || fsync(fd) != 0)
         {
-            // Use (2*i + 1, 2*j + 1) to grab odd row/column indices
-            compressed[i][j] = image[2 * i + 1][2 * j + 1];
+            if (fd >= 0)
+                close(fd);
+            throw std::runtime_error("Cannot write checkpoint: " + path);
         }
+        close(fd);
     }
 
-    std::cout << "After Compression: " << new_width << "x" << new_height << "\n";
-    image = compressed;
-}
+    void remove() const
+    {
+        std::remove(path.c_str());
+    }
+};
 
+// Number of worker threads used by the parallel operators (0 = use every core)
+int g_threads = 0;
 
-// Main function
-int main(int argc, char *argv[])
-{
-    if (argc < 3)
-    {     
-        std::cerr << "Program expects: " << argv[0] << " <input.ppm> <output.ppm> [options]\n"
-                  << "Supported options are: -g (grayscale), -i (invert), -x (contrast), -b (blur), -m (mirror), -c (compress)\n";  
-  
-        return 1;
-    }
+// Number of rows a worker claims at a time in parallelRows
+int g_bandRows = 32;
 
-    std::string inputFile, outputFile;
-    std::vector<std::string> options;
+// Per-thread cap on workers; batch workers running images side by side set it to 1
+thread_local int t_workerLimit = 0;
 
-    // Flexible Argument Parsing Loop
-    int nonOptionCount = 0;  // Tracks the number of non-option arguments (input and output files)
-    for (int i = 1; i < argc; ++i)  // Iterates over all arguments from index 1
+// Band height and thread count from the host profile for the operator the current thread
+// is running (0 = not tuned); see ScopedTuning
+thread_local int t_bandRows = 0;
+thread_local int t_tunedThreads = 0;
+
+// When set, parallelRows adds each worker's time spent in bands to its slot (used by the
+// scaling harness to measure load imbalance)
+std::vector<double> *g_workerBusy = nullptr;
+
+// Function to count the cores this process may use: the CPU affinity mask, capped by a
+// cgroup CPU quota (v2 cpu.max, or v1 cfs_quota_us / cfs_period_us) when one is set
+int availableCores()
+{
+    static const int cores = []()
     {
-        std::string arg = argv[i];  // Current argument being evaluated
-        if (arg[0] == '-')  // Identifies options (arguments starting with '-')
+        int count = static_cast<int>(std::thread::hardware_concurrency());
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            count = CPU_COUNT(&set);
+
+        long quota = -1, period = 0;
+        std::ifstream v2("/sys/fs/cgroup/cpu.max");
+        std::string max;
+        if (v2 >> max >> period)
         {
-            options.push_back(arg);  // Adds options to a vector, regardless of position
+            if (max != "max")
+                quota = std::stol(max);
         }
         else
         {
-            if (nonOptionCount == 0)  // Assigns the first non-option as input file
-                inputFile = arg;
-            else if (nonOptionCount == 1)  // Assigns the second non-option as output file
-                outputFile = arg;
-            else
-            {
-                std::cerr << "Error: Too many non-option arguments. Only input and output files are expected.\n";  // Handles excess non-options
-                return 1;
-            }
-            nonOptionCount++;  // Increments counter for each non-option found
+            std::ifstream q("/sys/fs/cgroup/cpu/cpu.cfs_quota_us"), p("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            if (!(q >> quota) || !(p >> period))
+                quota = -1;
         }
-    }
+        if (quota > 0 && period > 0)
+            count = std::min(count, static_cast<int>((quota + period - 1) / period));
+        return std::max(1, count);
+    }();
+    return cores;
+}
 
-    // Validation of File Arguments
-    if (nonOptionCount < 2)  // Ensures at least two non-option arguments (input and output)
-    {
-        std::cerr << "Error: Both input and output file paths must be provided.\n";
-        return 1;
-    }
+// Function to get the number of worker threads to use
+int workerCount()
+{
+    if (t_workerLimit > 0)
+        return t_workerLimit;
+    if (g_threads > 0)
+        return g_threads;
+    if (t_tunedThreads > 0)
+        return std::min(t_tunedThreads, availableCores());
+    return availableCores();
+}
 
-    try
-    {
-        auto image = readPPM(inputFile);
+// Function to get the band height parallelRows uses by default on this thread
+int defaultBandRows()
+{
+    return std::max(1, t_bandRows > 0 ? t_bandRows : g_bandRows);
+}
 
-        // Apply Options in Order
-        for (const auto &option : options)  // Applies transformations based on collected options
-        {
-            if (option == "-g")
+// Progress and cancellation state shared by every operator
+static ProgressCallback g_progress;
+static std::atomic<bool> g_cancel(false);
+
+// Name reported for the passes the current thread starts (e.g. the option being applied)
+thread_local std::string t_stage;
+
+void setProgressCallback(const ProgressCallback &callback)
+{
+    g_progress = callback;
+}
+
+void requestCancel()
+{
+    g_cancel.store(true, std::memory_order_relaxed);
+}
+
+bool cancelRequested()
+{
+    return g_cancel.load(std::memory_order_relaxed);
+}
+
+void clearCancel()
+{
+    g_cancel.store(false);
+}
+
+// Function to run fn(firstRow, lastRow) over bands of [0, height) on all worker threads.
+// Bands are claimed dynamically so uneven rows do not leave threads idle. The first
+// exception thrown by any band stops the remaining bands and is rethrown to the caller.
+// bandRows overrides defaultBandRows() for operators whose bands carry a halo.
+// Cancellation is checked before every band, and finished rows are reported to the
+// progress callback each time another percent of the pass completes.
+void parallelRows(int height, const std::function<void(int, int)> &fn, int bandRows = 0)
+{
+    int band = bandRows > 0 ? bandRows : defaultBandRows();
+    int bands = (height + band - 1) / band;
+    int workers = std::min(workerCount(), bands);
+
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    std::atomic<long> done(0);
+    std::atomic<int> reported(0);
+    std::mutex progressMutex;
+    const std::string stage = t_stage;
+
+    std::vector<double> *busy = g_workerBusy;
+    if (busy && busy->size() < static_cast<size_t>(workers))
+        busy->resize(workers);
+
+    auto work = [&](int worker)
+    {
+        try
+        {
+            for (;;)
+            {
+                if (cancelRequested())
+                    throw OperationCancelled();
+                int first = next.fetch_add(band);
+                if (first >= height)
+                    break;
+                int last = std::min(height, first + band);
+                if (busy)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    fn(first, last);
+                    (*busy)[worker] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                }
+                else
+                {
+                    fn(first, last);
+                }
+
+                if (g_progress)
+                {
+                    long rows = done.fetch_add(last - first) + (last - first);
+                    int percent = static_cast<int>(rows * 100 / height);
+                    int seen = reported.load();
+                    if (percent > seen && reported.compare_exchange_strong(seen, percent))
+                    {
+                        std::lock_guard<std::mutex> lock(progressMutex);
+                        g_progress(stage, rows, height);
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+            next.store(height);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < workers; ++t)
+    {
+        pool.emplace_back(work, t);
+    }
+    work(0);
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Function to convert one row to grayscale
+static void grayscaleRow(RGB *row, int width)
+{
+    for (RGB *pixel = row; pixel != row + width; ++pixel)
+    {
+        unsigned char gray = (pixel->r + pixel->g + pixel->b) / 3;
+        pixel->r = pixel->g = pixel->b = gray;
+    }
+}
+
+// Function to convert image to grayscale
+void grayscale(std::vector<std::vector<RGB>> &image)
+{
+    for (auto &row : image)
+    {
+        grayscaleRow(row.data(), row.size());
+    }
+}
+
+// Function to invert the colors of one row
+static void invertRow(RGB *row, int width)
+{
+    for (RGB *pixel = row; pixel != row + width; ++pixel)
+    {
+        pixel->r = 255 - pixel->r;
+        pixel->g = 255 - pixel->g;
+        pixel->b = 255 - pixel->b;
+    }
+}
+
+// Function to invert colors of the image
+void invert(std::vector<std::vector<RGB>> &image)
+{
+    for (auto &row : image)
+    {
+        invertRow(row.data(), row.size());
+    }
+}
+
+// Function to adjust contrast
+
+/*
+void contrast(std::vector<std::vector<RGB>> &image, float factor)
+{
+    for (auto &row : image)
+    {
+        for (auto &pixel : row)
+        {
+            pixel.r = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
+            pixel.g = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
+            pixel.b = std::min(255, std::max(0, static_cast<int>(std::round((pixel.r - 128) * factor + 128))));
+        }
+    }
+}
+*/
+/*
+void contrast(std::vector<std::vector<RGB>> &image, float factor)
+{
+    for (auto &row : image)
+    {
+        for (auto &pixel : row)
+        {
+            int newR = static_cast<int>(std::round((pixel.r - 128) * factor + 128));
+            int newG = static_cast<int>(std::round((pixel.g - 128) * factor + 128));
+            int newB = static_cast<int>(std::round((pixel.b - 128) * factor + 128));
+
+            // Clamp each channel between 0 and 255
+            pixel.r = std::min(255, std::max(0, newR));
+            pixel.g = std::min(255, std::max(0, newG));
+            pixel.b = std::min(255, std::max(0, newB));
+        }
+    }
+}
+*/
+/*
+void contrast(std::vector<std::vector<RGB>> &image, double factor)
+{
+    for (auto &row : image)
+    {
+        for (auto &pixel : row)
+        {
+            double newR = std::round((pixel.r - 128) * factor + 128);
+            double newG = std::round((pixel.g - 128) * factor + 128);
+            double newB = std::round((pixel.b - 128) * factor + 128);
+
+            pixel.r = std::min(255, std::max(0, static_cast<int>(newR)));
+            pixel.g = std::min(255, std::max(0, static_cast<int>(newG)));
+            pixel.b = std::min(255, std::max(0, static_cast<int>(newB)));
+        }
+    }
+}
+*/
+static void contrastRow(RGB *row, int width, float factor)
+{
+    for (RGB *pixel = row; pixel != row + width; ++pixel)
+    {
+        // Truncate instead of rounding
+        int newR = static_cast<int>((pixel->r - 128) * factor + 128);
+        int newG = static_cast<int>((pixel->g - 128) * factor + 128);
+        int newB = static_cast<int>((pixel->b - 128) * factor + 128);
+
+        // Clamp each channel to [0,255]
+        pixel->r = std::min(255, std::max(0, newR));
+        pixel->g = std::min(255, std::max(0, newG));
+        pixel->b = std::min(255, std::max(0, newB));
+    }
+}
+
+void contrast(std::vector<std::vector<RGB>> &image, float factor)
+{
+    for (auto &row : image)
+    {
+        contrastRow(row.data(), row.size(), factor);
+    }
+}
+
+// Function to apply box blur
+// The result is built in the copy and swapped in at the end, so a cancelled blur
+// leaves the image exactly as it was.
+void blur(std::vector<std::vector<RGB>> &image)
+{
+    std::vector<std::vector<RGB>> temp = image;
+    int height = image.size();
+    int width = image[0].size();
+
+    parallelRows(std::max(0, height - 2), [&](int first, int last)
+    {
+        for (int i = first + 1; i < last + 1; ++i)
+        {
+            for (int j = 1; j < width - 1; ++j)
+            {
+                int sum_r = 0, sum_g = 0, sum_b = 0;
+                for (int x = -1; x <= 1; ++x)
+                {
+                    for (int y = -1; y <= 1; ++y)
+                    {
+                        sum_r += image[i + x][j + y].r;
+                        sum_g += image[i + x][j + y].g;
+                        sum_b += image[i + x][j + y].b;
+                    }
+                }
+                temp[i][j].r = sum_r / 9;
+                temp[i][j].g = sum_g / 9;
+                temp[i][j].b = sum_b / 9;
+            }
+        }
+    });
+    image.swap(temp);
+}
+
+// Function to mirror the image horizontally
+void mirror(std::vector<std::vector<RGB>> &image) {
+    int height = image.size();
+    int width = image[0].size();
+
+    std::cout << "Applying mirroring using std::reverse...\n";
+
+    // Print the first and last few pixels before mirroring for better visibility
+    std::cout << "Before Mirroring (First and Last 5 pixels of first row):\n";
+    for (int j = 0; j < std::min(5, width); ++j) {
+        std::cout << "(" << (int)image[0][j].r << ", " 
+                  << (int)image[0][j].g << ", " 
+                  << (int)image[0][j].b << ") ";
+    }
+    std::cout << " ... ";
+    for (int j = width - 5; j < width; ++j) {
+        std::cout << "(" << (int)image[0][j].r << ", " 
+                  << (int)image[0][j].g << ", " 
+                  << (int)image[0][j].b << ") ";
+    }
+    std::cout << "\n";
+
+    // Reverse each row to flip the image horizontally
+    for (int i = 0; i < height; ++i) {
+        std::reverse(image[i].begin(), image[i].end());
+    }
+
+    // Print the first and last few pixels after mirroring
+    std::cout << "After Mirroring (First and Last 5 pixels of first row):\n";
+    for (int j = 0; j < std::min(5, width); ++j) {
+        std::cout << "(" << (int)image[0][j].r << ", " 
+                  << (int)image[0][j].g << ", " 
+                  << (int)image[0][j].b << ") ";
+    }
+    std::cout << " ... ";
+    for (int j = width - 5; j < width; ++j) {
+        std::cout << "(" << (int)image[0][j].r << ", " 
+                  << (int)image[0][j].g << ", " 
+                  << (int)image[0][j].b << ") ";
+    }
+    std::cout << "\n";
+}
+
+
+// Function to compress the image
+void compress(std::vector<std::vector<RGB>> &image)
+{
+    int height = image.size();
+    int width = image[0].size();
+
+    // Number of kept rows/columns is roughly half
+    // If the image height/width is odd, integer division will floor it,
+    // leaving room for the "odd" indices to be kept.
+    int new_height = height / 2;
+    int new_width = width / 2;
+
+    std::vector<std::vector<RGB>> compressed(new_height, std::vector<RGB>(new_width));
+
+    // Skip even row/column indices => keep odd row/column indices
+    for (int i = 0; i < new_height; ++i)
+    {
+        for (int j = 0; j < new_width; ++j)
+        {
+            // Use (2*i + 1, 2*j + 1) to grab odd row/column indices
+            compressed[i][j] = image[2 * i + 1][2 * j + 1];
+        }
+    }
+
+    std::cout << "After Compression: " << new_width << "x" << new_height << "\n";
+    image = compressed;
+}
+
+
+// A command line option and, for options such as --lut, the argument that follows it
+struct Option
+{
+    std::string name;
+    std::string value;
+};
+
+// Per-pixel expressions for -e, e.g. "r=255-g; g=(r+b)/2". Each statement assigns one
+// channel; right-hand sides read the pixel as it was before the expression, so "r=g; g=r"
+// swaps. Arithmetic is in float (+ - * / %, unary -, comparisons giving 0 or 1, c ? a : b,
+// min, max, clamp, abs); x/0 and x%0 are 0. Results are clamped to [0, 255] and truncated,
+// as contrast() does.
+enum class ExprCode : uint8_t
+{
+    Const, Add, Sub, Mul, Div, Mod, Neg, Lt, Le, Gt, Ge, Eq, Ne, Min, Max, Abs, Select
+};
+
+struct ExprInstr
+{
+    ExprCode code;
+    uint8_t dst, a, b, c;
+    float value;  // for Const
+};
+
+// One channel's bytecode. Registers 0-2 hold the input r, g, b; each instruction writes a
+// fresh register. deps has bit k set when the result depends on input channel k.
+struct ExprProgram
+{
+    std::vector<ExprInstr> code;
+    int result = -1;
+    int deps = 0;
+};
+
+struct Expression
+{
+    static constexpr int kMaxRegisters = 64;
+    ExprProgram channel[3];
+    bool assigned[3] = {false, false, false};
+    // Channels depending on at most one input are baked into a table indexed by that input
+    std::vector<unsigned char> lut[3];
+    int lutSource[3] = {0, 0, 0};
+    int registers = 3;
+};
+
+// Float versions of truncation, min and max with exactly the SIMD instructions' semantics
+static inline float exprTrunc(float x)
+{
+    return std::fabs(x) < 8388608.0f ? static_cast<float>(static_cast<int>(x)) : x;
+}
+static inline float exprMin(float a, float b)
+{
+    return a < b ? a : b;
+}
+static inline float exprMax(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+// Function to evaluate one operation; shared by constant folding and the scalar path
+static float exprScalar(ExprCode code, float a, float b, float c)
+{
+    switch (code)
+    {
+    case ExprCode::Add: return a + b;
+    case ExprCode::Sub: return a - b;
+    case ExprCode::Mul: return a * b;
+    case ExprCode::Div: return b == 0 ? 0.0f : a / b;
+    case ExprCode::Mod: return b == 0 ? 0.0f : a - b * exprTrunc(a / b);
+    case ExprCode::Neg: return -a;
+    case ExprCode::Lt: return a < b ? 1.0f : 0.0f;
+    case ExprCode::Le: return a <= b ? 1.0f : 0.0f;
+    case ExprCode::Gt: return a > b ? 1.0f : 0.0f;
+    case ExprCode::Ge: return a >= b ? 1.0f : 0.0f;
+    case ExprCode::Eq: return a == b ? 1.0f : 0.0f;
+    case ExprCode::Ne: return a != b ? 1.0f : 0.0f;
+    case ExprCode::Min: return exprMin(a, b);
+    case ExprCode::Max: return exprMax(a, b);
+    case ExprCode::Abs: return std::fabs(a);
+    case ExprCode::Select: return a != 0 ? b : c;
+    default: return 0.0f;
+    }
+}
+
+// Recursive-descent compiler from expression text to per-channel bytecode. Operations on
+// constants are folded as they are parsed, so only work that depends on a pixel is emitted.
+struct ExprParser
+{
+    struct Operand
+    {
+        bool constant;
+        float value;
+        int reg;
+        int deps;
+    };
+
+    const std::string &text;
+    size_t pos = 0;
+    Expression &expr;
+    ExprProgram *program = nullptr;
+
+    ExprParser(const std::string &source, Expression &target) : text(source), expr(target) {}
+
+    [[noreturn]] void fail(const std::string &what)
+    {
+        throw std::runtime_error("Invalid expression at column " + std::to_string(pos + 1) + ": " + what);
+    }
+
+    void skipSpace()
+    {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            pos++;
+    }
+
+    bool accept(const char *token)
+    {
+        skipSpace();
+        size_t n = std::strlen(token);
+        if (text.compare(pos, n, token) != 0)
+            return false;
+        pos += n;
+        return true;
+    }
+
+    void expect(const char *token)
+    {
+        if (!accept(token))
+            fail(std::string("expected '") + token + "'");
+    }
+
+    int channelIndex(const std::string &name)
+    {
+        return name == "r" ? 0 : name == "g" ? 1 : name == "b" ? 2 : -1;
+    }
+
+    std::string identifier()
+    {
+        skipSpace();
+        size_t start = pos;
+        while (pos < text.size() && std::isalpha(static_cast<unsigned char>(text[pos])))
+            pos++;
+        return text.substr(start, pos - start);
+    }
+
+    int newRegister()
+    {
+        if (expr.registers >= Expression::kMaxRegisters)
+            fail("expression is too long");
+        return expr.registers++;
+    }
+
+    Operand materialize(const Operand &x)
+    {
+        if (!x.constant)
+            return x;
+        int reg = newRegister();
+        program->code.push_back({ExprCode::Const, static_cast<uint8_t>(reg), 0, 0, 0, x.value});
+        return {false, 0, reg, 0};
+    }
+
+    Operand emit(ExprCode code, Operand a, Operand b = {true, 0, 0, 0}, Operand c = {true, 0, 0, 0})
+    {
+        if (a.constant && b.constant && c.constant)
+            return {true, exprScalar(code, a.value, b.value, c.value), 0, 0};
+        // Only operands the opcode reads get a register; unused fields stay 0
+        int arity = (code == ExprCode::Neg || code == ExprCode::Abs) ? 1 : code == ExprCode::Select ? 3 : 2;
+        a = materialize(a);
+        if (arity >= 2)
+            b = materialize(b);
+        if (arity == 3)
+            c = materialize(c);
+        int reg = newRegister();
+        program->code.push_back({code, static_cast<uint8_t>(reg), static_cast<uint8_t>(a.reg),
+                                 static_cast<uint8_t>(b.reg), static_cast<uint8_t>(c.reg), 0});
+        return {false, 0, reg, a.deps | b.deps | c.deps};
+    }
+
+    Operand primary()
+    {
+        skipSpace();
+        if (pos < text.size() && (std::isdigit(static_cast<unsigned char>(text[pos])) || text[pos] == '.'))
+        {
+            size_t used = 0;
+            float value = 0;
+            try
+            {
+                value = std::stof(text.substr(pos), &used);
+            }
+            catch (const std::exception &)
+            {
+                fail("invalid number");
+            }
+            pos += used;
+            return {true, value, 0, 0};
+        }
+        if (accept("("))
+        {
+            Operand x = conditional();
+            expect(")");
+            return x;
+        }
+        std::string name = identifier();
+        int channel = channelIndex(name);
+        if (channel >= 0)
+            return {false, 0, channel, 1 << channel};
+        if (name == "min" || name == "max" || name == "abs" || name == "clamp")
+        {
+            expect("(");
+            Operand x = conditional();
+            if (name == "abs")
+            {
+                expect(")");
+                return emit(ExprCode::Abs, x);
+            }
+            expect(",");
+            Operand y = conditional();
+            if (name == "clamp")
+            {
+                expect(",");
+                Operand z = conditional();
+                expect(")");
+                return emit(ExprCode::Min, emit(ExprCode::Max, x, y), z);
+            }
+            expect(")");
+            return emit(name == "min" ? ExprCode::Min : ExprCode::Max, x, y);
+        }
+        fail(name.empty() ? "expected a value" : "unknown name '" + name + "'");
+    }
+
+    Operand unary()
+    {
+        if (accept("-"))
+            return emit(ExprCode::Neg, unary());
+        if (accept("+"))
+            return unary();
+        return primary();
+    }
+
+    Operand multiplicative()
+    {
+        Operand x = unary();
+        for (;;)
+        {
+            if (accept("*"))
+                x = emit(ExprCode::Mul, x, unary());
+            else if (accept("/"))
+                x = emit(ExprCode::Div, x, unary());
+            else if (accept("%"))
+                x = emit(ExprCode::Mod, x, unary());
+            else
+                return x;
+        }
+    }
+
+    Operand additive()
+    {
+        Operand x = multiplicative();
+        for (;;)
+        {
+            if (accept("+"))
+                x = emit(ExprCode::Add, x, multiplicative());
+            else if (accept("-"))
+                x = emit(ExprCode::Sub, x, multiplicative());
+            else
+                return x;
+        }
+    }
+
+    Operand comparison()
+    {
+        Operand x = additive();
+        for (;;)
+        {
+            // Two-character operators first so "<=" is not read as "<"
+            if (accept("<="))
+                x = emit(ExprCode::Le, x, additive());
+            else if (accept(">="))
+                x = emit(ExprCode::Ge, x, additive());
+            else if (accept("=="))
+                x = emit(ExprCode::Eq, x, additive());
+            else if (accept("!="))
+                x = emit(ExprCode::Ne, x, additive());
+            else if (accept("<"))
+                x = emit(ExprCode::Lt, x, additive());
+            else if (accept(">"))
+                x = emit(ExprCode::Gt, x, additive());
+            else
+                return x;
+        }
+    }
+
+    Operand conditional()
+    {
+        Operand x = comparison();
+        if (!accept("?"))
+            return x;
+        Operand y = conditional();
+        expect(":");
+        Operand z = conditional();
+        if (x.constant)
+            return x.value != 0 ? y : z;
+        return emit(ExprCode::Select, x, y, z);
+    }
+
+    void parse()
+    {
+        while (skipSpace(), pos < text.size())
+        {
+            if (accept(";"))
+                continue;
+            int channel = channelIndex(identifier());
+            if (channel < 0)
+                fail("expected r, g or b");
+            expect("=");
+            program = &expr.channel[channel];
+            *program = ExprProgram();
+            Operand result = materialize(conditional());
+            program->result = result.reg;
+            program->deps = result.deps;
+            expr.assigned[channel] = true;
+            skipSpace();
+            if (pos < text.size() && text[pos] != ';')
+                fail("expected ';'");
+        }
+    }
+};
+
+// Function to run a channel program over kBatch lanes of the register file
+static const int kExprBatch = 16;
+static void runExprProgram(const ExprProgram &program, float (*regs)[kExprBatch])
+{
+    for (const ExprInstr &op : program.code)
+    {
+        float *d = regs[op.dst];
+        const float *a = regs[op.a], *b = regs[op.b], *c = regs[op.c];
+#if defined(__SSE2__)
+        for (int k = 0; k < kExprBatch; k += 4)
+        {
+            __m128 x = _mm_loadu_ps(a + k), y = _mm_loadu_ps(b + k), z = _mm_loadu_ps(c + k), r;
+            const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+            switch (op.code)
+            {
+            case ExprCode::Const: r = _mm_set1_ps(op.value); break;
+            case ExprCode::Add: r = _mm_add_ps(x, y); break;
+            case ExprCode::Sub: r = _mm_sub_ps(x, y); break;
+            case ExprCode::Mul: r = _mm_mul_ps(x, y); break;
+            case ExprCode::Div:
+            case ExprCode::Mod:
+            {
+                __m128 nonzero = _mm_cmpneq_ps(y, zero);
+                r = _mm_and_ps(nonzero, _mm_div_ps(x, _mm_or_ps(y, _mm_andnot_ps(nonzero, one))));
+                if (op.code == ExprCode::Mod)
+                {
+                    // Truncate the quotient where it fits an int, as exprTrunc does
+                    __m128 small = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), r), _mm_set1_ps(8388608.0f));
+                    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(r));
+                    t = _mm_or_ps(_mm_and_ps(small, t), _mm_andnot_ps(small, r));
+                    r = _mm_and_ps(nonzero, _mm_sub_ps(x, _mm_mul_ps(y, t)));
+                }
+                break;
+            }
+            case ExprCode::Neg: r = _mm_sub_ps(zero, x); break;
+            case ExprCode::Lt: r = _mm_and_ps(_mm_cmplt_ps(x, y), one); break;
+            case ExprCode::Le: r = _mm_and_ps(_mm_cmple_ps(x, y), one); break;
+            case ExprCode::Gt: r = _mm_and_ps(_mm_cmpgt_ps(x, y), one); break;
+            case ExprCode::Ge: r = _mm_and_ps(_mm_cmpge_ps(x, y), one); break;
+            case ExprCode::Eq: r = _mm_and_ps(_mm_cmpeq_ps(x, y), one); break;
+            case ExprCode::Ne: r = _mm_and_ps(_mm_cmpneq_ps(x, y), one); break;
+            case ExprCode::Min: r = _mm_min_ps(x, y); break;
+            case ExprCode::Max: r = _mm_max_ps(x, y); break;
+            case ExprCode::Abs: r = _mm_andnot_ps(_mm_set1_ps(-0.0f), x); break;
+            case ExprCode::Select:
+            {
+                __m128 m = _mm_cmpneq_ps(x, zero);
+                r = _mm_or_ps(_mm_and_ps(m, y), _mm_andnot_ps(m, z));
+                break;
+            }
+            default: r = zero; break;
+            }
+            _mm_storeu_ps(d + k, r);
+        }
+#else
+        for (int k = 0; k < kExprBatch; ++k)
+            d[k] = (op.code == ExprCode::Const) ? op.value : exprScalar(op.code, a[k], b[k], c[k]);
+#endif
+    }
+}
+
+// Function to parse an expression and prepare it for applyExpression: channels that
+// depend on one input (or none) become 256-entry tables, the rest keep their bytecode
+Expression compileExpression(const std::string &text)
+{
+    Expression expr;
+    ExprParser(text, expr).parse();
+    if (!expr.assigned[0] && !expr.assigned[1] && !expr.assigned[2])
+        throw std::runtime_error("Expression assigns no channel: " + text);
+
+    float regs[Expression::kMaxRegisters][kExprBatch] = {};
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        const ExprProgram &program = expr.channel[ch];
+        if (!expr.assigned[ch] || (program.deps & (program.deps - 1)) != 0)
+            continue;
+        int source = program.deps ? __builtin_ctz(program.deps) : 0;
+        expr.lutSource[ch] = source;
+        expr.lut[ch].resize(256);
+        for (int v0 = 0; v0 < 256; v0 += kExprBatch)
+        {
+            for (int k = 0; k < kExprBatch; ++k)
+                regs[source][k] = static_cast<float>(v0 + k);
+            runExprProgram(program, regs);
+            for (int k = 0; k < kExprBatch; ++k)
+                expr.lut[ch][v0 + k] = static_cast<unsigned char>(exprMax(exprMin(regs[program.result][k], 255.0f), 0.0f));
+        }
+    }
+    return expr;
+}
+
+// Function to apply a compiled expression to one row. Pixels go through in batches of
+// kExprBatch: table channels are looked up, the others run their bytecode on SIMD lanes.
+void expressionRow(const Expression &expr, unsigned char *row, int width)
+{
+    bool bytecode = false;
+    for (int ch = 0; ch < 3; ++ch)
+        bytecode |= expr.assigned[ch] && expr.lut[ch].empty();
+
+    float regs[Expression::kMaxRegisters][kExprBatch];
+    unsigned char result[3][kExprBatch];
+    for (int j0 = 0; j0 < width; j0 += kExprBatch)
+    {
+        int n = std::min(kExprBatch, width - j0);
+        unsigned char *px = row + j0 * 3;
+        if (bytecode)
+        {
+            for (int k = 0; k < kExprBatch; ++k)
+            {
+                int p = std::min(k, n - 1) * 3;  // the tail repeats the last pixel
+                regs[0][k] = px[p];
+                regs[1][k] = px[p + 1];
+                regs[2][k] = px[p + 2];
+            }
+        }
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            if (!expr.assigned[ch])
+            {
+                for (int k = 0; k < n; ++k)
+                    result[ch][k] = px[k * 3 + ch];
+            }
+            else if (!expr.lut[ch].empty())
+            {
+                const unsigned char *lut = expr.lut[ch].data();
+                for (int k = 0; k < n; ++k)
+                    result[ch][k] = lut[px[k * 3 + expr.lutSource[ch]]];
+            }
+            else
+            {
+                runExprProgram(expr.channel[ch], regs);
+                const float *out = regs[expr.channel[ch].result];
+#if defined(__SSE2__)
+                unsigned char packed[kExprBatch];
+                for (int k = 0; k < kExprBatch; k += 8)
+                {
+                    const __m128 hi = _mm_set1_ps(255.0f), lo = _mm_setzero_ps();
+                    __m128i a = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(out + k), hi), lo));
+                    __m128i b = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(out + k + 4), hi), lo));
+                    __m128i words = _mm_packs_epi32(a, b);
+                    _mm_storel_epi64(reinterpret_cast<__m128i *>(packed + k), _mm_packus_epi16(words, words));
+                }
+                std::memcpy(result[ch], packed, n);
+#else
+                for (int k = 0; k < n; ++k)
+                    result[ch][k] = static_cast<unsigned char>(exprMax(exprMin(out[k], 255.0f), 0.0f));
+#endif
+            }
+        }
+        for (int k = 0; k < n; ++k)
+        {
+            px[k * 3] = result[0][k];
+            px[k * 3 + 1] = result[1][k];
+            px[k * 3 + 2] = result[2][k];
+        }
+    }
+}
+
+// Function to apply a compiled expression to every pixel
+void applyExpression(std::vector<std::vector<RGB>> &image, const Expression &expr)
+{
+    parallelRows(image.size(), [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            expressionRow(expr, reinterpret_cast<unsigned char *>(image[i].data()), image[i].size());
+        }
+    });
+}
+
+// 3x3 color matrix with offsets: out[c] = m[c][0] r + m[c][1] g + m[c][2] b + offset[c]
+struct ColorMatrix
+{
+    float m[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    float offset[3] = {0, 0, 0};
+};
+
+// Function to build a color matrix from a preset name or from 9 (or 12, with offsets)
+// comma-separated numbers in row order. Presets: identity, sepia, luma, red/green/blue
+// (that channel as gray) and the swizzles rbg, grb, gbr, brg and bgr (output channel order).
+ColorMatrix parseColorMatrix(const std::string &spec)
+{
+    ColorMatrix cm;
+    auto fill = [&cm](const float (&rows)[3][3])
+    {
+        for (int c = 0; c < 3; ++c)
+            for (int k = 0; k < 3; ++k)
+                cm.m[c][k] = rows[c][k];
+    };
+    if (spec == "identity")
+        return cm;
+    if (spec == "sepia")
+    {
+        fill({{0.393f, 0.769f, 0.189f}, {0.349f, 0.686f, 0.168f}, {0.272f, 0.534f, 0.131f}});
+        return cm;
+    }
+    if (spec == "luma")
+    {
+        fill({{0.299f, 0.587f, 0.114f}, {0.299f, 0.587f, 0.114f}, {0.299f, 0.587f, 0.114f}});
+        return cm;
+    }
+    const std::string channels = "rgb";
+    const char *extract[] = {"red", "green", "blue"};
+    for (int k = 0; k < 3; ++k)
+    {
+        if (spec == extract[k])
+        {
+            for (int c = 0; c < 3; ++c)
+                for (int j = 0; j < 3; ++j)
+                    cm.m[c][j] = (j == k) ? 1.0f : 0.0f;
+            return cm;
+        }
+    }
+    std::string sorted = spec;
+    std::sort(sorted.begin(), sorted.end());
+    if (spec.size() == 3 && sorted == "bgr")
+    {
+        for (int c = 0; c < 3; ++c)
+            for (int j = 0; j < 3; ++j)
+                cm.m[c][j] = (channels[j] == spec[c]) ? 1.0f : 0.0f;
+        return cm;
+    }
+
+    std::vector<float> values;
+    std::stringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ','))
+    {
+        try
+        {
+            values.push_back(std::stof(item));
+        }
+        catch (const std::exception &)
+        {
+            throw std::runtime_error("Unknown color matrix: " + spec);
+        }
+    }
+    if (values.size() != 9 && values.size() != 12)
+        throw std::runtime_error("Color matrix needs a preset or 9 or 12 numbers: " + spec);
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int k = 0; k < 3; ++k)
+            cm.m[c][k] = values[c * 3 + k];
+        if (values.size() == 12)
+            cm.offset[c] = values[9 + c];
+    }
+    return cm;
+}
+
+// Color matrix ready to apply. Coefficients are Q12 int16 (|m| < 8); the offset, with the
+// rounding half, is stored divided by 64 so it pairs with a constant 64 lane in pmaddwd.
+// When every output channel is a copy of an input channel or zero, shuffle[c] holds that
+// input (-1 for zero) and the matrix is applied as a byte shuffle.
+struct PreparedMatrix
+{
+    int16_t coef[3][4];
+    int shuffle[3];
+    bool isShuffle = true;
+};
+
+PreparedMatrix prepareColorMatrix(const ColorMatrix &cm)
+{
+    PreparedMatrix pm;
+    for (int c = 0; c < 3; ++c)
+    {
+        int nonzero = 0, source = -1;
+        for (int k = 0; k < 3; ++k)
+        {
+            // The bound is checked on the rounded Q12 value: just below 8 can still round to 32768
+            long q = std::fabs(cm.m[c][k]) < 8.0f ? std::lround(cm.m[c][k] * 4096) : 32768;
+            if (q < -32768 || q > 32767)
+                throw std::runtime_error("Color matrix coefficients must be below 8 in magnitude");
+            pm.coef[c][k] = static_cast<int16_t>(q);
+            if (cm.m[c][k] != 0)
+            {
+                nonzero++;
+                source = k;
+            }
+        }
+        if (std::fabs(cm.offset[c]) >= 511.0f)
+            throw std::runtime_error("Color matrix offsets must be below 511 in magnitude");
+        pm.coef[c][3] = static_cast<int16_t>(std::lround(cm.offset[c] * 64 + 32));
+        bool copy = nonzero == 1 && cm.m[c][source] == 1.0f;
+        pm.shuffle[c] = copy ? source : -1;
+        pm.isShuffle &= cm.offset[c] == 0 && (copy || nonzero == 0);
+    }
+    return pm;
+}
+
+// Function to apply a prepared color matrix to one row
+void matrixRow(const PreparedMatrix &pm, unsigned char *row, int width)
+{
+    if (pm.isShuffle)
+    {
+        for (int j = 0; j < width; ++j)
+        {
+            unsigned char *px = row + j * 3;
+            unsigned char in[4] = {px[0], px[1], px[2], 0};
+            for (int c = 0; c < 3; ++c)
+                px[c] = in[pm.shuffle[c] < 0 ? 3 : pm.shuffle[c]];
+        }
+        return;
+    }
+
+    int j = 0;
+#if defined(__SSE2__)
+    alignas(16) int16_t planes[3][8];
+    alignas(16) unsigned char out[3][16];
+    __m128i pairRG[3], pairB1[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        pairRG[c] = _mm_set1_epi32((static_cast<uint16_t>(pm.coef[c][1]) << 16) | static_cast<uint16_t>(pm.coef[c][0]));
+        pairB1[c] = _mm_set1_epi32((static_cast<uint16_t>(pm.coef[c][3]) << 16) | static_cast<uint16_t>(pm.coef[c][2]));
+    }
+    const __m128i sixtyFour = _mm_set1_epi16(64);
+    for (; j + 8 <= width; j += 8)
+    {
+        unsigned char *px = row + j * 3;
+        for (int k = 0; k < 8; ++k)
+        {
+            planes[0][k] = px[k * 3];
+            planes[1][k] = px[k * 3 + 1];
+            planes[2][k] = px[k * 3 + 2];
+        }
+        __m128i r = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[0]));
+        __m128i g = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[1]));
+        __m128i b = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[2]));
+        __m128i rgLo = _mm_unpacklo_epi16(r, g), rgHi = _mm_unpackhi_epi16(r, g);
+        __m128i b1Lo = _mm_unpacklo_epi16(b, sixtyFour), b1Hi = _mm_unpackhi_epi16(b, sixtyFour);
+        for (int c = 0; c < 3; ++c)
+        {
+            __m128i lo = _mm_add_epi32(_mm_madd_epi16(rgLo, pairRG[c]), _mm_madd_epi16(b1Lo, pairB1[c]));
+            __m128i hi = _mm_add_epi32(_mm_madd_epi16(rgHi, pairRG[c]), _mm_madd_epi16(b1Hi, pairB1[c]));
+            __m128i words = _mm_packs_epi32(_mm_srai_epi32(lo, 12), _mm_srai_epi32(hi, 12));
+            _mm_store_si128(reinterpret_cast<__m128i *>(out[c]), _mm_packus_epi16(words, words));
+        }
+        for (int k = 0; k < 8; ++k)
+        {
+            px[k * 3] = out[0][k];
+            px[k * 3 + 1] = out[1][k];
+            px[k * 3 + 2] = out[2][k];
+        }
+    }
+#endif
+    for (; j < width; ++j)
+    {
+        unsigned char *px = row + j * 3;
+        int in[3] = {px[0], px[1], px[2]};
+        for (int c = 0; c < 3; ++c)
+        {
+            int acc = in[0] * pm.coef[c][0] + in[1] * pm.coef[c][1] + in[2] * pm.coef[c][2] + 64 * pm.coef[c][3];
+            px[c] = static_cast<unsigned char>(std::min(255, std::max(0, acc >> 12)));
+        }
+    }
+}
+
+// Function to apply a 3x3 color matrix (plus offsets) to every pixel
+void colorMatrix(std::vector<std::vector<RGB>> &image, const ColorMatrix &cm)
+{
+    PreparedMatrix pm = prepareColorMatrix(cm);
+    parallelRows(image.size(), [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            matrixRow(pm, reinterpret_cast<unsigned char *>(image[i].data()), image[i].size());
+        }
+    });
+}
+
+// Function to check for the point operators that applyPointChain can fuse
+bool isPointOption(const std::string &option)
+{
+    return option == "-g" || option == "-i" || option == "-x" || option == "-e" || option == "--matrix";
+}
+
+// Function to apply a run of point operators in a single pass: each row goes through every
+// operator in turn while it is still in cache, instead of the image being streamed through
+// memory once per operator. Every step is the same row kernel the operator uses alone, so
+// the result is identical to applying them one after another.
+void applyPointChain(std::vector<std::vector<RGB>> &image, const std::vector<Option> &chain)
+{
+    std::vector<std::function<void(RGB *, int)>> steps;
+    for (const auto &opt : chain)
+    {
+        if (opt.name == "-g")
+            steps.push_back(grayscaleRow);
+        else if (opt.name == "-i")
+            steps.push_back(invertRow);
+        else if (opt.name == "-x")
+            steps.push_back([](RGB *row, int width) { contrastRow(row, width, 1.2f); });
+        else if (opt.name == "-e")
+        {
+            auto expr = std::make_shared<Expression>(compileExpression(opt.value));
+            steps.push_back([expr](RGB *row, int width)
+            {
+                expressionRow(*expr, reinterpret_cast<unsigned char *>(row), width);
+            });
+        }
+        else if (opt.name == "--matrix")
+        {
+            PreparedMatrix pm = prepareColorMatrix(parseColorMatrix(opt.value));
+            steps.push_back([pm](RGB *row, int width)
+            {
+                matrixRow(pm, reinterpret_cast<unsigned char *>(row), width);
+            });
+        }
+        else
+            throw std::runtime_error("Not a point operator: " + opt.name);
+    }
+
+    parallelRows(image.size(), [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            for (const auto &step : steps)
+                step(image[i].data(), image[i].size());
+        }
+    });
+}
+
+// 3D color lookup table. Lattice points are stored as (r, g, b, 0) in Q15 fixed point
+// so a single 64-bit load fetches a whole point and one SIMD lerp covers all channels.
+struct Lut3D
+{
+    int size = 0;
+    std::vector<int16_t> table;          // size^3 points, red varying fastest
+    int index[256];                      // lattice cell of each 8-bit input value
+    int16_t frac[256];                   // Q15 position of the value inside its cell
+    bool tetrahedral = false;
+    std::vector<unsigned char> baked;    // optional 256^3 RGB cache for 8-bit input
+};
+
+// Function to load a 3D LUT in .cube format (e.g. a 33^3 grading LUT)
+Lut3D loadCubeLUT(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open LUT file: " + filename);
+    }
+
+    Lut3D lut;
+    std::vector<float> values;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream iss(line);
+        std::string key;
+        if (!(iss >> key) || key[0] == '#')
+            continue;
+
+        if (key == "TITLE")
+            continue;
+        if (key == "LUT_3D_SIZE")
+        {
+            iss >> lut.size;
+            if (lut.size < 2 || lut.size > 256)
+                throw std::runtime_error("Unsupported LUT_3D_SIZE in " + filename);
+            continue;
+        }
+        if (key == "LUT_1D_SIZE")
+            throw std::runtime_error("1D LUTs are not supported: " + filename);
+        if (key == "DOMAIN_MIN" || key == "DOMAIN_MAX")
+        {
+            float a, b, c;
+            iss >> a >> b >> c;
+            float expected = (key == "DOMAIN_MIN") ? 0.0f : 1.0f;
+            if (a != expected || b != expected || c != expected)
+                throw std::runtime_error("Only the default [0, 1] LUT domain is supported: " + filename);
+            continue;
+        }
+
+        // Anything else must be a data line of three floats
+        std::istringstream data(line);
+        float r, g, b;
+        if (!(data >> r >> g >> b))
+            throw std::runtime_error("Invalid LUT line in " + filename + ": " + line);
+        values.push_back(r);
+        values.push_back(g);
+        values.push_back(b);
+    }
+
+    if (lut.size == 0)
+        throw std::runtime_error("Missing LUT_3D_SIZE in " + filename);
+    size_t points = static_cast<size_t>(lut.size) * lut.size * lut.size;
+    if (values.size() != points * 3)
+    {
+        throw std::runtime_error("LUT " + filename + " has " + std::to_string(values.size() / 3) +
+                                 " entries, expected " + std::to_string(points));
+    }
+
+    lut.table.resize(points * 4);
+    for (size_t i = 0; i < points; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            float v = std::min(1.0f, std::max(0.0f, values[i * 3 + c]));
+            lut.table[i * 4 + c] = static_cast<int16_t>(std::lround(v * 32767.0f));
+        }
+        lut.table[i * 4 + 3] = 0;
+    }
+
+    // Every axis has the same spacing, so one table maps 0..255 to (cell, fraction)
+    for (int v = 0; v < 256; ++v)
+    {
+        int pos = v * (lut.size - 1);
+        lut.index[v] = std::min(pos / 255, lut.size - 2);
+        // v == 255 sits at the far end of the last cell; clamp so it stays a valid Q15 value
+        lut.frac[v] = static_cast<int16_t>(std::min(32767, ((pos - lut.index[v] * 255) << 15) / 255));
+    }
+
+    std::cout << "Loaded " << lut.size << "^3 LUT: " << filename << "\n";
+    return lut;
+}
+
+// Fixed-point helpers shared by the scalar and SIMD LUT paths. Both compute
+// a + 2 * ((b - a) * f >> 16) so the two paths produce identical output.
+static inline int lutLerp(int a, int b, int f)
+{
+    return a + (((b - a) * f) >> 16) * 2;
+}
+
+static inline unsigned char lutToByte(int v)
+{
+    v = std::max(0, v);
+    return static_cast<unsigned char>(std::min(255, ((v + 64) * 510) >> 16));
+}
+
+// Function to fetch the 8 lattice corners around an input pixel (c[bit0 = r, bit1 = g, bit2 = b])
+static inline void lutCorners(const Lut3D &lut, const unsigned char *px, const int16_t *c[8])
+{
+    int n = lut.size;
+    const int16_t *base = lut.table.data() +
+                          4 * (lut.index[px[0]] + n * (lut.index[px[1]] + n * lut.index[px[2]]));
+    int dr = 4, dg = 4 * n, db = 4 * n * n;
+    for (int k = 0; k < 8; ++k)
+    {
+        c[k] = base + ((k & 1) ? dr : 0) + ((k & 2) ? dg : 0) + ((k & 4) ? db : 0);
+    }
+}
+
+// Function to order the tetrahedron of a pixel: returns the two intermediate corners
+// and the fractions sorted from largest to smallest.
+static inline void lutTetrahedron(const Lut3D &lut, const unsigned char *px, int &k1, int &k2, int f[3])
+{
+    int fr = lut.frac[px[0]], fg = lut.frac[px[1]], fb = lut.frac[px[2]];
+    if (fr >= fg && fg >= fb)      { k1 = 1; k2 = 3; f[0] = fr; f[1] = fg; f[2] = fb; }
+    else if (fr >= fb && fb >= fg) { k1 = 1; k2 = 5; f[0] = fr; f[1] = fb; f[2] = fg; }
+    else if (fb >= fr && fr >= fg) { k1 = 4; k2 = 5; f[0] = fb; f[1] = fr; f[2] = fg; }
+    else if (fg >= fr && fr >= fb) { k1 = 2; k2 = 3; f[0] = fg; f[1] = fr; f[2] = fb; }
+    else if (fg >= fb && fb >= fr) { k1 = 2; k2 = 6; f[0] = fg; f[1] = fb; f[2] = fr; }
+    else                           { k1 = 4; k2 = 6; f[0] = fb; f[1] = fg; f[2] = fr; }
+}
+
+// Function to grade one pixel without SIMD (also used for odd tail pixels)
+static void lutPixel(const Lut3D &lut, const unsigned char *in, unsigned char *out)
+{
+    const int16_t *c[8];
+    lutCorners(lut, in, c);
+    int result[3];
+    if (lut.tetrahedral)
+    {
+        int k1, k2, f[3];
+        lutTetrahedron(lut, in, k1, k2, f);
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            int v0 = c[0][ch], v1 = c[k1][ch], v2 = c[k2][ch], v3 = c[7][ch];
+            result[ch] = v0 + (((v1 - v0) * f[0]) >> 16) * 2 + (((v2 - v1) * f[1]) >> 16) * 2 +
+                         (((v3 - v2) * f[2]) >> 16) * 2;
+        }
+    }
+    else
+    {
+        int fr = lut.frac[in[0]], fg = lut.frac[in[1]], fb = lut.frac[in[2]];
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            int c00 = lutLerp(c[0][ch], c[1][ch], fr);
+            int c10 = lutLerp(c[2][ch], c[3][ch], fr);
+            int c01 = lutLerp(c[4][ch], c[5][ch], fr);
+            int c11 = lutLerp(c[6][ch], c[7][ch], fr);
+            result[ch] = lutLerp(lutLerp(c00, c10, fg), lutLerp(c01, c11, fg), fb);
+        }
+    }
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        out[ch] = lutToByte(result[ch]);
+    }
+}
+
+#if defined(__SSE2__)
+// Load the lattice points of two pixels into the low and high halves of one register
+static inline __m128i lutLoad2(const int16_t *p0, const int16_t *p1)
+{
+    return _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p0)),
+                              _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p1)));
+}
+
+static inline __m128i lutLerp2(__m128i a, __m128i b, __m128i f)
+{
+    return _mm_add_epi16(a, _mm_slli_epi16(_mm_mulhi_epi16(_mm_sub_epi16(b, a), f), 1));
+}
+
+static inline __m128i lutFrac2(int f0, int f1)
+{
+    return _mm_unpacklo_epi64(_mm_set1_epi16(static_cast<short>(f0)), _mm_set1_epi16(static_cast<short>(f1)));
+}
+#endif
+
+// Function to grade one row of pixels (in and out may be the same buffer)
+void lutRow(const Lut3D &lut, const unsigned char *in, unsigned char *out, int width)
+{
+    int j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 2 <= width; j += 2)
+    {
+        const unsigned char *p0 = in + j * 3, *p1 = p0 + 3;
+        const int16_t *a[8], *b[8];
+        lutCorners(lut, p0, a);
+        lutCorners(lut, p1, b);
+
+        __m128i v;
+        if (lut.tetrahedral)
+        {
+            int ka1, ka2, fa[3], kb1, kb2, fb[3];
+            lutTetrahedron(lut, p0, ka1, ka2, fa);
+            lutTetrahedron(lut, p1, kb1, kb2, fb);
+            __m128i v0 = lutLoad2(a[0], b[0]);
+            __m128i v1 = lutLoad2(a[ka1], b[kb1]);
+            __m128i v2 = lutLoad2(a[ka2], b[kb2]);
+            __m128i v3 = lutLoad2(a[7], b[7]);
+            v = _mm_add_epi16(v0, _mm_slli_epi16(_mm_mulhi_epi16(_mm_sub_epi16(v1, v0), lutFrac2(fa[0], fb[0])), 1));
+            v = _mm_add_epi16(v, _mm_slli_epi16(_mm_mulhi_epi16(_mm_sub_epi16(v2, v1), lutFrac2(fa[1], fb[1])), 1));
+            v = _mm_add_epi16(v, _mm_slli_epi16(_mm_mulhi_epi16(_mm_sub_epi16(v3, v2), lutFrac2(fa[2], fb[2])), 1));
+        }
+        else
+        {
+            __m128i fr = lutFrac2(lut.frac[p0[0]], lut.frac[p1[0]]);
+            __m128i fg = lutFrac2(lut.frac[p0[1]], lut.frac[p1[1]]);
+            __m128i fb = lutFrac2(lut.frac[p0[2]], lut.frac[p1[2]]);
+            __m128i c00 = lutLerp2(lutLoad2(a[0], b[0]), lutLoad2(a[1], b[1]), fr);
+            __m128i c10 = lutLerp2(lutLoad2(a[2], b[2]), lutLoad2(a[3], b[3]), fr);
+            __m128i c01 = lutLerp2(lutLoad2(a[4], b[4]), lutLoad2(a[5], b[5]), fr);
+            __m128i c11 = lutLerp2(lutLoad2(a[6], b[6]), lutLoad2(a[7], b[7]), fr);
+            v = lutLerp2(lutLerp2(c00, c10, fg), lutLerp2(c01, c11, fg), fb);
+        }
+
+        // Q15 -> 8 bit, matching lutToByte
+        v = _mm_max_epi16(v, zero);
+        v = _mm_mulhi_epu16(_mm_add_epi16(v, _mm_set1_epi16(64)), _mm_set1_epi16(510));
+        alignas(16) unsigned char bytes[16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(bytes), _mm_packus_epi16(v, zero));
+        unsigned char *o = out + j * 3;
+        o[0] = bytes[0]; o[1] = bytes[1]; o[2] = bytes[2];
+        o[3] = bytes[4]; o[4] = bytes[5]; o[5] = bytes[6];
+    }
+#endif
+    for (; j < width; ++j)
+    {
+        lutPixel(lut, in + j * 3, out + j * 3);
+    }
+}
+
+// Function to bake the LUT for every 8-bit input so grading becomes a single lookup
+void bakeLUT(Lut3D &lut)
+{
+    lut.baked.resize(256 * 256 * 256 * 3);
+    parallelRows(256 * 256, [&](int first, int last)
+    {
+        // Each "row" is one (g, b) pair with red running 0..255
+        unsigned char row[256 * 3];
+        for (int gb = first; gb < last; ++gb)
+        {
+            for (int r = 0; r < 256; ++r)
+            {
+                row[r * 3] = static_cast<unsigned char>(r);
+                row[r * 3 + 1] = static_cast<unsigned char>(gb & 255);
+                row[r * 3 + 2] = static_cast<unsigned char>(gb >> 8);
+            }
+            lutRow(lut, row, lut.baked.data() + static_cast<size_t>(gb) * 256 * 3, 256);
+        }
+    });
+    std::cout << "Baked LUT cache (" << lut.baked.size() / (1024 * 1024) << " MiB)\n";
+}
+
+// Function to apply a 3D LUT with trilinear or tetrahedral interpolation
+void applyLUT(std::vector<std::vector<RGB>> &image, const Lut3D &lut)
+{
+    int height = image.size();
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            unsigned char *row = reinterpret_cast<unsigned char *>(image[i].data());
+            int width = image[i].size();
+            if (!lut.baked.empty())
+            {
+                const unsigned char *cache = lut.baked.data();
+                for (int j = 0; j < width * 3; j += 3)
+                {
+                    const unsigned char *hit = cache + ((static_cast<size_t>(row[j + 2]) << 16) |
+                                                        (row[j + 1] << 8) | row[j]) * 3;
+                    row[j] = hit[0];
+                    row[j + 1] = hit[1];
+                    row[j + 2] = hit[2];
+                }
+            }
+            else
+            {
+                lutRow(lut, row, row, width);
+            }
+        }
+    });
+}
+
+// Function to combine two byte rows with a per-byte max (dilate) or min (erode)
+static void minMaxBytes(const unsigned char *a, const unsigned char *b, unsigned char *out, size_t n, bool isMax)
+{
+    size_t k = 0;
+#if defined(__SSE2__)
+    for (; k + 16 <= n; k += 16)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + k));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + k), isMax ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb));
+    }
+#endif
+    for (; k < n; ++k)
+    {
+        out[k] = isMax ? std::max(a[k], b[k]) : std::min(a[k], b[k]);
+    }
+}
+
+// Function to run the van Herk/Gil-Werman filter along one row of RGB pixels.
+// The padded row is cut into blocks of k = before + after + 1 pixels; a prefix and a
+// suffix min/max inside each block give any window as min(suffix[x], prefix[x + k - 1]),
+// i.e. about three comparisons per value whatever the window size.
+static void morphRowH(const unsigned char *in, unsigned char *out, int width, int before, int after, bool isMax,
+                      std::vector<unsigned char> &prefix, std::vector<unsigned char> &suffix)
+{
+    int k = before + after + 1;
+    int n = width + k - 1;
+    unsigned char identity = isMax ? 0 : 255;
+    prefix.resize(n * 3);
+    suffix.resize(n * 3);
+
+    unsigned char *g = prefix.data(), *h = suffix.data();
+    std::memset(h, identity, before * 3);
+    std::memcpy(h + before * 3, in, width * 3);
+    std::memset(h + (before + width) * 3, identity, after * 3);
+
+    for (int x = 0, pos = 0; x < n; ++x, pos = (pos + 1 == k) ? 0 : pos + 1)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned char v = h[x * 3 + c];
+            g[x * 3 + c] = (pos == 0) ? v : (isMax ? std::max(g[(x - 1) * 3 + c], v) : std::min(g[(x - 1) * 3 + c], v));
+        }
+    }
+    for (int x = n - 2; x >= 0; --x)
+    {
+        if ((x + 1) % k == 0)
+            continue;
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned char v = h[x * 3 + c], w = h[(x + 1) * 3 + c];
+            h[x * 3 + c] = isMax ? std::max(v, w) : std::min(v, w);
+        }
+    }
+    minMaxBytes(h, g + (k - 1) * 3, out, static_cast<size_t>(width) * 3, isMax);
+}
+
+// Function to erode (min) or dilate (max) the output rows [y0, y1) with a w x h rectangle.
+// rowAt(i) returns input row i; only rows inside [0, height) that the band needs are requested.
+// Rows are processed as whole vectors in the vertical pass, so it is fully SIMD.
+static void morphBand(const std::function<const unsigned char *(int)> &rowAt, int height, int width,
+                      int y0, int y1, int w, int h, bool isMax, unsigned char *out)
+{
+    // Dilation uses the reflected structuring element so that open/close stay idempotent
+    int left = isMax ? w / 2 : (w - 1) / 2, right = w - 1 - left;
+    int top = isMax ? h / 2 : (h - 1) / 2;
+
+    size_t rowBytes = static_cast<size_t>(width) * 3;
+    int n = (y1 - y0) + h - 1;
+    std::vector<unsigned char> suffix(n * rowBytes), prefix(n * rowBytes);
+    std::vector<unsigned char> scratchG, scratchH;
+
+    // Horizontal pass for every row the band touches; rows outside the image are the identity
+    for (int t = 0; t < n; ++t)
+    {
+        int src = y0 - top + t;
+        unsigned char *dst = suffix.data() + t * rowBytes;
+        if (src < 0 || src >= height)
+            std::memset(dst, isMax ? 0 : 255, rowBytes);
+        else if (w == 1)
+            std::memcpy(dst, rowAt(src), rowBytes);
+        else
+            morphRowH(rowAt(src), dst, width, left, right, isMax, scratchG, scratchH);
+    }
+
+    // Vertical pass: the same block prefix/suffix scheme with whole rows as the elements
+    for (int t = 0; t < n; ++t)
+    {
+        unsigned char *g = prefix.data() + t * rowBytes;
+        const unsigned char *s = suffix.data() + t * rowBytes;
+        if (t % h == 0)
+            std::memcpy(g, s, rowBytes);
+        else
+            minMaxBytes(g - rowBytes, s, g, rowBytes, isMax);
+    }
+    for (int t = n - 2; t >= 0; --t)
+    {
+        if ((t + 1) % h == 0)
+            continue;
+        unsigned char *s = suffix.data() + t * rowBytes;
+        minMaxBytes(s, s + rowBytes, s, rowBytes, isMax);
+    }
+    for (int o = 0; o < y1 - y0; ++o)
+    {
+        minMaxBytes(suffix.data() + o * rowBytes, prefix.data() + (o + h - 1) * rowBytes, out + o * rowBytes,
+                    rowBytes, isMax);
+    }
+}
+
+// Function to apply erode, dilate, open or close with a w x h rectangular structuring element.
+// Open and close are composed per band: each band erodes (or dilates) just the rows its
+// second step needs, so no full-size intermediate image is ever allocated.
+void morphology(std::vector<std::vector<RGB>> &image, const std::string &op, int w, int h)
+{
+    int height = image.size();
+    int width = image[0].size();
+    size_t rowBytes = static_cast<size_t>(width) * 3;
+    bool composed = (op == "open" || op == "close");
+    bool firstIsMax = (op == "dilate" || op == "close");
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    auto imageRow = [&](int i) { return reinterpret_cast<const unsigned char *>(image[i].data()); };
+
+    // Bands shorter than the element would mostly be halo, so grow them with it
+    parallelRows(height, [&](int y0, int y1)
+    {
+        std::vector<unsigned char> band((y1 - y0) * rowBytes);
+        if (!composed)
+        {
+            morphBand(imageRow, height, width, y0, y1, w, h, firstIsMax, band.data());
+        }
+        else
+        {
+            // Rows the second step reads, clipped to the image
+            int top = !firstIsMax ? h / 2 : (h - 1) / 2, bottom = h - 1 - top;
+            int e0 = std::max(0, y0 - top), e1 = std::min(height, y1 + bottom);
+            std::vector<unsigned char> first((e1 - e0) * rowBytes);
+            morphBand(imageRow, height, width, e0, e1, w, h, firstIsMax, first.data());
+            morphBand([&](int i) { return first.data() + (i - e0) * rowBytes; }, height, width, y0, y1, w, h,
+                      !firstIsMax, band.data());
+        }
+        for (int i = y0; i < y1; ++i)
+        {
+            std::memcpy(result[i].data(), band.data() + (i - y0) * rowBytes, rowBytes);
+        }
+    }, std::max(defaultBandRows(), 2 * h));
+
+    image.swap(result);
+}
+
+// Function to parse a structuring element size given as "WxH" or a single "N"
+void parseSize(const std::string &value, int &w, int &h)
+{
+    size_t x = value.find('x');
+    // Each side must be a whole number; "3x" or "3x4y" are errors, not 3 or 3x4
+    auto side = [&](const std::string &text)
+    {
+        size_t used = 0;
+        int n = 0;
+        try
+        {
+            n = std::stoi(text, &used);
+        }
+        catch (const std::exception &)
+        {
+            used = 0;
+        }
+        if (used == 0 || used != text.size())
+            throw std::runtime_error("Invalid size: " + value);
+        return n;
+    };
+    w = side(value.substr(0, x));
+    h = (x == std::string::npos) ? w : side(value.substr(x + 1));
+    if (w < 1 || h < 1)
+        throw std::runtime_error("Invalid size: " + value);
+}
+
+// Non-local means denoising. Every pixel becomes a weighted mean of the pixels in its
+// (2 * search + 1)^2 neighbourhood, weighted by how alike the (2 * patch + 1)^2 patches
+// around the two pixels are. The work is organised per offset rather than per pixel: for
+// one offset (dy, dx) the squared differences between the image and its shifted copy form
+// a plane whose box sums are the patch distances, so each distance costs a few adds
+// however large the patch is.
+struct NlmParams
+{
+    int patch = 1;
+    int search = 5;
+    float strength = 10.0f;  // h: patches whose mean squared difference is h^2 get weight 1/e
+};
+
+// Function to parse "patch:search[:strength]"
+NlmParams parseNlm(const std::string &value)
+{
+    NlmParams params;
+    size_t first = value.find(':');
+    if (first == std::string::npos)
+        throw std::runtime_error("Invalid non-local means parameters (want patch:search[:strength]): " + value);
+    size_t second = value.find(':', first + 1);
+    params.patch = std::stoi(value.substr(0, first));
+    params.search = std::stoi(value.substr(first + 1, second == std::string::npos ? std::string::npos : second - first - 1));
+    if (second != std::string::npos)
+        params.strength = std::stof(value.substr(second + 1));
+    // Patch sums are kept in 32 bits, which is exact up to a 21x21 patch
+    if (params.patch < 0 || params.patch > 10 || params.search < 1 || params.search > 30 || !(params.strength > 0))
+        throw std::runtime_error("Non-local means parameters out of range (patch 0-10, search 1-30, strength > 0): " +
+                                 value);
+    return params;
+}
+
+static const int kNlmTileWidth = 256;
+static const int kNlmLutSize = 4096;  // weights for distance / h^2 in steps of 1/256, 0 beyond 16
+
+// Function to compute the squared RGB distance between two planar int16 rows
+static void nlmDiffRow(const int16_t *const a[3], const int16_t *const b[3], uint32_t *out, int n)
+{
+    int j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 8 <= n; j += 8)
+    {
+        __m128i dr = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a[0] + j)),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(b[0] + j)));
+        __m128i dg = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a[1] + j)),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(b[1] + j)));
+        __m128i db = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a[2] + j)),
+                                   _mm_loadu_si128(reinterpret_cast<const __m128i *>(b[2] + j)));
+        // Interleaving (r, g) and (b, 0) lets pmaddwd square and add two channels per lane
+        __m128i rgLo = _mm_unpacklo_epi16(dr, dg), rgHi = _mm_unpackhi_epi16(dr, dg);
+        __m128i bLo = _mm_unpacklo_epi16(db, zero), bHi = _mm_unpackhi_epi16(db, zero);
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(rgLo, rgLo), _mm_madd_epi16(bLo, bLo));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(rgHi, rgHi), _mm_madd_epi16(bHi, bHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j + 4), hi);
+    }
+#endif
+    for (; j < n; ++j)
+    {
+        int dr = a[0][j] - b[0][j], dg = a[1][j] - b[1][j], db = a[2][j] - b[2][j];
+        out[j] = static_cast<uint32_t>(dr * dr + dg * dg + db * db);
+    }
+}
+
+// Function to add the weighted pixels of one offset to a row of accumulators. box holds
+// the column sums' prefix: the patch distance of pixel j is box[j + span] - box[j]. The
+// sums wrap modulo 2^32, which leaves the differences exact.
+static void nlmAccumulateRow(const uint32_t *box, int span, const int16_t *const src[3], float *acc[5], int n,
+                             const float *lut, float scale)
+{
+    const float top = static_cast<float>(kNlmLutSize - 1);
+    int j = 0;
+#if defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale), vtop = _mm_set1_ps(top);
+    const __m128i zero = _mm_setzero_si128();
+    alignas(16) int index[4];
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128i d = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(box + j + span)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(box + j)));
+        __m128 t = _mm_min_ps(_mm_mul_ps(_mm_cvtepi32_ps(d), vscale), vtop);
+        _mm_store_si128(reinterpret_cast<__m128i *>(index), _mm_cvttps_epi32(t));
+        __m128 w = _mm_setr_ps(lut[index[0]], lut[index[1]], lut[index[2]], lut[index[3]]);
+        for (int c = 0; c < 3; ++c)
+        {
+            __m128i px = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src[c] + j)), zero);
+            __m128 sum = _mm_loadu_ps(acc[c] + j);
+            _mm_storeu_ps(acc[c] + j, _mm_add_ps(sum, _mm_mul_ps(w, _mm_cvtepi32_ps(px))));
+        }
+        _mm_storeu_ps(acc[3] + j, _mm_add_ps(_mm_loadu_ps(acc[3] + j), w));
+        _mm_storeu_ps(acc[4] + j, _mm_max_ps(_mm_loadu_ps(acc[4] + j), w));
+    }
+#endif
+    for (; j < n; ++j)
+    {
+        float t = std::min(static_cast<float>(static_cast<int32_t>(box[j + span] - box[j])) * scale, top);
+        float w = lut[static_cast<int>(t)];
+        for (int c = 0; c < 3; ++c)
+            acc[c][j] += w * static_cast<float>(src[c][j]);
+        acc[3][j] += w;
+        acc[4][j] = std::max(acc[4][j], w);
+    }
+}
+
+// Function to denoise the tile of rows [y0, y1) and columns [x0, x1) into out. The tile and
+// a border of patch + search pixels (edges replicated) are copied to planar int16 rows first.
+static void nlmTile(const std::vector<std::vector<RGB>> &image, std::vector<std::vector<RGB>> &out, int y0, int y1,
+                    int x0, int x1, const NlmParams &params, const float *lut)
+{
+    int height = image.size();
+    int width = image[0].size();
+    const int P = params.patch, S = params.search, pad = P + S;
+    const int th = y1 - y0, tw = x1 - x0;
+    const int ph = th + 2 * pad, pw = tw + 2 * pad;
+    const int span = 2 * P + 1;  // patch width, and the number of difference rows in a box
+    const int dw = tw + 2 * P;   // difference rows cover the tile plus the patch border
+    const float scale = 256.0f / (3.0f * span * span * params.strength * params.strength);
+
+    std::vector<int16_t> planes(static_cast<size_t>(3) * ph * pw);
+    auto plane = [&](int c, int r) { return planes.data() + (static_cast<size_t>(c) * ph + r) * pw; };
+    for (int r = 0; r < ph; ++r)
+    {
+        const RGB *row = image[std::min(height - 1, std::max(0, y0 - pad + r))].data();
+        int16_t *pr = plane(0, r), *pg = plane(1, r), *pb = plane(2, r);
+        for (int c = 0; c < pw; ++c)
+        {
+            const RGB &px = row[std::min(width - 1, std::max(0, x0 - pad + c))];
+            pr[c] = px.r;
+            pg[c] = px.g;
+            pb[c] = px.b;
+        }
+    }
+
+    // r, g, b, weight and the largest weight seen, which the centre pixel gets at the end
+    size_t tileSize = static_cast<size_t>(th) * tw;
+    std::vector<float> sums(5 * tileSize, 0.0f);
+    std::vector<uint32_t> ring(static_cast<size_t>(span) * dw), columns(dw), box(dw + 1);
+
+    for (int dy = -S; dy <= S; ++dy)
+    {
+        for (int dx = -S; dx <= S; ++dx)
+        {
+            if (dy == 0 && dx == 0)
+                continue;
+
+            // Difference row q compares plane row S + q with its shifted partner
+            auto diffRow = [&](int q, uint32_t *dst)
+            {
+                const int16_t *a[3], *b[3];
+                for (int c = 0; c < 3; ++c)
+                {
+                    a[c] = plane(c, S + q) + S;
+                    b[c] = plane(c, S + q + dy) + S + dx;
+                }
+                nlmDiffRow(a, b, dst, dw);
+            };
+
+            std::fill(columns.begin(), columns.end(), 0u);
+            for (int q = 0; q < span; ++q)
+            {
+                uint32_t *d = ring.data() + static_cast<size_t>(q) * dw;
+                diffRow(q, d);
+                for (int c = 0; c < dw; ++c)
+                    columns[c] += d[c];
+            }
+
+            for (int i = 0; i < th; ++i)
+            {
+                uint32_t sum = 0;
+                box[0] = 0;
+                for (int c = 0; c < dw; ++c)
+                {
+                    sum += columns[c];
+                    box[c + 1] = sum;
+                }
+
+                const int16_t *src[3];
+                for (int c = 0; c < 3; ++c)
+                    src[c] = plane(c, pad + i + dy) + pad + dx;
+                float *acc[5];
+                for (int k = 0; k < 5; ++k)
+                    acc[k] = sums.data() + k * tileSize + static_cast<size_t>(i) * tw;
+                nlmAccumulateRow(box.data(), span, src, acc, tw, lut, scale);
+
+                // Slide the box down: the oldest difference row is replaced by the next one
+                if (i + 1 < th)
+                {
+                    uint32_t *d = ring.data() + static_cast<size_t>(i % span) * dw;
+                    for (int c = 0; c < dw; ++c)
+                        columns[c] -= d[c];
+                    diffRow(i + span, d);
+                    for (int c = 0; c < dw; ++c)
+                        columns[c] += d[c];
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < th; ++i)
+    {
+        RGB *dst = out[y0 + i].data() + x0;
+        for (int j = 0; j < tw; ++j)
+        {
+            size_t k = static_cast<size_t>(i) * tw + j;
+            float center = sums[4 * tileSize + k] > 0.0f ? sums[4 * tileSize + k] : 1.0f;
+            float total = sums[3 * tileSize + k] + center;
+            float rgb[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                float self = static_cast<float>(plane(c, pad + i)[pad + j]);
+                rgb[c] = (sums[c * tileSize + k] + center * self) / total;
+            }
+            dst[j].r = static_cast<unsigned char>(std::min(255.0f, rgb[0] + 0.5f));
+            dst[j].g = static_cast<unsigned char>(std::min(255.0f, rgb[1] + 0.5f));
+            dst[j].b = static_cast<unsigned char>(std::min(255.0f, rgb[2] + 0.5f));
+        }
+    }
+}
+
+// Function to apply non-local means denoising. Row bands are claimed by the worker threads
+// and split into tiles of kNlmTileWidth columns, so the accumulators of one tile stay in
+// cache across all (2 * search + 1)^2 offsets. Each tile also reads patch + search halo
+// rows above and below, so bands are at least four times that tall to keep the halo
+// (and the box sums recomputed over it) a small share of the work.
+void nonLocalMeans(std::vector<std::vector<RGB>> &image, const NlmParams &params)
+{
+    int height = image.size();
+    int width = image[0].size();
+
+    std::vector<float> lut(kNlmLutSize);
+    for (int k = 0; k < kNlmLutSize - 1; ++k)
+        lut[k] = std::exp(-static_cast<float>(k) / 256.0f);
+    lut[kNlmLutSize - 1] = 0.0f;
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int y0, int y1)
+    {
+        for (int x0 = 0; x0 < width; x0 += kNlmTileWidth)
+            nlmTile(image, result, y0, y1, x0, std::min(width, x0 + kNlmTileWidth), params, lut.data());
+    }, std::max(defaultBandRows(), 4 * (params.patch + params.search)));
+    image.swap(result);
+}
+
+// Bilateral filtering on a bilateral grid (Paris and Durand). Pixels are splatted into a
+// coarse 3D grid over (y / sigma_s, x / sigma_s, gray / sigma_r), each cell summing r, g,
+// b and a pixel count; the grid is blurred with [1 4 6 4 1] along each axis and read back
+// with trilinear interpolation. It has about width * height / sigma_s^2 * 256 / sigma_r
+// cells, so the cost stays one splat and one slice per pixel whatever the spatial sigma.
+struct BilateralGrid
+{
+    int gh = 0, gw = 0, gd = 0;
+    std::vector<float> cells;  // [gy][gx][gz][r, g, b, count]
+
+    float *at(int gy, int gx, int gz) { return cells.data() + ((static_cast<size_t>(gy) * gw + gx) * gd + gz) * 4; }
+};
+
+// Function to parse "sigma_s:sigma_r"
+void parseBilateral(const std::string &value, float &sigmaSpatial, float &sigmaRange)
+{
+    size_t colon = value.find(':');
+    if (colon == std::string::npos)
+        throw std::runtime_error("Invalid bilateral parameters (want sigma_s:sigma_r): " + value);
+    sigmaSpatial = std::stof(value.substr(0, colon));
+    sigmaRange = std::stof(value.substr(colon + 1));
+    // Finer grids than this take more memory than the image itself
+    if (!(sigmaSpatial >= 2) || !(sigmaRange >= 4))
+        throw std::runtime_error("Bilateral sigmas out of range (sigma_s >= 2, sigma_r >= 4): " + value);
+}
+
+// Function to blur n cells spaced stride floats apart with [1 4 6 4 1]. Cells outside the
+// grid count as empty; line is scratch space for n + 4 cells.
+static void bilateralBlurLine(float *data, size_t stride, int n, float *line)
+{
+    std::fill(line, line + 8, 0.0f);
+    std::fill(line + 4 * (n + 2), line + 4 * (n + 4), 0.0f);
+    for (int i = 0; i < n; ++i)
+        std::memcpy(line + 4 * (i + 2), data + stride * i, 4 * sizeof(float));
+
+    for (int i = 0; i < n; ++i)
+    {
+        const float *p = line + 4 * i;  // cells i - 2 .. i + 2
+        float *out = data + stride * i;
+#if defined(__SSE2__)
+        __m128 acc = _mm_mul_ps(_mm_set1_ps(6.0f), _mm_loadu_ps(p + 8));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(4.0f), _mm_loadu_ps(p + 4)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(4.0f), _mm_loadu_ps(p + 12)));
+        acc = _mm_add_ps(acc, _mm_loadu_ps(p));
+        _mm_storeu_ps(out, _mm_add_ps(acc, _mm_loadu_ps(p + 16)));
+#else
+        for (int c = 0; c < 4; ++c)
+            out[c] = 6.0f * p[8 + c] + 4.0f * p[4 + c] + 4.0f * p[12 + c] + p[c] + p[16 + c];
+#endif
+    }
+}
+
+// Function to interpolate between two cells: a + (b - a) * t
+#if defined(__SSE2__)
+static inline __m128 bilateralLerp(__m128 a, __m128 b, float t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(t)));
+}
+#endif
+
+// Function to apply an edge-preserving bilateral filter with spatial sigma sigmaSpatial
+// (pixels) and range sigma sigmaRange (gray levels), using a bilateral grid.
+// Splatting runs in parallel over grid rows, each gathering the image rows nearest to it,
+// so no two threads ever add to the same cell and the sums do not depend on the thread
+// count. The blur runs over grid rows and then grid columns; slicing over image rows.
+void bilateral(std::vector<std::vector<RGB>> &image, float sigmaSpatial, float sigmaRange)
+{
+    int height = image.size();
+    int width = image[0].size();
+
+    BilateralGrid grid;
+    grid.gh = static_cast<int>((height - 1) / sigmaSpatial) + 2;
+    grid.gw = static_cast<int>((width - 1) / sigmaSpatial) + 2;
+    grid.gd = static_cast<int>(255 / sigmaRange) + 2;
+    grid.cells.assign(static_cast<size_t>(grid.gh) * grid.gw * grid.gd * 4, 0.0f);
+
+    // Nearest grid row, column and layer of every image row, column and gray level
+    std::vector<int> cellY(height), cellX(width), cellZ(256);
+    for (int i = 0; i < height; ++i)
+        cellY[i] = static_cast<int>(i / sigmaSpatial + 0.5f);
+    for (int j = 0; j < width; ++j)
+        cellX[j] = static_cast<int>(j / sigmaSpatial + 0.5f);
+    for (int z = 0; z < 256; ++z)
+        cellZ[z] = static_cast<int>(z / sigmaRange + 0.5f);
+    std::vector<int> firstRow(grid.gh + 1, height);
+    for (int i = height - 1; i >= 0; --i)
+        firstRow[cellY[i]] = i;
+    for (int gy = grid.gh - 1; gy >= 0; --gy)
+        firstRow[gy] = std::min(firstRow[gy], firstRow[gy + 1]);
+
+    parallelRows(grid.gh, [&](int g0, int g1)
+    {
+        for (int i = firstRow[g0]; i < firstRow[g1]; ++i)
+        {
+            const RGB *row = image[i].data();
+            for (int j = 0; j < width; ++j)
+            {
+                const RGB &px = row[j];
+                float *cell = grid.at(cellY[i], cellX[j], cellZ[(px.r + px.g + px.b) / 3]);
+#if defined(__SSE2__)
+                __m128 v = _mm_setr_ps(px.r, px.g, px.b, 1.0f);
+                _mm_storeu_ps(cell, _mm_add_ps(_mm_loadu_ps(cell), v));
+#else
+                cell[0] += px.r;
+                cell[1] += px.g;
+                cell[2] += px.b;
+                cell[3] += 1.0f;
+#endif
+            }
+        }
+    }, 4);
+
+    // Layers and columns lie within one grid row; rows are blurred down strips of columns
+    parallelRows(grid.gh, [&](int g0, int g1)
+    {
+        std::vector<float> line(4 * (std::max(grid.gw, grid.gd) + 4));
+        for (int gy = g0; gy < g1; ++gy)
+        {
+            for (int gx = 0; gx < grid.gw; ++gx)
+                bilateralBlurLine(grid.at(gy, gx, 0), 4, grid.gd, line.data());
+            for (int gz = 0; gz < grid.gd; ++gz)
+                bilateralBlurLine(grid.at(gy, 0, gz), 4 * static_cast<size_t>(grid.gd), grid.gw, line.data());
+        }
+    }, 4);
+    parallelRows(grid.gw, [&](int c0, int c1)
+    {
+        std::vector<float> line(4 * (grid.gh + 4));
+        for (int gx = c0; gx < c1; ++gx)
+            for (int gz = 0; gz < grid.gd; ++gz)
+                bilateralBlurLine(grid.at(0, gx, gz), 4 * static_cast<size_t>(grid.gw) * grid.gd, grid.gh, line.data());
+    }, 16);
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            float fy = i / sigmaSpatial;
+            int y0 = static_cast<int>(fy);
+            float ty = fy - y0;
+            const RGB *row = image[i].data();
+            RGB *dst = result[i].data();
+            for (int j = 0; j < width; ++j)
+            {
+                const RGB &px = row[j];
+                float fx = j / sigmaSpatial, fz = ((px.r + px.g + px.b) / 3) / sigmaRange;
+                int x0 = static_cast<int>(fx), z0 = static_cast<int>(fz);
+                float tx = fx - x0, tz = fz - z0;
+                const float *c00 = grid.at(y0, x0, z0), *c01 = grid.at(y0, x0 + 1, z0);
+                const float *c10 = grid.at(y0 + 1, x0, z0), *c11 = grid.at(y0 + 1, x0 + 1, z0);
+                float v[4];
+#if defined(__SSE2__)
+                // Each cell is one vector, so the eight-corner interpolation is seven lerps
+                __m128 a = bilateralLerp(_mm_loadu_ps(c00), _mm_loadu_ps(c00 + 4), tz);
+                __m128 b = bilateralLerp(_mm_loadu_ps(c01), _mm_loadu_ps(c01 + 4), tz);
+                __m128 c = bilateralLerp(_mm_loadu_ps(c10), _mm_loadu_ps(c10 + 4), tz);
+                __m128 d = bilateralLerp(_mm_loadu_ps(c11), _mm_loadu_ps(c11 + 4), tz);
+                _mm_storeu_ps(v, bilateralLerp(bilateralLerp(a, b, tx), bilateralLerp(c, d, tx), ty));
+#else
+                for (int k = 0; k < 4; ++k)
+                {
+                    float a = c00[k] + (c00[k + 4] - c00[k]) * tz;
+                    float b = c01[k] + (c01[k + 4] - c01[k]) * tz;
+                    float c = c10[k] + (c10[k + 4] - c10[k]) * tz;
+                    float d = c11[k] + (c11[k + 4] - c11[k]) * tz;
+                    float ab = a + (b - a) * tx, cd = c + (d - c) * tx;
+                    v[k] = ab + (cd - ab) * ty;
+                }
+#endif
+                if (v[3] > 0.0f)
+                {
+                    dst[j].r = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v[0] / v[3] + 0.5f)));
+                    dst[j].g = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v[1] / v[3] + 0.5f)));
+                    dst[j].b = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v[2] / v[3] + 0.5f)));
+                }
+                else
+                {
+                    dst[j] = px;
+                }
+            }
+        }
+    });
+    image.swap(result);
+}
+
+// Convolution with arbitrary kernels. Small kernels are applied directly; large ones by
+// overlap-save over FFT tiles, where the cost per pixel grows with log(tile size) rather
+// than with the kernel area. Both use true convolution (the kernel is flipped) centred on
+// (rows / 2, columns / 2), with edge pixels replicated.
+struct Kernel
+{
+    int w = 0, h = 0;
+    std::vector<float> k;  // row-major
+};
+
+// Function to load a kernel: "disk:R" (a normalized disk of radius R) or a text file with
+// one row of weights per line. Blank lines and lines starting with '#' are skipped; the
+// weights are used as given.
+Kernel loadKernel(const std::string &spec)
+{
+    Kernel kernel;
+    if (spec.compare(0, 5, "disk:") == 0)
+    {
+        int radius = std::stoi(spec.substr(5));
+        if (radius < 0 || radius > 255)
+            throw std::runtime_error("Disk radius out of range (0-255): " + spec);
+        kernel.w = kernel.h = 2 * radius + 1;
+        kernel.k.assign(kernel.w * kernel.h, 0.0f);
+        int count = 0;
+        for (int i = -radius; i <= radius; ++i)
+            for (int j = -radius; j <= radius; ++j)
+                if (i * i + j * j <= radius * radius)
+                {
+                    kernel.k[(i + radius) * kernel.w + j + radius] = 1.0f;
+                    ++count;
+                }
+        for (float &v : kernel.k)
+            v /= count;
+        return kernel;
+    }
+
+    std::ifstream file(spec);
+    if (!file)
+        throw std::runtime_error("Cannot open file: " + spec);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        std::istringstream row(line);
+        float v;
+        int n = 0;
+        while (row >> v)
+        {
+            kernel.k.push_back(v);
+            ++n;
+        }
+        if (!row.eof())
+            throw std::runtime_error("Invalid kernel weight in " + spec + ": " + line);
+        if (kernel.h > 0 && n != kernel.w)
+            throw std::runtime_error("Kernel rows have different lengths in " + spec);
+        kernel.w = n;
+        ++kernel.h;
+    }
+    if (kernel.h == 0)
+        throw std::runtime_error("Empty kernel: " + spec);
+    if (kernel.w > 511 || kernel.h > 511)
+        throw std::runtime_error("Kernel larger than 511x511: " + spec);
+    return kernel;
+}
+
+// Complex value for the FFT. A plain pair rather than std::complex, so the scalar and SSE2
+// paths below do the same float operations in the same order.
+struct Complex
+{
+    float re, im;
+};
+
+static inline Complex complexMul(Complex a, Complex b)
+{
+    return {a.re * b.re - a.im * b.im, a.im * b.re + a.re * b.im};
+}
+
+#if defined(__SSE2__)
+// Two interleaved complex values times one complex b (broadcast) or two (per lane)
+static inline __m128 complexMul2(__m128 a, __m128 bre, __m128 bim)
+{
+    const __m128 negRe = _mm_castsi128_ps(_mm_setr_epi32(INT32_MIN, 0, INT32_MIN, 0));
+    __m128 swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_add_ps(_mm_mul_ps(a, bre), _mm_xor_ps(_mm_mul_ps(swapped, bim), negRe));
+}
+#endif
+
+struct FFTPlan
+{
+    int n = 0;                     // complex points, a power of two
+    std::vector<Complex> twiddle;  // exp(-2 pi i k / n), k in [0, n)
+};
+
+FFTPlan makeFFTPlan(int n)
+{
+    FFTPlan plan;
+    plan.n = n;
+    plan.twiddle.resize(n);
+    for (int k = 0; k < n; ++k)
+    {
+        double angle = -2.0 * M_PI * k / n;
+        plan.twiddle[k] = {static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle))};
+    }
+    return plan;
+}
+
+// Function to run a forward complex FFT of plan.n points in place; scratch holds n points.
+// Stockham autosort: every radix-4 pass (plus one radix-2 pass when log2 n is odd) reads
+// one buffer and writes the other in natural order, so there is no bit-reversal step.
+// The inner loop runs over s independent sub-transforms that share a twiddle, two per
+// SSE2 vector once s >= 2.
+void fft(const FFTPlan &plan, Complex *data, Complex *scratch)
+{
+    const Complex *tw = plan.twiddle.data();
+    Complex *x = data, *y = scratch;
+    int s = 1;
+    for (int len = plan.n; len > 1; )
+    {
+        if (len == 2)
+        {
+            for (int q = 0; q < s; ++q)
+            {
+                Complex a = x[q], b = x[q + s];
+                y[q] = {a.re + b.re, a.im + b.im};
+                y[q + s] = {a.re - b.re, a.im - b.im};
+            }
+            len = 1;
+            s *= 2;
+        }
+        else
+        {
+            int m = len / 4;
+            for (int p = 0; p < m; ++p)
+            {
+                Complex w1 = tw[p * s], w2 = tw[2 * p * s], w3 = tw[3 * p * s];
+                const Complex *a = x + s * p, *b = x + s * (p + m), *c = x + s * (p + 2 * m), *d = x + s * (p + 3 * m);
+                Complex *out = y + s * 4 * p;
+                int q = 0;
+#if defined(__SSE2__)
+                if (s >= 2)
+                {
+                    const __m128 negRe = _mm_castsi128_ps(_mm_setr_epi32(INT32_MIN, 0, INT32_MIN, 0));
+                    __m128 w1re = _mm_set1_ps(w1.re), w1im = _mm_set1_ps(w1.im);
+                    __m128 w2re = _mm_set1_ps(w2.re), w2im = _mm_set1_ps(w2.im);
+                    __m128 w3re = _mm_set1_ps(w3.re), w3im = _mm_set1_ps(w3.im);
+                    for (; q + 2 <= s; q += 2)
+                    {
+                        __m128 va = _mm_loadu_ps(&a[q].re), vb = _mm_loadu_ps(&b[q].re);
+                        __m128 vc = _mm_loadu_ps(&c[q].re), vd = _mm_loadu_ps(&d[q].re);
+                        __m128 apc = _mm_add_ps(va, vc), amc = _mm_sub_ps(va, vc);
+                        __m128 bpd = _mm_add_ps(vb, vd), bmd = _mm_sub_ps(vb, vd);
+                        // j * (b - d) = (-im, re)
+                        __m128 jbmd = _mm_xor_ps(_mm_shuffle_ps(bmd, bmd, _MM_SHUFFLE(2, 3, 0, 1)), negRe);
+                        _mm_storeu_ps(&out[q].re, _mm_add_ps(apc, bpd));
+                        _mm_storeu_ps(&out[q + s].re, complexMul2(_mm_sub_ps(amc, jbmd), w1re, w1im));
+                        _mm_storeu_ps(&out[q + 2 * s].re, complexMul2(_mm_sub_ps(apc, bpd), w2re, w2im));
+                        _mm_storeu_ps(&out[q + 3 * s].re, complexMul2(_mm_add_ps(amc, jbmd), w3re, w3im));
+                    }
+                }
+#endif
+                for (; q < s; ++q)
+                {
+                    Complex apc = {a[q].re + c[q].re, a[q].im + c[q].im}, amc = {a[q].re - c[q].re, a[q].im - c[q].im};
+                    Complex bpd = {b[q].re + d[q].re, b[q].im + d[q].im}, bmd = {b[q].re - d[q].re, b[q].im - d[q].im};
+                    Complex jbmd = {-bmd.im, bmd.re};
+                    out[q] = {apc.re + bpd.re, apc.im + bpd.im};
+                    out[q + s] = complexMul({amc.re - jbmd.re, amc.im - jbmd.im}, w1);
+                    out[q + 2 * s] = complexMul({apc.re - bpd.re, apc.im - bpd.im}, w2);
+                    out[q + 3 * s] = complexMul({amc.re + jbmd.re, amc.im + jbmd.im}, w3);
+                }
+            }
+            len = m;
+            s *= 4;
+        }
+        std::swap(x, y);
+    }
+    if (x != data)
+        std::memcpy(data, x, sizeof(Complex) * plan.n);
+}
+
+// Function to run an unnormalized inverse FFT (n times the true inverse) as conj(fft(conj(x)))
+void inverseFFT(const FFTPlan &plan, Complex *data, Complex *scratch)
+{
+    for (int k = 0; k < plan.n; ++k)
+        data[k].im = -data[k].im;
+    fft(plan, data, scratch);
+    for (int k = 0; k < plan.n; ++k)
+        data[k].im = -data[k].im;
+}
+
+// A real FFT of N points runs as a complex FFT of N / 2 points over (even, odd) sample
+// pairs, followed by a split step that untangles the two interleaved spectra.
+struct RealFFTPlan
+{
+    int n = 0;  // real points
+    FFTPlan half;
+    std::vector<Complex> rotate;  // exp(-2 pi i k / n), k in [0, n / 2]
+};
+
+RealFFTPlan makeRealFFTPlan(int n)
+{
+    RealFFTPlan plan;
+    plan.n = n;
+    plan.half = makeFFTPlan(n / 2);
+    plan.rotate.resize(n / 2 + 1);
+    for (int k = 0; k <= n / 2; ++k)
+    {
+        double angle = -2.0 * M_PI * k / n;
+        plan.rotate[k] = {static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle))};
+    }
+    return plan;
+}
+
+// Function to transform n reals into spectrum bins [0, n / 2]; scratch holds n / 2 + 1 points
+void realFFT(const RealFFTPlan &plan, const float *in, Complex *out, Complex *scratch)
+{
+    int half = plan.n / 2;
+    std::memcpy(out, in, sizeof(float) * plan.n);
+    fft(plan.half, out, scratch);
+    out[half] = out[0];
+    // Bins k and half - k are combined pairwise so the split can run in place
+    for (int k = 0; k <= half / 2; ++k)
+    {
+        Complex zk = out[k], zc = out[half - k];
+        Complex spectra[2];
+        for (int side = 0; side < 2; ++side)
+        {
+            int bin = side ? half - k : k;
+            Complex a = side ? zc : zk, b = side ? zk : zc;
+            Complex even = {0.5f * (a.re + b.re), 0.5f * (a.im - b.im)};
+            Complex odd = {0.5f * (a.im + b.im), -0.5f * (a.re - b.re)};  // (a - conj b) / 2i
+            Complex r = complexMul(odd, plan.rotate[bin]);
+            spectra[side] = {even.re + r.re, even.im + r.im};
+        }
+        out[k] = spectra[0];
+        out[half - k] = spectra[1];
+    }
+}
+
+// Function to turn bins [0, n / 2] back into n reals, scaled by n; scratch holds n / 2 points
+void inverseRealFFT(const RealFFTPlan &plan, Complex *spectrum, float *out, Complex *scratch)
+{
+    int half = plan.n / 2;
+    for (int k = 0; k <= half / 2; ++k)
+    {
+        Complex xk = spectrum[k], xc = spectrum[half - k];
+        Complex packed[2];
+        for (int side = 0; side < 2; ++side)
+        {
+            int bin = side ? half - k : k;
+            Complex a = side ? xc : xk, b = side ? xk : xc;
+            Complex even = {a.re + b.re, a.im - b.im};
+            Complex rot = {plan.rotate[bin].re, -plan.rotate[bin].im};
+            Complex odd = complexMul({a.re - b.re, a.im + b.im}, rot);
+            packed[side] = {even.re - odd.im, even.im + odd.re};  // even + i * odd
+        }
+        spectrum[k] = packed[0];
+        spectrum[half - k] = packed[1];
+    }
+    inverseFFT(plan.half, spectrum, scratch);
+    std::memcpy(out, spectrum, sizeof(float) * plan.n);
+}
+
+// Function to convert a float sum to a byte, rounding and clamping
+static inline unsigned char convolveToByte(float v)
+{
+    return static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v)) + 0.5f);
+}
+
+// Function to convolve directly: for each kernel tap a whole planar float row is scaled
+// and added to the accumulators, four pixels per SSE2 instruction.
+static void convolveDirect(std::vector<std::vector<RGB>> &image, const Kernel &kernel)
+{
+    int height = image.size();
+    int width = image[0].size();
+    const int kw = kernel.w, kh = kernel.h, cy = kh / 2, cx = kw / 2;
+    const int pw = width + kw - 1;
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int y0, int y1)
+    {
+        // Band rows plus the kernel's reach, each channel padded by the kernel width
+        int rows = y1 - y0 + kh - 1;
+        std::vector<float> planes(static_cast<size_t>(3) * rows * pw);
+        auto plane = [&](int c, int t) { return planes.data() + (static_cast<size_t>(c) * rows + t) * pw; };
+        for (int t = 0; t < rows; ++t)
+        {
+            const RGB *row = image[std::min(height - 1, std::max(0, y0 + cy - kh + 1 + t))].data();
+            for (int u = 0; u < pw; ++u)
+            {
+                const RGB &px = row[std::min(width - 1, std::max(0, u + cx - kw + 1))];
+                plane(0, t)[u] = px.r;
+                plane(1, t)[u] = px.g;
+                plane(2, t)[u] = px.b;
+            }
+        }
+
+        std::vector<float> acc(static_cast<size_t>(3) * width);
+        for (int y = y0; y < y1; ++y)
+        {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int i = 0; i < kh; ++i)
+            {
+                for (int j = 0; j < kw; ++j)
+                {
+                    float k = kernel.k[i * kw + j];
+                    if (k == 0.0f)
+                        continue;
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        const float *src = plane(c, y - y0 + kh - 1 - i) + kw - 1 - j;
+                        float *dst = acc.data() + static_cast<size_t>(c) * width;
+                        int x = 0;
+#if defined(__SSE2__)
+                        __m128 vk = _mm_set1_ps(k);
+                        for (; x + 4 <= width; x += 4)
+                            _mm_storeu_ps(dst + x, _mm_add_ps(_mm_loadu_ps(dst + x), _mm_mul_ps(vk, _mm_loadu_ps(src + x))));
+#endif
+                        for (; x < width; ++x)
+                            dst[x] += k * src[x];
+                    }
+                }
+            }
+            RGB *out = result[y].data();
+            for (int x = 0; x < width; ++x)
+            {
+                out[x].r = convolveToByte(acc[x]);
+                out[x].g = convolveToByte(acc[width + x]);
+                out[x].b = convolveToByte(acc[2 * static_cast<size_t>(width) + x]);
+            }
+        }
+    });
+    image.swap(result);
+}
+
+// Function to pick the FFT tile size for a kernel: the power of two with the least
+// estimated transform work over all the tiles that cover the image
+static int fftTileSize(int width, int height, const Kernel &kernel, double &costPerPixel)
+{
+    int best = 0;
+    double bestCost = 0;
+    for (int n = 16; n <= 2048; n *= 2)
+    {
+        int validH = n - kernel.h + 1, validW = n - kernel.w + 1;
+        if (validH < 1 || validW < 1)
+            continue;
+        double tiles = std::ceil(static_cast<double>(height) / validH) * std::ceil(static_cast<double>(width) / validW);
+        double cost = tiles * n * n * std::log2(n) / (static_cast<double>(width) * height);
+        if (best == 0 || cost < bestCost)
+        {
+            best = n;
+            bestCost = cost;
+        }
+    }
+    costPerPixel = bestCost;
+    return best;
+}
+
+// Function to convolve by overlap-save. Each n x n tile of input yields an
+// (n - kh + 1) x (n - kw + 1) block of output that circular convolution leaves free of
+// wrap-around. Per channel, rows get a real FFT; each spectrum column is then transformed,
+// multiplied by the kernel's spectrum and transformed back before moving to the next, so
+// only one tile's half spectrum is ever held. Tile rows are the parallelRows bands.
+static void convolveFFT(std::vector<std::vector<RGB>> &image, const Kernel &kernel, int n)
+{
+    int height = image.size();
+    int width = image[0].size();
+    const int kw = kernel.w, kh = kernel.h, cy = kh / 2, cx = kw / 2;
+    const int bins = n / 2 + 1;
+    const int validH = n - kh + 1, validW = n - kw + 1;
+
+    RealFFTPlan rowPlan = makeRealFFTPlan(n);
+    FFTPlan columnPlan = makeFFTPlan(n);
+
+    // Kernel spectrum, column-major to match the column pass, with the 1 / n^2 of the
+    // inverse transforms folded in
+    std::vector<Complex> kernelSpectrum(static_cast<size_t>(bins) * n);
+    {
+        std::vector<float> row(n);
+        std::vector<Complex> spectrum(static_cast<size_t>(n) * bins), column(n), scratch(n);
+        for (int r = 0; r < n; ++r)
+        {
+            std::fill(row.begin(), row.end(), 0.0f);
+            if (r < kh)
+                std::copy(kernel.k.begin() + r * kw, kernel.k.begin() + (r + 1) * kw, row.begin());
+            realFFT(rowPlan, row.data(), spectrum.data() + static_cast<size_t>(r) * bins, scratch.data());
+        }
+        float scale = 1.0f / (static_cast<float>(n) * n);
+        for (int c = 0; c < bins; ++c)
+        {
+            for (int r = 0; r < n; ++r)
+                column[r] = spectrum[static_cast<size_t>(r) * bins + c];
+            fft(columnPlan, column.data(), scratch.data());
+            for (int r = 0; r < n; ++r)
+                kernelSpectrum[static_cast<size_t>(c) * n + r] = {column[r].re * scale, column[r].im * scale};
+        }
+    }
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int ty, int tyEnd)
+    {
+        std::vector<float> block(static_cast<size_t>(n) * n);
+        std::vector<Complex> spectrum(static_cast<size_t>(n) * bins), column(n), scratch(n);
+        std::vector<int> sourceCol(n);
+        for (int tx = 0; tx < width; tx += validW)
+        {
+            for (int v = 0; v < n; ++v)
+                sourceCol[v] = std::min(width - 1, std::max(0, tx + cx - kw + 1 + v));
+            int outW = std::min(validW, width - tx);
+            for (int c = 0; c < 3; ++c)
+            {
+                for (int u = 0; u < n; ++u)
+                {
+                    const RGB *row = image[std::min(height - 1, std::max(0, ty + cy - kh + 1 + u))].data();
+                    float *dst = block.data() + static_cast<size_t>(u) * n;
+                    for (int v = 0; v < n; ++v)
+                        dst[v] = reinterpret_cast<const unsigned char *>(row + sourceCol[v])[c];
+                    realFFT(rowPlan, dst, spectrum.data() + static_cast<size_t>(u) * bins, scratch.data());
+                }
+                for (int b = 0; b < bins; ++b)
+                {
+                    for (int r = 0; r < n; ++r)
+                        column[r] = spectrum[static_cast<size_t>(r) * bins + b];
+                    fft(columnPlan, column.data(), scratch.data());
+                    const Complex *k = kernelSpectrum.data() + static_cast<size_t>(b) * n;
+                    int r = 0;
+#if defined(__SSE2__)
+                    for (; r + 2 <= n; r += 2)
+                    {
+                        __m128 vk = _mm_loadu_ps(&k[r].re);
+                        __m128 kre = _mm_shuffle_ps(vk, vk, _MM_SHUFFLE(2, 2, 0, 0));
+                        __m128 kim = _mm_shuffle_ps(vk, vk, _MM_SHUFFLE(3, 3, 1, 1));
+                        _mm_storeu_ps(&column[r].re, complexMul2(_mm_loadu_ps(&column[r].re), kre, kim));
+                    }
+#endif
+                    for (; r < n; ++r)
+                        column[r] = complexMul(column[r], k[r]);
+                    inverseFFT(columnPlan, column.data(), scratch.data());
+                    for (int r2 = 0; r2 < n; ++r2)
+                        spectrum[static_cast<size_t>(r2) * bins + b] = column[r2];
+                }
+                // Only rows kh - 1 onwards are free of wrap-around
+                for (int u = kh - 1; u < kh - 1 + (tyEnd - ty); ++u)
+                {
+                    float *dst = block.data() + static_cast<size_t>(u) * n;
+                    inverseRealFFT(rowPlan, spectrum.data() + static_cast<size_t>(u) * bins, dst, scratch.data());
+                    unsigned char *out = reinterpret_cast<unsigned char *>(result[ty + u - kh + 1].data() + tx) + c;
+                    for (int v = 0; v < outW; ++v)
+                        out[3 * v] = convolveToByte(dst[kw - 1 + v]);
+                }
+            }
+        }
+    }, validH);
+    image.swap(result);
+}
+
+// Function to convolve the image with a kernel. method is "direct", "fft" or "auto";
+// auto compares the direct path's nonzero taps with the estimated FFT work per pixel.
+// Returns the method used.
+std::string convolve(std::vector<std::vector<RGB>> &image, const Kernel &kernel, const std::string &method)
+{
+    if (method != "auto" && method != "direct" && method != "fft")
+        throw std::runtime_error("Unknown convolution method: " + method);
+    double fftCost = 0;
+    int n = fftTileSize(image[0].size(), image.size(), kernel, fftCost);
+    // Measured on SSE2: an n^2 log2 n unit of FFT work per pixel costs about as much as nine taps
+    long taps = std::count_if(kernel.k.begin(), kernel.k.end(), [](float k) { return k != 0.0f; });
+    bool useFFT = method == "fft" || (method == "auto" && taps > 9 * fftCost);
+    if (useFFT)
+        convolveFFT(image, kernel, n);
+    else
+        convolveDirect(image, kernel);
+    return useFFT ? "fft" : "direct";
+}
+
+// Recursive Gaussian (Young and van Vliet). A third-order causal filter runs forward and
+// then backward over each line, so the cost per pixel is the same for any sigma. The
+// coefficients below are pre-divided by b0.
+struct GaussianIIR
+{
+    float B, c1, c2, c3;
+};
+
+GaussianIIR makeGaussianIIR(float sigma)
+{
+    if (!(sigma >= 0.5f && sigma <= 100.0f))
+        throw std::runtime_error("Gaussian sigma out of range (0.5-100): " + std::to_string(sigma));
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+    GaussianIIR iir;
+    iir.B = static_cast<float>(1.0 - (b1 + b2 + b3) / b0);
+    iir.c1 = static_cast<float>(b1 / b0);
+    iir.c2 = static_cast<float>(b2 / b0);
+    iir.c3 = static_cast<float>(b3 / b0);
+    return iir;
+}
+
+// Function to filter n samples of lanes independent lines in place, forward and then
+// backward. Sample i of lane l is at data[i * lanes + l]; lanes is a multiple of 4. The
+// lines are taken to continue with their first and last values, for which the filter is
+// in steady state.
+static void gaussianLines(const GaussianIIR &iir, float *data, int n, int lanes)
+{
+    for (int l = 0; l < lanes; l += 4)
+    {
+        auto at = [&](int i) { return data + static_cast<size_t>(i) * lanes + l; };
+#if defined(__SSE2__)
+        const __m128 B = _mm_set1_ps(iir.B), c1 = _mm_set1_ps(iir.c1), c2 = _mm_set1_ps(iir.c2),
+                     c3 = _mm_set1_ps(iir.c3);
+        __m128 w1 = _mm_loadu_ps(at(0)), w2 = w1, w3 = w1;
+        for (int i = 0; i < n; ++i)
+        {
+            __m128 w = _mm_add_ps(_mm_mul_ps(B, _mm_loadu_ps(at(i))),
+                                  _mm_add_ps(_mm_add_ps(_mm_mul_ps(c1, w1), _mm_mul_ps(c2, w2)), _mm_mul_ps(c3, w3)));
+            _mm_storeu_ps(at(i), w);
+            w3 = w2;
+            w2 = w1;
+            w1 = w;
+        }
+        w2 = w3 = w1;
+        for (int i = n - 1; i >= 0; --i)
+        {
+            __m128 y = _mm_add_ps(_mm_mul_ps(B, _mm_loadu_ps(at(i))),
+                                  _mm_add_ps(_mm_add_ps(_mm_mul_ps(c1, w1), _mm_mul_ps(c2, w2)), _mm_mul_ps(c3, w3)));
+            _mm_storeu_ps(at(i), y);
+            w3 = w2;
+            w2 = w1;
+            w1 = y;
+        }
+#else
+        for (int k = 0; k < 4; ++k)
+        {
+            float w1 = at(0)[k], w2 = w1, w3 = w1;
+            for (int i = 0; i < n; ++i)
+            {
+                float w = iir.B * at(i)[k] + ((iir.c1 * w1 + iir.c2 * w2) + iir.c3 * w3);
+                at(i)[k] = w;
+                w3 = w2;
+                w2 = w1;
+                w1 = w;
+            }
+            w2 = w3 = w1;
+            for (int i = n - 1; i >= 0; --i)
+            {
+                float y = iir.B * at(i)[k] + ((iir.c1 * w1 + iir.c2 * w2) + iir.c3 * w3);
+                at(i)[k] = y;
+                w3 = w2;
+                w2 = w1;
+                w1 = y;
+            }
+        }
+#endif
+    }
+}
+
+static const int kGaussianStrip = 32;  // columns filtered together in the column pass
+
+// Function to apply a Gaussian blur of the given sigma with the recursive filter. The row
+// pass keeps each pixel's r, g, b in one vector; the column pass walks strips of
+// kGaussianStrip columns down the image, so each step filters 96 adjacent channel values
+// at once and reads whole cache lines. The row pass writes floats straight into those
+// strips and the result is rounded to bytes once, after the column pass.
+void gaussianBlur(std::vector<std::vector<RGB>> &image, float sigma)
+{
+    int height = image.size();
+    int width = image[0].size();
+    GaussianIIR iir = makeGaussianIIR(sigma);
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+
+    // Strip s holds rows of 3 * kGaussianStrip floats (the last strip, rounded up to a
+    // multiple of 4) and starts at s * height * 3 * kGaussianStrip
+    const int stripLanes = 3 * kGaussianStrip;
+    auto lanesOf = [&](int c0) { return (3 * (std::min(width, c0 + kGaussianStrip) - c0) + 3) & ~3; };
+    int lastStrip = (width - 1) / kGaussianStrip * kGaussianStrip;
+    std::vector<float> strips(static_cast<size_t>(height) * (lastStrip / kGaussianStrip * stripLanes + lanesOf(lastStrip)));
+    auto stripRow = [&](int c0, int i)
+    {
+        return strips.data() + static_cast<size_t>(height) * 3 * c0 + static_cast<size_t>(i) * lanesOf(c0);
+    };
+
+    parallelRows(height, [&](int first, int last)
+    {
+        std::vector<float> line(static_cast<size_t>(width) * 4, 0.0f);
+        for (int i = first; i < last; ++i)
+        {
+            const RGB *src = image[i].data();
+            for (int j = 0; j < width; ++j)
+            {
+                line[4 * j] = src[j].r;
+                line[4 * j + 1] = src[j].g;
+                line[4 * j + 2] = src[j].b;
+            }
+            gaussianLines(iir, line.data(), width, 4);
+            for (int c0 = 0; c0 < width; c0 += kGaussianStrip)
+            {
+                float *dst = stripRow(c0, i);
+                for (int j = c0; j < std::min(width, c0 + kGaussianStrip); ++j, dst += 3)
+                {
+                    dst[0] = line[4 * j];
+                    dst[1] = line[4 * j + 1];
+                    dst[2] = line[4 * j + 2];
+                }
+            }
+        }
+    });
+
+    // "Rows" here are strips of columns, each filtered top to bottom
+    parallelRows(width, [&](int c0, int c1)
+    {
+        int values = 3 * (c1 - c0), lanes = lanesOf(c0);
+        gaussianLines(iir, stripRow(c0, 0), height, lanes);
+        for (int i = 0; i < height; ++i)
+        {
+            unsigned char *dst = reinterpret_cast<unsigned char *>(result[i].data() + c0);
+            const float *src = stripRow(c0, i);
+            for (int v = 0; v < values; ++v)
+                dst[v] = convolveToByte(src[v]);
+        }
+    }, kGaussianStrip);
+    image.swap(result);
+}
+
+// Affine warps. The map takes source to destination: x' = a x + b y + c,
+// y' = d x + e y + f. Warping inverts it and, for every output pixel, samples the
+// source at the mapped position; pixels that map outside the source are black.
+struct AffineMap
+{
+    double a = 1, b = 0, c = 0, d = 0, e = 1, f = 0;
+};
+
+// Function to parse "a,b,c,d,e,f"
+AffineMap parseAffine(const std::string &spec)
+{
+    std::vector<double> v;
+    std::stringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ','))
+        v.push_back(std::stod(item));
+    if (v.size() != 6)
+        throw std::runtime_error("Affine map needs 6 comma-separated values (a,b,c,d,e,f): " + spec);
+    AffineMap map;
+    map.a = v[0];
+    map.b = v[1];
+    map.c = v[2];
+    map.d = v[3];
+    map.e = v[4];
+    map.f = v[5];
+    return map;
+}
+
+// Function to build the map rotating a width x height image counterclockwise by degrees
+// about its centre
+AffineMap rotationMap(double degrees, int width, int height)
+{
+    double angle = degrees * M_PI / 180.0;
+    double cs = std::cos(angle), sn = std::sin(angle);
+    double cx = (width - 1) / 2.0, cy = (height - 1) / 2.0;
+    AffineMap map;
+    map.a = cs;
+    map.b = sn;
+    map.c = cx - cs * cx - sn * cy;
+    map.d = -sn;
+    map.e = cs;
+    map.f = cy + sn * cx - cs * cy;
+    return map;
+}
+
+static const int kWarpTile = 64;  // output tiles are kWarpTile x kWarpTile pixels
+
+// Function to sample n output pixels bilinearly along one row. (sx, sy) is the source
+// position of the first pixel in 64-bit 16.16 fixed point and (dx, dy) the step per pixel. tex is
+// the source as 32-bit texels with a one-pixel black border, pw texels per row. Weights
+// have 7 fractional bits per axis, so each pair of texels is blended by one pmaddwd.
+static void warpRowBilinear(const uint32_t *tex, int pw, int width, int height, int64_t sx, int64_t sy, int64_t dx,
+                            int64_t dy, RGB *out, int n)
+{
+    for (int j = 0; j < n; ++j, sx += dx, sy += dy)
+    {
+        int64_t ix = sx >> 16, iy = sy >> 16;
+        if (ix < -1 || ix >= width || iy < -1 || iy >= height)
+        {
+            out[j] = {0, 0, 0};
+            continue;
+        }
+        int fx = static_cast<int>((sx >> 9) & 127), fy = static_cast<int>((sy >> 9) & 127);
+        int w00 = (128 - fx) * (128 - fy), w01 = fx * (128 - fy), w10 = (128 - fx) * fy, w11 = fx * fy;
+        const uint32_t *p = tex + static_cast<size_t>(iy + 1) * pw + ix + 1;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i top = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[0]), zero),
+                                         _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[1]), zero));
+        __m128i bottom = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[pw]), zero),
+                                            _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[pw + 1]), zero));
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(top, _mm_set1_epi32(w00 | (w01 << 16))),
+                                    _mm_madd_epi16(bottom, _mm_set1_epi32(w10 | (w11 << 16))));
+        sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(8192)), 14);
+        uint32_t rgb = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(sum, zero), zero)));
+        out[j] = {static_cast<unsigned char>(rgb), static_cast<unsigned char>(rgb >> 8),
+                  static_cast<unsigned char>(rgb >> 16)};
+#else
+        const unsigned char *t00 = reinterpret_cast<const unsigned char *>(p);
+        const unsigned char *t01 = reinterpret_cast<const unsigned char *>(p + 1);
+        const unsigned char *t10 = reinterpret_cast<const unsigned char *>(p + pw);
+        const unsigned char *t11 = reinterpret_cast<const unsigned char *>(p + pw + 1);
+        unsigned char v[3];
+        for (int c = 0; c < 3; ++c)
+            v[c] = static_cast<unsigned char>((t00[c] * w00 + t01[c] * w01 + t10[c] * w10 + t11[c] * w11 + 8192) >> 14);
+        out[j] = {v[0], v[1], v[2]};
+#endif
+    }
+}
+
+// Function to sample n output pixels from the nearest source pixel, with the same
+// arguments as warpRowBilinear
+static void warpRowNearest(const uint32_t *tex, int pw, int width, int height, int64_t sx, int64_t sy, int64_t dx,
+                           int64_t dy, RGB *out, int n)
+{
+    for (int j = 0; j < n; ++j, sx += dx, sy += dy)
+    {
+        int64_t ix = (sx + 0x8000) >> 16, iy = (sy + 0x8000) >> 16;
+        if (ix < 0 || ix >= width || iy < 0 || iy >= height)
+        {
+            out[j] = {0, 0, 0};
+            continue;
+        }
+        const unsigned char *t = reinterpret_cast<const unsigned char *>(tex + static_cast<size_t>(iy + 1) * pw + ix + 1);
+        out[j] = {t[0], t[1], t[2]};
+    }
+}
+
+// Function to warp the image by an affine map, keeping its size. Source positions are
+// stepped incrementally in 16.16 fixed point from an exact start per tile row; they are
+// 64-bit, as 32 bits leave no headroom past 32767 pixels. The output is covered in
+// kWarpTile-square tiles, one band of tiles per parallelRows band, so for steep angles
+// each tile still reads a compact patch of the source.
+void warpAffine(std::vector<std::vector<RGB>> &image, const AffineMap &map, bool bilinear)
+{
+    int height = image.size();
+    int width = image[0].size();
+    if (width >= 32768 || height >= 32768)
+        throw std::runtime_error("Image too large to warp (limit 32767 pixels per side)");
+    double det = map.a * map.e - map.b * map.d;
+    if (std::fabs(det) < 1e-12)
+        throw std::runtime_error("Affine map is not invertible");
+    // Destination to source
+    double ia = map.e / det, ib = -map.b / det, id = -map.d / det, ie = map.a / det;
+    double ic = -(ia * map.c + ib * map.f), iff = -(id * map.c + ie * map.f);
+    // Bounds a tile row's steps, so a start clamped far outside the source stays outside
+    if (std::fabs(ia) > 128 || std::fabs(id) > 128)
+        throw std::runtime_error("Affine map shrinks the image more than 128 times");
+
+    // RGBx texels with a black border, so bilinear taps never need bounds checks
+    int pw = width + 2;
+    std::vector<uint32_t> tex(static_cast<size_t>(pw) * (height + 2), 0);
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            uint32_t *dst = tex.data() + static_cast<size_t>(i + 1) * pw + 1;
+            const RGB *src = image[i].data();
+            for (int j = 0; j < width; ++j)
+                dst[j] = src[j].r | (src[j].g << 8) | (src[j].b << 16);
+        }
+    });
+
+    // Starts far outside the source are clamped; they stay outside after a tile row of steps
+    auto fixed = [](double v) { return std::llround(std::max(-1.0e15, std::min(1.0e15, v * 65536.0))); };
+    int64_t dx = fixed(ia), dy = fixed(id);
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int x0 = 0; x0 < width; x0 += kWarpTile)
+        {
+            int n = std::min(kWarpTile, width - x0);
+            for (int i = first; i < last; ++i)
+            {
+                int64_t sx = fixed(ia * x0 + ib * i + ic), sy = fixed(id * x0 + ie * i + iff);
+                if (bilinear)
+                    warpRowBilinear(tex.data(), pw, width, height, sx, sy, dx, dy, result[i].data() + x0, n);
+                else
+                    warpRowNearest(tex.data(), pw, width, height, sx, sy, dx, dy, result[i].data() + x0, n);
+            }
+        }
+    }, kWarpTile);
+    image.swap(result);
+}
+
+// Seam carving (Avidan and Shamir). Narrowing removes, one at a time, the 8-connected
+// top-to-bottom path of least total energy, where energy is the gradient magnitude
+// |dI/dx| + |dI/dy| of r + g + b. Shortening does the same on the transposed image.
+// Energy and the cumulative cost table are computed once; after each removal only the
+// pixels whose neighbourhood changed get new energy, and the cost table is refreshed
+// from the seam outwards, one row at a time, only as far as its values actually change.
+struct SeamCarver
+{
+    int width = 0, height = 0, stride = 0;
+    std::vector<RGB> pixels;
+    std::vector<uint16_t> sum;     // r + g + b
+    std::vector<uint16_t> energy;
+    std::vector<int32_t> cost;     // cheapest seam from the top row ending at each pixel
+    std::vector<int> seam;
+
+    SeamCarver(const std::vector<std::vector<RGB>> &image, bool transpose)
+    {
+        int h = image.size(), w = image[0].size();
+        width = stride = transpose ? h : w;
+        height = transpose ? w : h;
+        pixels.resize(static_cast<size_t>(stride) * height);
+        sum.resize(pixels.size());
+        energy.resize(pixels.size());
+        cost.resize(pixels.size());
+        seam.resize(height);
+        parallelRows(height, [&](int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+                for (int j = 0; j < width; ++j)
+                {
+                    const RGB &px = transpose ? image[j][i] : image[i][j];
+                    pixels[at(i, j)] = px;
+                    sum[at(i, j)] = static_cast<uint16_t>(px.r + px.g + px.b);
+                }
+        });
+        parallelRows(height, [&](int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+                updateEnergy(i, 0, width - 1);
+        });
+        for (int i = 0; i < height; ++i)
+            updateCost(i, 0, width - 1);
+    }
+
+    size_t at(int i, int j) const { return static_cast<size_t>(i) * stride + j; }
+
+    // Function to recompute the energy of row i, columns [j0, j1]
+    void updateEnergy(int i, int j0, int j1)
+    {
+        const uint16_t *s = &sum[at(i, 0)];
+        const uint16_t *up = &sum[at(std::max(0, i - 1), 0)], *down = &sum[at(std::min(height - 1, i + 1), 0)];
+        uint16_t *e = &energy[at(i, 0)];
+        auto one = [&](int j)
+        {
+            int dx = s[std::min(width - 1, j + 1)] - s[std::max(0, j - 1)], dy = down[j] - up[j];
+            e[j] = static_cast<uint16_t>(std::abs(dx) + std::abs(dy));
+        };
+        int j = j0;
+        if (j == 0 && j <= j1)
+            one(j++);
+#if defined(__SSE2__)
+        // r + g + b fits in a signed 16-bit lane, so |a - b| is max - min
+        auto absDiff = [](__m128i a, __m128i b) { return _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b)); };
+        for (; j + 8 <= std::min(j1 + 1, width - 1); j += 8)
+        {
+            __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + j - 1));
+            __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + j + 1));
+            __m128i above = _mm_loadu_si128(reinterpret_cast<const __m128i *>(up + j));
+            __m128i below = _mm_loadu_si128(reinterpret_cast<const __m128i *>(down + j));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(e + j), _mm_add_epi16(absDiff(left, right), absDiff(above, below)));
+        }
+#endif
+        for (; j <= j1; ++j)
+            one(j);
+    }
+
+    // Function to recompute the cost of row i, columns [j0, j1], from row i - 1. Returns
+    // the range of columns whose cost changed in changedLo/changedHi (empty if lo > hi).
+    void updateCost(int i, int j0, int j1, int *changedLo = nullptr, int *changedHi = nullptr)
+    {
+        int lo = j1 + 1, hi = j0 - 1;
+        const uint16_t *e = &energy[at(i, 0)];
+        int32_t *c = &cost[at(i, 0)];
+        if (i == 0)
+        {
+            for (int j = j0; j <= j1; ++j)
+            {
+                if (c[j] != e[j])
+                {
+                    lo = std::min(lo, j);
+                    hi = j;
+                }
+                c[j] = e[j];
+            }
+        }
+        else
+        {
+            const int32_t *p = &cost[at(i - 1, 0)];
+            auto one = [&](int j)
+            {
+                int32_t v = e[j] + std::min(std::min(p[std::max(0, j - 1)], p[j]), p[std::min(width - 1, j + 1)]);
+                if (c[j] != v)
+                {
+                    lo = std::min(lo, j);
+                    hi = j;
+                }
+                c[j] = v;
+            };
+            int j = j0;
+            if (j == 0 && j <= j1)
+                one(j++);
+#if defined(__SSE2__)
+            // SSE2 has no pminsd, so the minimum is a compare and select
+            auto min32 = [](__m128i a, __m128i b)
+            {
+                __m128i gt = _mm_cmpgt_epi32(a, b);
+                return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+            };
+            const __m128i zero = _mm_setzero_si128();
+            for (; j + 4 <= std::min(j1 + 1, width - 1); j += 4)
+            {
+                __m128i m = min32(min32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j - 1)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j))),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j + 1)));
+                __m128i v = _mm_add_epi32(m, _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(e + j)), zero));
+                __m128i old = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c + j));
+                int same = _mm_movemask_epi8(_mm_cmpeq_epi32(old, v));
+                if (same != 0xFFFF)
+                {
+                    for (int k = 0; k < 4; ++k)
+                        if (((same >> (4 * k)) & 0xF) != 0xF)
+                        {
+                            lo = std::min(lo, j + k);
+                            hi = j + k;
+                        }
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(c + j), v);
+            }
+#endif
+            for (; j <= j1; ++j)
+                one(j);
+        }
+        if (changedLo)
+        {
+            *changedLo = lo;
+            *changedHi = hi;
+        }
+    }
+
+    // Function to trace the cheapest seam back up from the bottom row
+    void findSeam()
+    {
+        const int32_t *last = &cost[at(height - 1, 0)];
+        int j = static_cast<int>(std::min_element(last, last + width) - last);
+        seam[height - 1] = j;
+        for (int i = height - 2; i >= 0; --i)
+        {
+            const int32_t *c = &cost[at(i, 0)];
+            int best = j;
+            if (j > 0 && c[j - 1] < c[best])
+                best = j - 1;
+            if (j + 1 < width && c[j + 1] < c[best])
+                best = j + 1;
+            seam[i] = j = best;
+        }
+    }
+
+    // Function to remove the current seam and bring energy and cost up to date
+    void removeSeam()
+    {
+        for (int i = 0; i < height; ++i)
+        {
+            size_t from = at(i, seam[i] + 1), count = width - 1 - seam[i];
+            std::memmove(&pixels[from - 1], &pixels[from], count * sizeof(RGB));
+            std::memmove(&sum[from - 1], &sum[from], count * sizeof(uint16_t));
+            std::memmove(&energy[from - 1], &energy[from], count * sizeof(uint16_t));
+            std::memmove(&cost[from - 1], &cost[from], count * sizeof(int32_t));
+        }
+        --width;
+
+        // Columns in [min - 1, max] of the seam positions in rows i - 1..i + 1 gained a
+        // new horizontal or vertical neighbour; elsewhere the shift left nothing changed
+        auto touched = [&](int i, int &lo, int &hi)
+        {
+            int a = std::min(seam[std::max(0, i - 1)], std::min(seam[i], seam[std::min(height - 1, i + 1)]));
+            int b = std::max(seam[std::max(0, i - 1)], std::max(seam[i], seam[std::min(height - 1, i + 1)]));
+            lo = std::max(0, a - 1);
+            hi = std::min(width - 1, b);
+        };
+        for (int i = 0; i < height; ++i)
+        {
+            int lo, hi;
+            touched(i, lo, hi);
+            updateEnergy(i, lo, hi);
+        }
+        // A changed cost spreads at most one column each way per row below it
+        int prevLo = 0, prevHi = -1;
+        for (int i = 0; i < height; ++i)
+        {
+            int lo, hi;
+            touched(i, lo, hi);
+            if (prevLo <= prevHi)
+            {
+                lo = std::min(lo, std::max(0, prevLo - 1));
+                hi = std::max(hi, std::min(width - 1, prevHi + 1));
+            }
+            updateCost(i, lo, hi, &prevLo, &prevHi);
+        }
+    }
+
+    // Function to write the carved pixels back, transposing again if needed
+    std::vector<std::vector<RGB>> image(bool transpose) const
+    {
+        int h = transpose ? width : height, w = transpose ? height : width;
+        std::vector<std::vector<RGB>> out(h, std::vector<RGB>(w));
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                (transpose ? out[j][i] : out[i][j]) = pixels[at(i, j)];
+        return out;
+    }
+};
+
+// Function to resize the image down to targetWidth x targetHeight by removing seams,
+// vertical seams first
+void seamCarve(std::vector<std::vector<RGB>> &image, int targetWidth, int targetHeight)
+{
+    int height = image.size();
+    int width = image[0].size();
+    if (targetWidth > width || targetHeight > height)
+        throw std::runtime_error("Seam carving only shrinks: target " + std::to_string(targetWidth) + "x" +
+                                 std::to_string(targetHeight) + " is larger than " + std::to_string(width) + "x" +
+                                 std::to_string(height));
+    std::vector<std::vector<RGB>> result = image;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        bool transpose = (pass == 1);
+        int target = transpose ? targetHeight : targetWidth;
+        if (static_cast<int>(transpose ? result.size() : result[0].size()) == target)
+            continue;
+        SeamCarver carver(result, transpose);
+        while (carver.width > target)
+        {
+            if (cancelRequested())
+                throw OperationCancelled();
+            carver.findSeam();
+            carver.removeSeam();
+        }
+        result = carver.image(transpose);
+    }
+    image.swap(result);
+}
+
+// Exact round(x / 255) for x in [0, 255 * 255], shared by the scalar and SIMD paths
+static inline int div255(int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#if defined(__SSE2__)
+static inline __m128i div255x8(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+// Function to composite one row of straight-alpha RGBA pixels over an opaque RGB row.
+// The source is premultiplied first and then combined as  out = src' + dst * (1 - a).
+void overlayRow(const RGBA *src, RGB *dst, int width)
+{
+    int j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    for (; j + 2 <= width; j += 2)
+    {
+        // Two pixels per register as 16-bit lanes: r g b a | r g b a
+        __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + j)), zero);
+        __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i premul = div255x8(_mm_mullo_epi16(s, alpha));
+
+        unsigned char d8[8] = {dst[j].r, dst[j].g, dst[j].b, 0, dst[j + 1].r, dst[j + 1].g, dst[j + 1].b, 0};
+        __m128i d;
+        std::memcpy(&d, d8, 8);
+        d = _mm_unpacklo_epi8(d, zero);
+        __m128i kept = div255x8(_mm_mullo_epi16(d, _mm_sub_epi16(full, alpha)));
+
+        alignas(16) unsigned char out[16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(_mm_add_epi16(premul, kept), zero));
+        dst[j] = {out[0], out[1], out[2]};
+        dst[j + 1] = {out[4], out[5], out[6]};
+    }
+#endif
+    for (; j < width; ++j)
+    {
+        int a = src[j].a;
+        dst[j].r = static_cast<unsigned char>(div255(src[j].r * a) + div255(dst[j].r * (255 - a)));
+        dst[j].g = static_cast<unsigned char>(div255(src[j].g * a) + div255(dst[j].g * (255 - a)));
+        dst[j].b = static_cast<unsigned char>(div255(src[j].b * a) + div255(dst[j].b * (255 - a)));
+    }
+}
+
+// Function to composite straight-alpha RGBA pixels over a row that has its own straight
+// alpha: a = as + ad * (1 - as) and c = (cs * as + cd * ad * (1 - as)) / a. Fully
+// transparent results are black.
+void overlayRowAlpha(const RGBA *src, RGB *dst, unsigned char *dstAlpha, int width)
+{
+    for (int j = 0; j < width; ++j)
+    {
+        int as = src[j].a, keep = dstAlpha[j] * (255 - as);
+        int total = as * 255 + keep;  // output alpha x 255
+        if (total == 0)
+        {
+            dst[j] = {0, 0, 0};
+            dstAlpha[j] = 0;
+            continue;
+        }
+        auto mix = [&](int cs, int cd)
+        {
+            return static_cast<unsigned char>((cs * as * 255 + cd * keep + total / 2) / total);
+        };
+        dst[j] = {mix(src[j].r, dst[j].r), mix(src[j].g, dst[j].g), mix(src[j].b, dst[j].b)};
+        dstAlpha[j] = static_cast<unsigned char>(div255(total));
+    }
+}
+
+// Function to composite a PAM image onto the image with its top-left corner at (x, y).
+// The overlay is streamed from disk one row at a time and never fully loaded. alpha is
+// the image's own alpha plane, or empty when it is opaque.
+void overlay(std::vector<std::vector<RGB>> &image, const std::string &filename, int x, int y,
+             std::vector<std::vector<unsigned char>> &alpha)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    int width, height, depth;
+    readPAMHeader(file, filename, width, height, depth);
+
+    int imageHeight = image.size();
+    int imageWidth = image[0].size();
+    int first = std::max(0, -x), last = std::min(width, imageWidth - x);  // visible overlay columns
+
+    std::vector<unsigned char> tuples(static_cast<size_t>(width) * depth);
+    std::vector<RGBA> row(width);
+    for (int i = 0; i < height && y + i < imageHeight; ++i)
+    {
+        file.read(reinterpret_cast<char *>(tuples.data()), tuples.size());
+        if (file.gcount() != static_cast<std::streamsize>(tuples.size()))
+        {
+            throw std::runtime_error("Error reading overlay pixel data at row " + std::to_string(i));
+        }
+        if (y + i < 0 || first >= last)
+            continue;
+        tuplesToRGBA(tuples.data(), depth, row.data(), width);
+        if (alpha.empty())
+            overlayRow(row.data() + first, image[y + i].data() + x + first, last - first);
+        else
+            overlayRowAlpha(row.data() + first, image[y + i].data() + x + first, alpha[y + i].data() + x + first,
+                            last - first);
+    }
+}
+
+// Per-pixel operations between two same-sized images
+enum class CombineOp
+{
+    Diff,   // |a - b|
+    Add,    // a + b, saturating
+    Sub,    // a - b, saturating at 0
+    Blend,  // a * (1 - w) + b * w
+    Min,
+    Max
+};
+
+// Function to map a command line option to a two-input operation
+bool combineOpFor(const std::string &option, CombineOp &op)
+{
+    if (option == "--diff") op = CombineOp::Diff;
+    else if (option == "--add") op = CombineOp::Add;
+    else if (option == "--sub") op = CombineOp::Sub;
+    else if (option == "--blend") op = CombineOp::Blend;
+    else if (option == "--min") op = CombineOp::Min;
+    else if (option == "--max") op = CombineOp::Max;
+    else return false;
+    return true;
+}
+
+// Function to combine n bytes of two rows. weight is the share of b in Q8 (0..256) for Blend.
+void combineRow(const unsigned char *a, const unsigned char *b, unsigned char *out, size_t n, CombineOp op, int weight)
+{
+    size_t k = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wb = _mm_set1_epi16(static_cast<short>(weight));
+    const __m128i wa = _mm_set1_epi16(static_cast<short>(256 - weight));
+    const __m128i half = _mm_set1_epi16(128);
+    for (; k + 16 <= n; k += 16)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + k));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + k));
+        __m128i r;
+        switch (op)
+        {
+        case CombineOp::Diff: r = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)); break;
+        case CombineOp::Add: r = _mm_adds_epu8(va, vb); break;
+        case CombineOp::Sub: r = _mm_subs_epu8(va, vb); break;
+        case CombineOp::Min: r = _mm_min_epu8(va, vb); break;
+        case CombineOp::Max: r = _mm_max_epu8(va, vb); break;
+        default:
+        {
+            // (a * (256 - w) + b * w + 128) >> 8 in 16-bit lanes; the sum never exceeds 65408
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                                     _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)), half);
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                                     _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)), half);
+            r = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+            break;
+        }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + k), r);
+    }
+#endif
+    for (; k < n; ++k)
+    {
+        int x = a[k], y = b[k], r;
+        switch (op)
+        {
+        case CombineOp::Diff: r = std::abs(x - y); break;
+        case CombineOp::Add: r = std::min(255, x + y); break;
+        case CombineOp::Sub: r = std::max(0, x - y); break;
+        case CombineOp::Min: r = std::min(x, y); break;
+        case CombineOp::Max: r = std::max(x, y); break;
+        default: r = (x * (256 - weight) + y * weight + 128) >> 8; break;
+        }
+        out[k] = static_cast<unsigned char>(r);
+    }
+}
+
+// Function to combine the image with a second PPM that is mapped rather than loaded
+void combineWith(std::vector<std::vector<RGB>> &image, const std::string &filename, CombineOp op, int weight)
+{
+    MappedPPM other(filename);
+    int height = image.size();
+    int width = image[0].size();
+    if (other.width != width || other.height != height)
+    {
+        throw std::runtime_error("Image sizes differ: " + std::to_string(width) + "x" + std::to_string(height) +
+                                 " vs " + std::to_string(other.width) + "x" + std::to_string(other.height));
+    }
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            unsigned char *row = reinterpret_cast<unsigned char *>(image[i].data());
+            combineRow(row, other.row(i), row, static_cast<size_t>(width) * 3, op, weight);
+        }
+    });
+}
+
+// Function to combine two PPM files into a third without loading either one: both inputs
+// are mapped and walked in lockstep row bands, and each finished band is written out.
+// About once a second the rows written so far and their running checksum are recorded in
+// "<output>.checkpoint"; with resume a verified prefix of the output is kept.
+void combineFiles(const std::string &fileA, const std::string &fileB, const std::string &outputFile,
+                  CombineOp op, int weight, bool resume = false)
+{
+    MappedPPM a(fileA), b(fileB);
+    if (a.width != b.width || a.height != b.height)
+    {
+        throw std::runtime_error("Image sizes differ: " + std::to_string(a.width) + "x" + std::to_string(a.height) +
+                                 " vs " + std::to_string(b.width) + "x" + std::to_string(b.height));
+    }
+
+    // Truncating an input while it is mapped would fault the reads
+    std::error_code ec;
+    if (std::filesystem::equivalent(outputFile, fileA, ec) || std::filesystem::equivalent(outputFile, fileB, ec))
+    {
+        throw std::runtime_error("Output file must differ from the inputs: " + outputFile);
+    }
+
+    std::string header = "P6\n" + std::to_string(a.width) + " " + std::to_string(a.height) + "\n255\n";
+    size_t rowBytes = static_cast<size_t>(a.width) * 3;
+    Checkpoint checkpoint(outputFile + ".checkpoint",
+                          "combine " + std::to_string(static_cast<int>(op)) + " " + std::to_string(weight) + " " +
+                              fileStamp(fileA) + " " + fileStamp(fileB),
+                          resume);
+
+    // The last record whose prefix still checks out is where writing picks up again
+    int startRow = 0;
+    uint64_t hash = checksumBytes(reinterpret_cast<const unsigned char *>(header.data()), header.size());
+    for (auto it = checkpoint.records.rbegin(); it != checkpoint.records.rend(); ++it)
+    {
+        std::istringstream record(*it);
+        std::string kind;
+        int rows = 0;
+        uint64_t recorded = 0, actual = 0;
+        if (record >> kind >> rows >> std::hex >> recorded && kind == "rows" && rows <= a.height &&
+            checksumFile(outputFile, 0, header.size() + rowBytes * rows, actual) && actual == recorded)
+        {
+            startRow = rows;
+            hash = recorded;
+            break;
+        }
+    }
+
+    std::fstream file;
+    if (startRow > 0)
+    {
+        file.open(outputFile, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(header.size() + rowBytes * startRow);
+        std::cout << "Resuming at row " << startRow << " of " << a.height << "\n";
+    }
+    else
+    {
+        file.open(outputFile, std::ios::binary | std::ios::out | std::ios::trunc);
+        file << header;
+    }
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + outputFile);
+    }
+    std::cout << "Streaming " << a.width << "x" << a.height << " images into " << outputFile << "\n";
+
+    int chunkRows = defaultBandRows() * workerCount();
+    std::vector<unsigned char> chunk(rowBytes * std::min(chunkRows, a.height));
+    auto lastRecord = std::chrono::steady_clock::now();
+    for (int y0 = startRow; y0 < a.height; y0 += chunkRows)
+    {
+        int rows = std::min(chunkRows, a.height - y0);
+        parallelRows(rows, [&](int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                combineRow(a.row(y0 + i), b.row(y0 + i), chunk.data() + rowBytes * i, rowBytes, op, weight);
+            }
+        });
+        file.write(reinterpret_cast<const char *>(chunk.data()), rowBytes * rows);
+        if (!file)
+        {
+            throw std::runtime_error("Error writing pixel data at row " + std::to_string(y0));
+        }
+        hash = checksumBytes(chunk.data(), rowBytes * rows, hash);
+        if (std::chrono::steady_clock::now() - lastRecord >= std::chrono::seconds(1))
+        {
+            file.flush();
+            std::ostringstream record;
+            record << "rows " << y0 + rows << " " << std::hex << hash;
+            checkpoint.record(record.str());
+            lastRecord = std::chrono::steady_clock::now();
+        }
+        if (cancelRequested())
+            throw OperationCancelled();
+    }
+    file.close();
+    checkpoint.remove();
+    std::cout << "PPM file successfully written: " << outputFile << "\n";
+}
+
+// Function to split "file[:weight]" for --blend; weight is the share of the second image
+int parseBlendWeight(std::string &value)
+{
+    size_t colon = value.rfind(':');
+    float w = 0.5f;
+    if (colon != std::string::npos)
+    {
+        w = std::stof(value.substr(colon + 1));
+        value = value.substr(0, colon);
+    }
+    if (w < 0.0f || w > 1.0f)
+        throw std::runtime_error("Blend weight must be between 0 and 1");
+    return static_cast<int>(std::lround(w * 256.0f));
+}
+
+// Function to shrink a mapped image by an integer factor into out (rows of outStride bytes).
+// Strided decimation touches only every factor-th row of the mapping; area averaging
+// reads every source pixel once and averages factor x factor blocks.
+static void thumbnail(const MappedPPM &src, int factor, bool area, unsigned char *out, size_t outStride)
+{
+    int tw = src.width / factor, th = src.height / factor;
+    std::vector<int> sums(static_cast<size_t>(tw) * 3);
+    for (int y = 0; y < th; ++y)
+    {
+        unsigned char *dst = out + outStride * y;
+        if (!area)
+        {
+            const unsigned char *row = src.row(y * factor);
+            for (int x = 0; x < tw; ++x)
+            {
+                std::memcpy(dst + x * 3, row + static_cast<size_t>(x) * factor * 3, 3);
+            }
+            continue;
+        }
+
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int dy = 0; dy < factor; ++dy)
+        {
+            const unsigned char *row = src.row(y * factor + dy);
+            for (int x = 0; x < tw; ++x)
+            {
+                const unsigned char *block = row + static_cast<size_t>(x) * factor * 3;
+                for (int dx = 0; dx < factor * 3; dx += 3)
+                {
+                    sums[x * 3] += block[dx];
+                    sums[x * 3 + 1] += block[dx + 1];
+                    sums[x * 3 + 2] += block[dx + 2];
+                }
+            }
+        }
+        int count = factor * factor;
+        for (int k = 0; k < tw * 3; ++k)
+        {
+            dst[k] = static_cast<unsigned char>((sums[k] + count / 2) / count);
+        }
+    }
+}
+
+// Function to build a contact sheet of `columns` tiles of tileW x tileH from many PPM files.
+// Each input is mapped and shrunk by the smallest integer factor that fits its tile, then
+// centred on a black background. One row of tiles is built in parallel at a time and
+// written out before the next, so memory is a single strip whatever the input count.
+void buildMosaic(const std::vector<std::string> &inputs, const std::string &outputFile, int columns,
+                 int tileW, int tileH, bool area)
+{
+    if (inputs.empty())
+    {
+        throw std::runtime_error("Mosaic needs at least one input file.");
+    }
+    columns = std::max(1, std::min(columns, static_cast<int>(inputs.size())));
+    int rows = (static_cast<int>(inputs.size()) + columns - 1) / columns;
+    int canvasW = columns * tileW, canvasH = rows * tileH;
+    size_t stride = static_cast<size_t>(canvasW) * 3;
+
+    std::ofstream file(outputFile, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + outputFile);
+    }
+    file << "P6\n" << canvasW << " " << canvasH << "\n255\n";
+    std::cout << "Building " << columns << "x" << rows << " mosaic (" << canvasW << "x" << canvasH << ") from "
+              << inputs.size() << " images\n";
+
+    std::vector<unsigned char> strip(stride * tileH);
+    std::mutex logMutex;
+    for (int r = 0; r < rows; ++r)
+    {
+        std::fill(strip.begin(), strip.end(), 0);
+        int first = r * columns;
+        int count = std::min(columns, static_cast<int>(inputs.size()) - first);
+        parallelRows(count, [&](int c0, int c1)
+        {
+            for (int c = c0; c < c1; ++c)
+            {
+                const std::string &name = inputs[first + c];
+                try
+                {
+                    MappedPPM src(name);
+                    int factor = std::max((src.width + tileW - 1) / tileW, (src.height + tileH - 1) / tileH);
+                    factor = std::max(1, factor);
+                    int tw = src.width / factor, th = src.height / factor;
+                    int x0 = c * tileW + (tileW - tw) / 2, y0 = (tileH - th) / 2;
+                    thumbnail(src, factor, area, strip.data() + stride * y0 + static_cast<size_t>(x0) * 3, stride);
+                }
+                catch (const std::exception &e)
+                {
+                    // A bad input leaves its tile blank rather than failing the whole sheet
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cerr << "Skipping " << name << ": " << e.what() << "\n";
+                }
+            }
+        }, 1);
+
+        file.write(reinterpret_cast<const char *>(strip.data()), strip.size());
+        if (!file)
+        {
+            throw std::runtime_error("Error writing mosaic row " + std::to_string(r));
+        }
+    }
+    std::cout << "PPM file successfully written: " << outputFile << "\n";
+}
+
+// A fixed palette for quantization. Palette indices are what end up in the packed output.
+struct Palette
+{
+    std::string name;
+    int bits = 8;                // bits per packed index (1, 2, 4 or 8)
+    bool gray = false;           // entries are ascending grays, so the index is the gray level
+    std::vector<RGB> colors;
+    int spread[3] = {255, 255, 255};  // spacing between neighbouring levels, used by ordered dithering
+    std::vector<int16_t> cube;   // 32^3 nearest-entry index, -1 where a cell straddles two entries
+};
+
+// An image of palette indices, packed MSB-first into rows of `stride` bytes
+struct IndexedImage
+{
+    int width = 0, height = 0;
+    int bits = 8;
+    size_t stride = 0;
+    bool gray = false;
+    std::vector<RGB> palette;
+    std::vector<unsigned char> data;
+};
+
+// Function to find the nearest palette entry by exhaustive search
+static int nearestColorExact(const Palette &palette, int r, int g, int b)
+{
+    int best = 0, bestDist = std::numeric_limits<int>::max();
+    for (size_t k = 0; k < palette.colors.size(); ++k)
+    {
+        int dr = r - palette.colors[k].r, dg = g - palette.colors[k].g, db = b - palette.colors[k].b;
+        int dist = dr * dr + dg * dg + db * db;
+        if (dist < bestDist)
+        {
+            bestDist = dist;
+            best = static_cast<int>(k);
+        }
+    }
+    return best;
+}
+
+// Function to find the nearest palette entry using the precomputed color cube
+static inline int nearestColor(const Palette &palette, int r, int g, int b)
+{
+    int hit = palette.cube[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+    return hit >= 0 ? hit : nearestColorExact(palette, r, g, b);
+}
+
+// Function to build one of the fixed palettes: bw, gray4, gray16, gray256, rgb8, rgb332
+Palette makePalette(const std::string &name)
+{
+    Palette palette;
+    palette.name = name;
+    if (name == "bw")
+    {
+        // White first so that index 1 means black, exactly like a PBM bit
+        palette.bits = 1;
+        palette.gray = false;
+        palette.colors = {{255, 255, 255}, {0, 0, 0}};
+    }
+    else if (name == "gray4" || name == "gray16" || name == "gray256")
+    {
+        int levels = (name == "gray4") ? 4 : (name == "gray16") ? 16 : 256;
+        palette.bits = (levels == 4) ? 2 : (levels == 16) ? 4 : 8;
+        palette.gray = true;
+        for (int k = 0; k < levels; ++k)
+        {
+            unsigned char v = static_cast<unsigned char>(k * 255 / (levels - 1));
+            palette.colors.push_back({v, v, v});
+        }
+        for (int &s : palette.spread) s = 255 / (levels - 1);
+    }
+    else if (name == "rgb8")
+    {
+        palette.bits = 4;
+        for (int k = 0; k < 8; ++k)
+        {
+            palette.colors.push_back({static_cast<unsigned char>((k & 4) ? 255 : 0),
+                                      static_cast<unsigned char>((k & 2) ? 255 : 0),
+                                      static_cast<unsigned char>((k & 1) ? 255 : 0)});
+        }
+    }
+    else if (name == "rgb332")
+    {
+        palette.bits = 8;
+        for (int k = 0; k < 256; ++k)
+        {
+            palette.colors.push_back({static_cast<unsigned char>((k >> 5) * 255 / 7),
+                                      static_cast<unsigned char>(((k >> 2) & 7) * 255 / 7),
+                                      static_cast<unsigned char>((k & 3) * 255 / 3)});
+        }
+        palette.spread[0] = palette.spread[1] = 255 / 7;
+        palette.spread[2] = 255 / 3;
+    }
+    else
+    {
+        throw std::runtime_error("Unknown palette: " + name + " (expected bw, gray4, gray16, gray256, rgb8 or rgb332)");
+    }
+
+    // A cell whose 8 corners share a nearest entry lies entirely inside that entry's
+    // (convex) Voronoi region, so the cached index is exact; other cells fall back to a search.
+    palette.cube.resize(32 * 32 * 32);
+    for (int cr = 0; cr < 32; ++cr)
+    {
+        for (int cg = 0; cg < 32; ++cg)
+        {
+            for (int cb = 0; cb < 32; ++cb)
+            {
+                int first = -1;
+                bool same = true;
+                for (int k = 0; k < 8 && same; ++k)
+                {
+                    int n = nearestColorExact(palette, cr * 8 + ((k & 4) ? 7 : 0),
+                                              cg * 8 + ((k & 2) ? 7 : 0), cb * 8 + ((k & 1) ? 7 : 0));
+                    if (first < 0)
+                        first = n;
+                    same = (n == first);
+                }
+                palette.cube[(cr << 10) | (cg << 5) | cb] = static_cast<int16_t>(same ? first : -1);
+            }
+        }
+    }
+    return palette;
+}
+
+// Function to create an empty indexed image for a palette
+static IndexedImage makeIndexedImage(int width, int height, const Palette &palette)
+{
+    IndexedImage out;
+    out.width = width;
+    out.height = height;
+    out.bits = palette.bits;
+    out.gray = palette.gray;
+    out.stride = (static_cast<size_t>(width) * palette.bits + 7) / 8;
+    out.palette = palette.colors;
+    out.data.assign(out.stride * height, 0);
+    return out;
+}
+
+// Function to read the palette index of pixel j from a packed row
+static inline int getIndex(const unsigned char *row, int j, int bits)
+{
+    int bit = j * bits;
+    return (row[bit >> 3] >> (8 - bits - (bit & 7))) & ((1 << bits) - 1);
+}
+
+// Function to store the palette index of pixel j into a packed row (the row must start zeroed)
+static inline void setIndex(unsigned char *row, int j, int bits, int index)
+{
+    int bit = j * bits;
+    row[bit >> 3] |= static_cast<unsigned char>(index << (8 - bits - (bit & 7)));
+}
+
+// Function to dither with Floyd-Steinberg error diffusion.
+// Rows are dealt round-robin to the worker threads and run as a wavefront: row i may
+// process pixel j once row i-1 has finished pixel j+1, which is the last pixel that
+// diffuses error into (i, j). The output is identical to a sequential pass.
+IndexedImage ditherFloydSteinberg(const std::vector<std::vector<RGB>> &image, const Palette &palette)
+{
+    int height = image.size();
+    int width = image[0].size();
+    IndexedImage out = makeIndexedImage(width, height, palette);
+
+    const int chunk = 64;
+    int threads = std::max(1, std::min(workerCount(), height));
+    int ring = threads + 2;
+
+    // Error rows are accumulated x16 with one pixel of padding on each side. A row
+    // zeroes its entries as it consumes them so the ring can be reused further down.
+    // The padding is never read; it is reset by the row that diffuses into it, which is
+    // its only writer, so no other thread touches it at the same time.
+    std::vector<std::vector<int>> errors(ring, std::vector<int>((width + 2) * 3, 0));
+    std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[height]);
+    for (int i = 0; i < height; ++i)
+    {
+        progress[i].store(0);
+    }
+
+    auto runRows = [&](int t)
+    {
+        for (int i = t; i < height; i += threads)
+        {
+            int *cur = errors[i % ring].data() + 3;
+            int *next = errors[(i + 1) % ring].data() + 3;
+            unsigned char *packed = out.data.data() + out.stride * i;
+            const RGB *src = image[i].data();
+            next[-3] = next[-2] = next[-1] = 0;
+            next[width * 3] = next[width * 3 + 1] = next[width * 3 + 2] = 0;
+
+            int carry[3] = {0, 0, 0};
+            for (int j0 = 0; j0 < width; j0 += chunk)
+            {
+                int j1 = std::min(width, j0 + chunk);
+                // A cancelled wavefront just stops; rows waiting on it see the flag too
+                if (cancelRequested())
+                    return;
+                if (i > 0)
+                {
+                    int need = std::min(width, j1 + 1);
+                    while (progress[i - 1].load(std::memory_order_acquire) < need)
+                    {
+                        if (cancelRequested())
+                            return;
+                        std::this_thread::yield();
+                    }
+                }
+
+                for (int j = j0; j < j1; ++j)
+                {
+                    int value[3] = {src[j].r, src[j].g, src[j].b};
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        int acc = cur[j * 3 + c] + carry[c];
+                        cur[j * 3 + c] = 0;
+                        value[c] = std::min(255, std::max(0, value[c] + ((acc + 8) >> 4)));
+                    }
+
+                    int index = nearestColor(palette, value[0], value[1], value[2]);
+                    setIndex(packed, j, out.bits, index);
+
+                    const RGB &chosen = palette.colors[index];
+                    int err[3] = {value[0] - chosen.r, value[1] - chosen.g, value[2] - chosen.b};
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        carry[c] = err[c] * 7;
+                        next[(j - 1) * 3 + c] += err[c] * 3;
+                        next[j * 3 + c] += err[c] * 5;
+                        next[(j + 1) * 3 + c] += err[c];
+                    }
+                }
+                progress[i].store(j1, std::memory_order_release);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+    {
+        pool.emplace_back(runRows, t);
+    }
+    runRows(0);
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+    if (cancelRequested())
+        throw OperationCancelled();
+    return out;
+}
+
+// Function to dither with an 8x8 ordered (Bayer) threshold matrix
+IndexedImage ditherBayer(const std::vector<std::vector<RGB>> &image, const Palette &palette)
+{
+    static const int bayer[8][8] = {
+        {0, 32, 8, 40, 2, 34, 10, 42},    {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44, 4, 36, 14, 46, 6, 38},   {60, 28, 52, 20, 62, 30, 54, 22},
+        {3, 35, 11, 43, 1, 33, 9, 41},    {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47, 7, 39, 13, 45, 5, 37},   {63, 31, 55, 23, 61, 29, 53, 21}};
+
+    int height = image.size();
+    int width = image[0].size();
+    IndexedImage out = makeIndexedImage(width, height, palette);
+
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            unsigned char *packed = out.data.data() + out.stride * i;
+            for (int j = 0; j < width; ++j)
+            {
+                // Offset in (-spread/2, spread/2) centred on the matrix cell
+                int t = 2 * bayer[i & 7][j & 7] + 1 - 64;
+                const RGB &p = image[i][j];
+                int r = std::min(255, std::max(0, p.r + t * palette.spread[0] / 128));
+                int g = std::min(255, std::max(0, p.g + t * palette.spread[1] / 128));
+                int b = std::min(255, std::max(0, p.b + t * palette.spread[2] / 128));
+                setIndex(packed, j, out.bits, nearestColor(palette, r, g, b));
+            }
+        }
+    });
+    return out;
+}
+
+// Function to expand an indexed image back to RGB so later operators can run on it
+std::vector<std::vector<RGB>> expandIndexed(const IndexedImage &indexed)
+{
+    std::vector<std::vector<RGB>> image(indexed.height, std::vector<RGB>(indexed.width));
+    parallelRows(indexed.height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            const unsigned char *packed = indexed.data.data() + indexed.stride * i;
+            for (int j = 0; j < indexed.width; ++j)
+            {
+                image[i][j] = indexed.palette[getIndex(packed, j, indexed.bits)];
+            }
+        }
+    });
+    return image;
+}
+
+// Function to write an indexed image: black/white as packed P4, gray palettes as P5
+// holding the level directly (maxval = levels - 1), anything else expanded to P6
+void writeIndexed(const std::string &filename, const IndexedImage &indexed)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    bool bw = indexed.bits == 1 && indexed.palette.size() == 2 &&
+              indexed.palette[0].r == 255 && indexed.palette[1].r == 0;
+    if (bw)
+    {
+        file << "P4\n" << indexed.width << " " << indexed.height << "\n";
+        std::cout << "Writing PBM file: " << filename << "\n";
+        file.write(reinterpret_cast<const char *>(indexed.data.data()), indexed.data.size());
+    }
+    else if (indexed.gray)
+    {
+        file << "P5\n" << indexed.width << " " << indexed.height << "\n" << indexed.palette.size() - 1 << "\n";
+        std::cout << "Writing PGM file: " << filename << "\n";
+        std::vector<unsigned char> row(indexed.width);
+        for (int i = 0; i < indexed.height; ++i)
+        {
+            const unsigned char *packed = indexed.data.data() + indexed.stride * i;
+            for (int j = 0; j < indexed.width; ++j)
+            {
+                row[j] = static_cast<unsigned char>(getIndex(packed, j, indexed.bits));
+            }
+            file.write(reinterpret_cast<const char *>(row.data()), row.size());
+        }
+    }
+    else
+    {
+        file << "P6\n" << indexed.width << " " << indexed.height << "\n255\n";
+        std::cout << "Writing PPM file: " << filename << "\n";
+        std::vector<RGB> row(indexed.width);
+        for (int i = 0; i < indexed.height; ++i)
+        {
+            const unsigned char *packed = indexed.data.data() + indexed.stride * i;
+            for (int j = 0; j < indexed.width; ++j)
+            {
+                row[j] = indexed.palette[getIndex(packed, j, indexed.bits)];
+            }
+            file.write(reinterpret_cast<const char *>(row.data()), row.size() * 3);
+        }
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Error writing indexed image: " + filename);
+    }
+    std::cout << "Indexed file successfully written: " << filename << "\n";
+}
+
+// Function to pack one row of a bilevel image: bit j (MSB first) is set, i.e. black,
+// where gray[j] < limit[j]. SSE2 compares 16 pixels at a time and movemask gathers
+// their sign bits; movemask is LSB-first, so each mask byte is bit-reversed for PBM.
+static void packBelow(const unsigned char *gray, const unsigned char *limit, int width, unsigned char *packed)
+{
+    static unsigned char reversed[256];
+    static const bool ready = []()
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            int r = 0;
+            for (int b = 0; b < 8; ++b)
+                if (v & (1 << b))
+                    r |= 0x80 >> b;
+            reversed[v] = static_cast<unsigned char>(r);
+        }
+        return true;
+    }();
+    (void)ready;
+
+    int j = 0;
+#if defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+    for (; j + 16 <= width; j += 16)
+    {
+        // Unsigned a < b via a signed compare after flipping the top bit
+        __m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(gray + j)), bias);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(limit + j)), bias);
+        int mask = _mm_movemask_epi8(_mm_cmplt_epi8(a, b));
+        packed[j >> 3] = reversed[mask & 0xFF];
+        packed[(j >> 3) + 1] = reversed[mask >> 8];
+    }
+#endif
+    for (; j < width; j += 8)
+    {
+        unsigned char bits = 0;
+        for (int b = 0; b < 8 && j + b < width; ++b)
+        {
+            if (gray[j + b] < limit[j + b])
+                bits |= static_cast<unsigned char>(0x80 >> b);
+        }
+        packed[j >> 3] = bits;
+    }
+}
+
+// Function to compute the gray value of one row, the same average grayscale() uses
+static void grayRow(const RGB *row, unsigned char *gray, int width)
+{
+    for (int j = 0; j < width; ++j)
+    {
+        gray[j] = static_cast<unsigned char>((row[j].r + row[j].g + row[j].b) / 3);
+    }
+}
+
+// Function to binarize with a global threshold: pixels darker than `level` become black
+IndexedImage thresholdGlobal(const std::vector<std::vector<RGB>> &image, int level)
+{
+    int height = image.size();
+    int width = image[0].size();
+    IndexedImage out = makeIndexedImage(width, height, makePalette("bw"));
+    std::vector<unsigned char> limit(width, static_cast<unsigned char>(std::min(255, std::max(0, level))));
+
+    parallelRows(height, [&](int first, int last)
+    {
+        std::vector<unsigned char> gray(width);
+        for (int i = first; i < last; ++i)
+        {
+            grayRow(image[i].data(), gray.data(), width);
+            packBelow(gray.data(), limit.data(), width, out.data.data() + out.stride * i);
+        }
+    });
+    return out;
+}
+
+// Function to binarize against the local mean of a (2 * radius + 1)^2 window minus an offset.
+// Window sums come from an integral image, so the cost does not depend on the radius.
+IndexedImage thresholdAdaptive(const std::vector<std::vector<RGB>> &image, int radius, int offset)
+{
+    int height = image.size();
+    int width = image[0].size();
+    // A larger window would cover the whole image anyway; a negative one has no meaning
+    int maxRadius = std::max(width, height);
+    if (radius < 0 || radius > maxRadius)
+        throw std::runtime_error("Invalid adaptive threshold radius (0-" + std::to_string(maxRadius) +
+                                 "): " + std::to_string(radius));
+    IndexedImage out = makeIndexedImage(width, height, makePalette("bw"));
+    size_t stride = static_cast<size_t>(width) + 1;
+
+    // Gray plane and per-row prefix sums; row 0 and column 0 of the integral stay zero
+    std::vector<unsigned char> gray(static_cast<size_t>(width) * height);
+    std::vector<uint64_t> integral(stride * (height + 1), 0);
+    parallelRows(height, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+        {
+            unsigned char *g = gray.data() + static_cast<size_t>(i) * width;
+            grayRow(image[i].data(), g, width);
+            uint64_t *row = integral.data() + stride * (i + 1);
+            uint64_t sum = 0;
+            for (int j = 0; j < width; ++j)
+            {
+                sum += g[j];
+                row[j + 1] = sum;
+            }
+        }
+    });
+
+    // Column accumulation: "rows" here are strips of columns, each running top to bottom
+    parallelRows(width + 1, [&](int c0, int c1)
+    {
+        for (int i = 1; i <= height; ++i)
+        {
+            uint64_t *row = integral.data() + stride * i;
+            const uint64_t *above = row - stride;
+            for (int j = c0; j < c1; ++j)
+            {
+                row[j] += above[j];
+            }
+        }
+    }, 256);
+
+    parallelRows(height, [&](int first, int last)
+    {
+        std::vector<unsigned char> limit(width);
+        for (int i = first; i < last; ++i)
+        {
+            int top = std::max(0, i - radius), bottom = std::min(height, i + radius + 1);
+            const uint64_t *rowTop = integral.data() + stride * top;
+            const uint64_t *rowBottom = integral.data() + stride * bottom;
+            for (int j = 0; j < width; ++j)
+            {
+                int left = std::max(0, j - radius), right = std::min(width, j + radius + 1);
+                uint64_t sum = rowBottom[right] - rowBottom[left] - rowTop[right] + rowTop[left];
+                int count = (bottom - top) * (right - left);
+                int mean = static_cast<int>(sum / count);
+                limit[j] = static_cast<unsigned char>(std::min(255, std::max(0, mean - offset)));
+            }
+            packBelow(gray.data() + static_cast<size_t>(i) * width, limit.data(), width,
+                      out.data.data() + out.stride * i);
+        }
+    });
+    return out;
+}
+
+// Function to read a PBM (P4) file straight into packed rows
+IndexedImage readPBM(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+
+    std::string magic;
+    file >> magic;
+    if (magic != "P4")
+    {
+        throw std::runtime_error("Invalid PBM format: " + magic);
+    }
+
+    PPMInfo header = readPNMHeader(file, filename);
+    int width = header.width, height = header.height;
+    if (width <= 0 || height <= 0)
+    {
+        throw std::runtime_error("Invalid PBM dimensions in " + filename);
+    }
+
+    std::cout << "PBM File: " << filename << "\n";
+    std::cout << "Width: " << width << ", Height: " << height << "\n";
+
+    IndexedImage image = makeIndexedImage(width, height, makePalette("bw"));
+    file.read(reinterpret_cast<char *>(image.data.data()), image.data.size());
+    if (file.gcount() != static_cast<std::streamsize>(image.data.size()))
+    {
+        throw std::runtime_error("Error reading PBM pixel data: " + filename);
+    }
+
+    // Padding bits at the end of each row are undefined in PBM; clear them
+    int tail = width % 8;
+    if (tail != 0)
+    {
+        unsigned char keep = static_cast<unsigned char>(0xFF << (8 - tail));
+        for (int i = 0; i < height; ++i)
+        {
+            image.data[image.stride * i + image.stride - 1] &= keep;
+        }
+    }
+    return image;
+}
+
+// Function to read the magic number of a PNM file ("P4", "P6", ...)
+std::string readMagic(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    char magic[2] = {0, 0};
+    file.read(magic, 2);
+    return std::string(magic, 2);
+}
+
+// Connected-component labeling of a bilevel mask. Foreground is ink: set bits of a packed
+// 1-bit image, or RGB pixels darker than mid-gray. The image is cut into bands of
+// kLabelBand rows that are labeled independently on the worker threads with a
+// union-find over provisional labels. Each finished band adds its components to a shared
+// union-find table and is merged with whichever neighbouring bands are already done
+// along their common border, after which those border rows are dropped. Nothing the size
+// of the image is kept: final labels are produced by labeling each band again and
+// mapping its components through the resolved table.
+struct ComponentStats
+{
+    uint64_t area = 0;
+    uint64_t first = 0;  // raster index of the first pixel, which orders the final labels
+    uint64_t sumX = 0, sumY = 0;
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    void add(const ComponentStats &other)
+    {
+        area += other.area;
+        first = std::min(first, other.first);
+        sumX += other.sumX;
+        sumY += other.sumY;
+        x0 = std::min(x0, other.x0);
+        y0 = std::min(y0, other.y0);
+        x1 = std::max(x1, other.x1);
+        y1 = std::max(y1, other.y1);
+    }
+};
+
+// Fills mask[0, width) with 1 where row i is foreground and 0 elsewhere
+using MaskSource = std::function<void(int, unsigned char *)>;
+
+static const int kLabelBand = 64;
+
+// Function to label the rows [y0, y1) on their own. labels receives, row-major, 0 for
+// background or 1..n in raster order of each component's first pixel; stats, if given,
+// gets one entry per component in the same order. Returns n.
+static uint32_t labelBand(const MaskSource &source, int width, int y0, int y1, bool eight,
+                          std::vector<uint32_t> &labels, std::vector<ComponentStats> *stats)
+{
+    int rows = y1 - y0;
+    labels.assign(static_cast<size_t>(rows) * width, 0);
+    std::vector<uint32_t> parent(1, 0);  // provisional label 0 is background
+    std::vector<unsigned char> mask(width);
+    auto find = [&](uint32_t a)
+    {
+        while (parent[a] != a)
+        {
+            parent[a] = parent[parent[a]];
+            a = parent[a];
+        }
+        return a;
+    };
+
+    for (int r = 0; r < rows; ++r)
+    {
+        source(y0 + r, mask.data());
+        uint32_t *row = labels.data() + static_cast<size_t>(r) * width;
+        const uint32_t *up = r > 0 ? row - width : nullptr;
+        for (int j = 0; j < width; ++j)
+        {
+            if (!mask[j])
+                continue;
+            uint32_t neighbours[4];
+            int count = 0;
+            if (j > 0 && row[j - 1])
+                neighbours[count++] = row[j - 1];
+            if (up)
+            {
+                if (up[j])
+                    neighbours[count++] = up[j];
+                if (eight && j > 0 && up[j - 1])
+                    neighbours[count++] = up[j - 1];
+                if (eight && j + 1 < width && up[j + 1])
+                    neighbours[count++] = up[j + 1];
+            }
+            if (count == 0)
+            {
+                row[j] = static_cast<uint32_t>(parent.size());
+                parent.push_back(row[j]);
+                continue;
+            }
+            uint32_t root = find(neighbours[0]);
+            for (int k = 1; k < count; ++k)
+            {
+                uint32_t other = find(neighbours[k]);
+                if (other < root)
+                    std::swap(other, root);
+                parent[other] = root;
+            }
+            row[j] = root;
+        }
+    }
+
+    std::vector<uint32_t> compact(parent.size(), 0);
+    uint32_t n = 0;
+    for (int r = 0; r < rows; ++r)
+    {
+        uint32_t *row = labels.data() + static_cast<size_t>(r) * width;
+        int y = y0 + r;
+        for (int j = 0; j < width; ++j)
+        {
+            if (!row[j])
+                continue;
+            uint32_t root = find(row[j]);
+            if (!compact[root])
+            {
+                compact[root] = ++n;
+                if (stats)
+                {
+                    ComponentStats s;
+                    s.first = static_cast<uint64_t>(y) * width + j;
+                    s.x0 = s.x1 = j;
+                    s.y0 = s.y1 = y;
+                    stats->push_back(s);
+                }
+            }
+            row[j] = compact[root];
+            if (stats)
+            {
+                ComponentStats &s = (*stats)[row[j] - 1];
+                ++s.area;
+                s.sumX += j;
+                s.sumY += y;
+                s.x0 = std::min(s.x0, j);
+                s.x1 = std::max(s.x1, j);
+                s.y1 = y;
+            }
+        }
+    }
+    return n;
+}
+
+// The components of a whole image, resolved across bands
+struct ComponentLabels
+{
+    int width = 0, height = 0;
+    bool eight = true;
+    std::vector<uint32_t> bandBase;          // table index of each band's first component
+    std::vector<uint32_t> finalLabel;        // table index -> final label
+    std::vector<ComponentStats> components;  // final label - 1 -> stats
+};
+
+// Function to find the components of a width x height mask with 4- or 8-connectivity
+ComponentLabels findComponents(const MaskSource &source, int width, int height, bool eight)
+{
+    int bands = (height + kLabelBand - 1) / kLabelBand;
+    ComponentLabels result;
+    result.width = width;
+    result.height = height;
+    result.eight = eight;
+    result.bandBase.assign(bands, 0);
+
+    // Union-find over every band's components; roots carry the merged stats
+    std::vector<uint32_t> parent;
+    std::vector<ComponentStats> stats;
+    auto find = [&](uint32_t a)
+    {
+        while (parent[a] != a)
+        {
+            parent[a] = parent[parent[a]];
+            a = parent[a];
+        }
+        return a;
+    };
+    auto unite = [&](uint32_t a, uint32_t b)
+    {
+        a = find(a);
+        b = find(b);
+        if (a == b)
+            return;
+        if (b < a)
+            std::swap(a, b);
+        parent[b] = a;
+        stats[a].add(stats[b]);
+    };
+
+    // Border rows of finished bands, as table indices (0 is background, so index + 1)
+    std::vector<std::vector<uint32_t>> topRow(bands), bottomRow(bands);
+    std::vector<bool> done(bands, false);
+    std::mutex tableMutex;
+    auto mergeBorder = [&](int upper)
+    {
+        const uint32_t *u = bottomRow[upper].data(), *l = topRow[upper + 1].data();
+        for (int j = 0; j < width; ++j)
+        {
+            if (!l[j])
+                continue;
+            if (u[j])
+                unite(u[j] - 1, l[j] - 1);
+            if (eight && j > 0 && u[j - 1])
+                unite(u[j - 1] - 1, l[j] - 1);
+            if (eight && j + 1 < width && u[j + 1])
+                unite(u[j + 1] - 1, l[j] - 1);
+        }
+        std::vector<uint32_t>().swap(bottomRow[upper]);
+        std::vector<uint32_t>().swap(topRow[upper + 1]);
+    };
+
+    parallelRows(height, [&](int y0, int y1)
+    {
+        std::vector<uint32_t> labels;
+        std::vector<ComponentStats> local;
+        uint32_t n = labelBand(source, width, y0, y1, eight, labels, &local);
+        int band = y0 / kLabelBand;
+
+        std::lock_guard<std::mutex> lock(tableMutex);
+        uint32_t base = static_cast<uint32_t>(parent.size());
+        if (static_cast<uint64_t>(base) + n > UINT32_MAX)
+            throw std::runtime_error("Too many components to label");
+        result.bandBase[band] = base;
+        for (uint32_t k = 0; k < n; ++k)
+            parent.push_back(base + k);
+        stats.insert(stats.end(), local.begin(), local.end());
+        auto border = [&](int r)
+        {
+            std::vector<uint32_t> row(labels.begin() + static_cast<size_t>(r) * width,
+                                      labels.begin() + static_cast<size_t>(r + 1) * width);
+            for (uint32_t &v : row)
+                if (v)
+                    v += base;
+            return row;
+        };
+        topRow[band] = border(0);
+        bottomRow[band] = border(y1 - y0 - 1);
+        done[band] = true;
+        if (band > 0 && done[band - 1])
+            mergeBorder(band - 1);
+        if (band + 1 < bands && done[band + 1])
+            mergeBorder(band);
+    }, kLabelBand);
+
+    // Final labels follow the raster order of each component's first pixel, so they do
+    // not depend on the band size or on which thread finished first
+    std::vector<uint32_t> roots;
+    for (uint32_t k = 0; k < parent.size(); ++k)
+        if (find(k) == k)
+            roots.push_back(k);
+    std::sort(roots.begin(), roots.end(), [&](uint32_t a, uint32_t b) { return stats[a].first < stats[b].first; });
+    std::vector<uint32_t> rootLabel(parent.size(), 0);
+    for (size_t k = 0; k < roots.size(); ++k)
+    {
+        rootLabel[roots[k]] = static_cast<uint32_t>(k + 1);
+        result.components.push_back(stats[roots[k]]);
+    }
+    result.finalLabel.resize(parent.size());
+    for (uint32_t k = 0; k < parent.size(); ++k)
+        result.finalLabel[k] = rootLabel[find(k)];
+    return result;
+}
+
+// Function to produce the final labels of the band starting at row y0, which must be a
+// multiple of kLabelBand so that it is labeled exactly as findComponents saw it
+void componentBand(const ComponentLabels &cl, const MaskSource &source, int y0, std::vector<uint32_t> &labels)
+{
+    int y1 = std::min(cl.height, y0 + kLabelBand);
+    labelBand(source, cl.width, y0, y1, cl.eight, labels, nullptr);
+    uint32_t base = cl.bandBase[y0 / kLabelBand];
+    for (uint32_t &v : labels)
+        if (v)
+            v = cl.finalLabel[base + v - 1];
+}
+
+// Function to encode a row of labels as RGB, label = r * 65536 + g * 256 + b
+void labelsToRGB(const uint32_t *labels, RGB *out, int width)
+{
+    for (int j = 0; j < width; ++j)
+        out[j] = {static_cast<unsigned char>(labels[j] >> 16), static_cast<unsigned char>(labels[j] >> 8),
+                  static_cast<unsigned char>(labels[j])};
+}
+
+// Mask sources for packed 1-bit rows (set bit = foreground) and for RGB rows
+MaskSource packedMask(const unsigned char *data, size_t stride, int width)
+{
+    return [=](int i, unsigned char *mask)
+    {
+        const unsigned char *row = data + stride * i;
+        for (int j = 0; j < width; ++j)
+            mask[j] = (row[j >> 3] >> (7 - (j & 7))) & 1;
+    };
+}
+
+MaskSource rgbMask(const std::vector<std::vector<RGB>> &image)
+{
+    return [&image](int i, unsigned char *mask)
+    {
+        const RGB *row = image[i].data();
+        for (size_t j = 0; j < image[i].size(); ++j)
+            mask[j] = (row[j].r + row[j].g + row[j].b) < 3 * 128;
+    };
+}
+
+// Function to write per-component stats as JSON (via a temporary file and rename)
+void writeComponentStats(const std::string &filename, const ComponentLabels &cl)
+{
+    uint64_t foreground = 0;
+    for (const auto &s : cl.components)
+        foreground += s.area;
+    // Written straight to the file: with millions of components the text outweighs the table
+    std::string temp = filename + ".tmp";
+    std::ofstream json(temp);
+    json << std::fixed << std::setprecision(2);
+    json << "{\n  \"width\": " << cl.width << ",\n  \"height\": " << cl.height << ",\n  \"connectivity\": "
+         << (cl.eight ? 8 : 4) << ",\n  \"components\": " << cl.components.size()
+         << ",\n  \"foreground_pixels\": " << foreground << ",\n  \"items\": [";
+    for (size_t k = 0; k < cl.components.size(); ++k)
+    {
+        const ComponentStats &s = cl.components[k];
+        json << (k ? "," : "") << "\n    {\"label\": " << k + 1 << ", \"area\": " << s.area << ", \"bbox\": [" << s.x0
+             << ", " << s.y0 << ", " << s.x1 << ", " << s.y1 << "], \"centroid\": ["
+             << static_cast<double>(s.sumX) / s.area << ", " << static_cast<double>(s.sumY) / s.area << "]}";
+    }
+    json << "\n  ]\n}\n";
+    json.close();
+    if (!json || std::rename(temp.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Cannot write component stats: " + filename);
+}
+
+// Function to label the components of an image held in memory, replacing it with its
+// label image. A 1-bit indexed image is read packed, without expanding it to RGB.
+ComponentLabels labelComponents(std::vector<std::vector<RGB>> &image, const IndexedImage *packed, bool eight)
+{
+    int width = packed ? packed->width : static_cast<int>(image[0].size());
+    int height = packed ? packed->height : static_cast<int>(image.size());
+    MaskSource source = packed ? packedMask(packed->data.data(), packed->stride, width) : rgbMask(image);
+    ComponentLabels cl = findComponents(source, width, height, eight);
+    if (cl.components.size() > 0xFFFFFF)
+        throw std::runtime_error("Too many components for a 24-bit label image: " + std::to_string(cl.components.size()));
+
+    std::vector<std::vector<RGB>> result(height, std::vector<RGB>(width));
+    parallelRows(height, [&](int y0, int y1)
+    {
+        std::vector<uint32_t> labels;
+        componentBand(cl, source, y0, labels);
+        for (int i = y0; i < y1; ++i)
+            labelsToRGB(labels.data() + static_cast<size_t>(i - y0) * width, result[i].data(), width);
+    }, kLabelBand);
+    image.swap(result);
+    return cl;
+}
+
+// Function to label a P4 file straight into a P6 label image. The input stays mapped and
+// the output is written in chunks of bands, so memory stays at a few bands per thread
+// plus the component table, however large the mask.
+ComponentLabels labelComponentsFile(const std::string &inputFile, const std::string &outputFile, bool eight)
+{
+    MappedPPM input(inputFile, "P4");
+    std::error_code ec;
+    if (std::filesystem::equivalent(outputFile, inputFile, ec))
+        throw std::runtime_error("Output file must differ from the input: " + outputFile);
+    int width = input.width, height = input.height;
+    MaskSource source = packedMask(input.pixels, input.rowBytes, width);
+    std::cout << "Labeling " << width << "x" << height << " mask from " << inputFile << "\n";
+    ComponentLabels cl = findComponents(source, width, height, eight);
+    if (cl.components.size() > 0xFFFFFF)
+        throw std::runtime_error("Too many components for a 24-bit label image: " + std::to_string(cl.components.size()));
+
+    std::ofstream file(outputFile, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        throw std::runtime_error("Cannot open file: " + outputFile);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    size_t rowBytes = static_cast<size_t>(width) * 3;
+    int chunkRows = kLabelBand * workerCount();
+    std::vector<RGB> chunk(static_cast<size_t>(width) * std::min(chunkRows, height));
+    for (int c0 = 0; c0 < height; c0 += chunkRows)
+    {
+        int rows = std::min(chunkRows, height - c0);
+        parallelRows(rows, [&](int first, int last)
+        {
+            std::vector<uint32_t> labels;
+            componentBand(cl, source, c0 + first, labels);
+            for (int i = first; i < last; ++i)
+                labelsToRGB(labels.data() + static_cast<size_t>(i - first) * width, chunk.data() + static_cast<size_t>(i) * width,
+                            width);
+        }, kLabelBand);
+        file.write(reinterpret_cast<const char *>(chunk.data()), rowBytes * rows);
+        if (!file)
+            throw std::runtime_error("Error writing pixel data at row " + std::to_string(c0));
+    }
+    return cl;
+}
+
+// Log-linear latency histogram in microseconds (HDR style): exact below 64 us, then 32
+// sub-buckets per power of two up to about 12 days, so every value is kept to within 3%.
+// Anything longer (or a bogus clock delta) is counted in the last bucket.
+// Only the owning thread writes, so updates are plain relaxed stores; an exporter may read
+// it concurrently and sees each counter either before or after an update.
+struct LatencyHistogram
+{
+    static constexpr int kSubBits = 5;
+    static constexpr int kSub = 1 << kSubBits;
+    static constexpr int kMaxShift = 35;
+    static constexpr int kBuckets = 2 * kSub + kMaxShift * kSub;
+
+    std::atomic<uint64_t> counts[kBuckets];
+    std::atomic<uint64_t> total, sum, max;
+
+    LatencyHistogram() : total(0), sum(0), max(0)
+    {
+        for (auto &count : counts)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+    static int bucketOf(uint64_t us)
+    {
+        if (us < 2 * kSub)
+            return static_cast<int>(us);
+        int shift = std::min(kMaxShift, 63 - __builtin_clzll(us) - kSubBits);
+        uint64_t sub = std::min<uint64_t>(us >> shift, 2 * kSub - 1);
+        return 2 * kSub + (shift - 1) * kSub + static_cast<int>(sub - kSub);
+    }
+
+    // Middle of the range of values that fall in bucket b
+    static double bucketValue(int b)
+    {
+        if (b < 2 * kSub)
+            return b;
+        int shift = (b - 2 * kSub) / kSub + 1;
+        uint64_t sub = kSub + (b - 2 * kSub) % kSub;
+        return (static_cast<double>(sub) + 0.5) * static_cast<double>(uint64_t(1) << shift);
+    }
+
+    void record(uint64_t us)
+    {
+        std::atomic<uint64_t> &count = counts[bucketOf(us)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+        if (us > max.load(std::memory_order_relaxed))
+            max.store(us, std::memory_order_relaxed);
+    }
+};
+
+// Merged view of one series across every thread's recorder
+struct HistogramSnapshot
+{
+    std::vector<uint64_t> counts = std::vector<uint64_t>(LatencyHistogram::kBuckets);
+    uint64_t total = 0, sum = 0, max = 0;
+
+    void add(const LatencyHistogram &h)
+    {
+        for (int b = 0; b < LatencyHistogram::kBuckets; ++b)
+            counts[b] += h.counts[b].load(std::memory_order_relaxed);
+        total += h.total.load(std::memory_order_relaxed);
+        sum += h.sum.load(std::memory_order_relaxed);
+        max = std::max(max, h.max.load(std::memory_order_relaxed));
+    }
+
+    // Latency in seconds below which a fraction q of the samples fall
+    double quantile(double q) const
+    {
+        uint64_t seen = 0, n = 0;
+        for (uint64_t c : counts)
+            n += c;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * n)));
+        for (int b = 0; b < LatencyHistogram::kBuckets; ++b)
+        {
+            seen += counts[b];
+            if (seen >= rank)
+                return std::min(LatencyHistogram::bucketValue(b), static_cast<double>(max)) / 1e6;
+        }
+        return max / 1e6;
+    }
+};
+
+// Each thread records into its own recorder, created on first use and kept after the thread
+// exits so no samples are lost. Series slots are filled once by their owner and published
+// with a release store; the mutex below is taken only to register threads and series names.
+struct MetricsRecorder
+{
+    static constexpr int kMaxSeries = 128;
+    std::atomic<LatencyHistogram *> series[kMaxSeries];
+
+    MetricsRecorder()
+    {
+        for (auto &slot : series)
+            slot.store(nullptr, std::memory_order_relaxed);
+    }
+    ~MetricsRecorder()
+    {
+        for (auto &slot : series)
+            delete slot.load();
+    }
+};
+
+static bool g_metricsEnabled = false;
+static std::mutex g_metricsMutex;
+static std::vector<std::unique_ptr<MetricsRecorder>> g_recorders;
+static std::vector<std::pair<std::string, std::string>> g_series;  // metric name, label set
+static std::atomic<uint64_t> g_imagesDone(0), g_imageErrors(0), g_pixelsDone(0);
+static const auto g_metricsStart = std::chrono::steady_clock::now();
+thread_local MetricsRecorder *t_recorder = nullptr;
+thread_local std::map<std::string, int> t_seriesIds;
+
+// Function to record one latency sample, e.g. recordLatency("proj02_stage_seconds", "stage=\"-b\"", 0.25)
+void recordLatency(const std::string &metric, const std::string &labels, double seconds)
+{
+    if (!g_metricsEnabled)
+        return;
+    std::string key = metric + "{" + labels + "}";
+    auto it = t_seriesIds.find(key);
+    if (it == t_seriesIds.end() || !t_recorder)
+    {
+        std::lock_guard<std::mutex> lock(g_metricsMutex);
+        if (!t_recorder)
+        {
+            g_recorders.emplace_back(new MetricsRecorder());
+            t_recorder = g_recorders.back().get();
+        }
+        if (it == t_seriesIds.end())
+        {
+            auto found = std::find(g_series.begin(), g_series.end(), std::make_pair(metric, labels));
+            int id = static_cast<int>(found - g_series.begin());
+            if (found == g_series.end())
+            {
+                if (id >= MetricsRecorder::kMaxSeries)
+                    return;  // label sets are a small fixed vocabulary; ignore anything past it
+                g_series.emplace_back(metric, labels);
+            }
+            it = t_seriesIds.emplace(key, id).first;
+        }
+    }
+    std::atomic<LatencyHistogram *> &slot = t_recorder->series[it->second];
+    LatencyHistogram *histogram = slot.load(std::memory_order_relaxed);
+    if (!histogram)
+    {
+        histogram = new LatencyHistogram();
+        slot.store(histogram, std::memory_order_release);
+    }
+    histogram->record(static_cast<uint64_t>(std::max(0.0, seconds) * 1e6 + 0.5));
+}
+
+// Function to name the size bucket an image of the given pixel count is reported under
+std::string sizeBucket(uint64_t pixels)
+{
+    double mp = pixels / 1e6;
+    return mp < 1 ? "<1MP" : mp < 4 ? "1-4MP" : mp < 16 ? "4-16MP" : mp < 64 ? "16-64MP" : ">=64MP";
+}
+
+// Function to record a finished (or failed) image: latency by size bucket plus the counters
+void recordImage(double seconds, uint64_t pixels, bool ok)
+{
+    if (!g_metricsEnabled)
+        return;
+    g_imagesDone.fetch_add(1, std::memory_order_relaxed);
+    if (!ok)
+    {
+        g_imageErrors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    g_pixelsDone.fetch_add(pixels, std::memory_order_relaxed);
+    recordLatency("proj02_image_seconds", "size=\"" + sizeBucket(pixels) + "\"", seconds);
+}
+
+// Function to write the metrics as a Prometheus textfile (<prefix>.prom) and as JSON
+// (<prefix>.json). Each file is written beside its target and renamed over it, so a
+// scraper never reads a half-written file.
+void writeMetrics(const std::string &prefix)
+{
+    std::vector<std::pair<std::string, std::string>> series;
+    std::vector<HistogramSnapshot> snapshots;
+    {
+        std::lock_guard<std::mutex> lock(g_metricsMutex);
+        series = g_series;
+        snapshots.resize(series.size());
+        for (const auto &recorder : g_recorders)
+        {
+            for (size_t s = 0; s < series.size(); ++s)
+            {
+                const LatencyHistogram *h = recorder->series[s].load(std::memory_order_acquire);
+                if (h)
+                    snapshots[s].add(*h);
+            }
+        }
+    }
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_metricsStart).count();
+    uint64_t images = g_imagesDone.load(), errors = g_imageErrors.load(), pixels = g_pixelsDone.load();
+    const double quantiles[] = {0.5, 0.95, 0.99};
+
+    // The exposition format wants each family's samples together, after its HELP and TYPE
+    std::vector<size_t> order(series.size());
+    for (size_t s = 0; s < order.size(); ++s)
+        order[s] = s;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return series[a].first < series[b].first; });
+
+    std::ostringstream prom;
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        size_t s = order[k];
+        const std::string &name = series[s].first, &labels = series[s].second;
+        if (k == 0 || series[order[k - 1]].first != name)
+        {
+            prom << "# HELP " << name << " Wall time in seconds per "
+                 << (name == "proj02_image_seconds" ? "image, by size bucket" : "option applied to an image") << "\n"
+                 << "# TYPE " << name << " summary\n";
+        }
+        for (double q : quantiles)
+            prom << name << "{" << labels << ",quantile=\"" << q << "\"} " << snapshots[s].quantile(q) << "\n";
+        prom << name << "_sum{" << labels << "} " << snapshots[s].sum / 1e6 << "\n"
+             << name << "_count{" << labels << "} " << snapshots[s].total << "\n";
+    }
+    prom << "# TYPE proj02_images_total counter\nproj02_images_total " << images << "\n"
+         << "# TYPE proj02_image_errors_total counter\nproj02_image_errors_total " << errors << "\n"
+         << "# TYPE proj02_pixels_total counter\nproj02_pixels_total " << pixels << "\n"
+         << "# TYPE proj02_images_per_second gauge\nproj02_images_per_second " << images / uptime << "\n"
+         << "# TYPE proj02_megapixels_per_second gauge\nproj02_megapixels_per_second " << pixels / 1e6 / uptime << "\n"
+         << "# TYPE proj02_uptime_seconds gauge\nproj02_uptime_seconds " << uptime << "\n";
+
+    std::ostringstream json;
+    json << "{\n  \"uptime_seconds\": " << uptime << ",\n  \"images\": " << images << ",\n  \"errors\": " << errors
+         << ",\n  \"pixels\": " << pixels << ",\n  \"images_per_second\": " << images / uptime
+         << ",\n  \"megapixels_per_second\": " << pixels / 1e6 / uptime << ",\n  \"series\": [";
+    for (size_t s = 0; s < series.size(); ++s)
+    {
+        const HistogramSnapshot &h = snapshots[s];
+        std::string labels = series[s].second;
+        size_t eq = labels.find('=');
+        std::string key = labels.substr(0, eq), value = labels.substr(eq + 2, labels.size() - eq - 3);
+        json << (s ? "," : "") << "\n    {\"metric\": \"" << series[s].first << "\", \"" << key << "\": \"" << value
+             << "\", \"count\": " << h.total << ", \"mean\": " << (h.total ? h.sum / 1e6 / h.total : 0)
+             << ", \"p50\": " << h.quantile(0.5) << ", \"p95\": " << h.quantile(0.95)
+             << ", \"p99\": " << h.quantile(0.99) << ", \"max\": " << h.max / 1e6 << "}";
+    }
+    json << "\n  ]\n}\n";
+
+    for (const auto &file : {std::make_pair(prefix + ".prom", prom.str()), std::make_pair(prefix + ".json", json.str())})
+    {
+        std::string temp = file.first + ".tmp";
+        std::ofstream out(temp);
+        out << file.second;
+        out.close();
+        if (!out || std::rename(temp.c_str(), file.first.c_str()) != 0)
+            std::cerr << "Cannot write metrics file: " << file.first << "\n";
+    }
+}
+
+// Records the time from construction to destruction as one sample of a stage
+struct StageTimer
+{
+    std::string stage;
+    bool active;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    StageTimer(const std::string &name, bool record) : stage(name), active(record && g_metricsEnabled) {}
+    ~StageTimer()
+    {
+        if (active)
+            recordLatency("proj02_stage_seconds", "stage=\"" + stage + "\"",
+                          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+// Writes the metrics every `interval` seconds from a background thread while it lives, and
+// once more when it is destroyed
+struct MetricsExporter
+{
+    std::string prefix;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void start(const std::string &filePrefix, int interval)
+    {
+        prefix = filePrefix;
+        g_metricsEnabled = true;
+        thread = std::thread([this, interval]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, std::chrono::seconds(interval), [this] { return stopping; }))
+            {
+                writeMetrics(prefix);
+            }
+        });
+    }
+
+    ~MetricsExporter()
+    {
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        writeMetrics(prefix);
+    }
+};
+
+// Function to check whether an option consumes the next argument as its value
+bool optionTakesValue(const std::string &name)
+{
+    return name == "-e" || name == "--matrix" || name == "--lut" || name == "--lut-interp" || name == "--threads" || name == "--palette" ||
+           name == "--dither" || name == "--erode" || name == "--dilate" || name == "--open" ||
+           name == "--close" || name == "--nlm" || name == "--bilateral" ||
+           name == "--convolve" || name == "--convolve-method" || name == "--gaussian" ||
+           name == "--rotate" || name == "--affine" || name == "--warp-interp" || name == "--seam-carve" ||
+           name == "--components" || name == "--connectivity" || name == "--threshold" || name == "--adaptive-threshold" ||
+           name == "--overlay" || name == "--diff" || name == "--add" || name == "--sub" || name == "--blend" ||
+           name == "--min" || name == "--max" || name == "--mosaic" || name == "--tile" || name == "--downsample" ||
+           name == "--batch" || name == "--shards" || name == "--metrics" || name == "--bench" ||
+           name == "--scaling" || name == "--scaling-size" || name == "--scaling-out" || name == "--autotune";
+}
+
+// Function to check for options that change how proj02 runs rather than what it computes;
+// main applies them once and the per-image code skips them
+bool isRunOption(const std::string &name)
+{
+    return name == "--threads" || name == "--progress" || name == "--resume" || name == "--metrics";
+}
+
+// Function to check for options that only set how later operators behave
+bool isSettingOption(const std::string &name)
+{
+    return isRunOption(name) || name == "--lut-interp" || name == "--lut-bake" || name == "--palette" ||
+           name == "--convolve-method" || name == "--warp-interp" || name == "--connectivity";
+}
+
+// Function to check for operators that keep the alpha plane of P7 input: point operators
+// only change each pixel's color, and --overlay composites into the alpha as well
+bool keepsAlpha(const std::string &name)
+{
+    return isPointOption(name) || name == "--lut" || name == "--overlay" || isSettingOption(name);
+}
+
+// Function to describe what a run computes, for matching checkpoints: every option except
+// those that only change how it runs
+std::string optionsKey(const std::vector<Option> &options)
+{
+    std::string key;
+    for (const auto &opt : options)
+    {
+        if (isRunOption(opt.name))
+            continue;
+        key += opt.name + (opt.value.empty() ? "" : "=" + opt.value) + " ";
+    }
+    return key;
+}
+
+// Function to checksum a whole file for checkpoints; false if it cannot be read
+bool checksumWholeFile(const std::string &filename, uint64_t &hash)
+{
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(filename, ec);
+    return !ec && checksumFile(filename, 0, size, hash);
+}
+
+// Function to map an option to the profile entry that tunes it ("" if none)
+std::string tuningKey(const std::string &option)
+{
+    CombineOp op;
+    if (option == "-b")
+        return "blur";
+    if (option == "--erode" || option == "--dilate" || option == "--open" || option == "--close")
+        return "morphology";
+    if (combineOpFor(option, op))
+        return "combine";
+    return "";
+}
+
+// Function to find this host's tuning profile: $PROJ02_PROFILE, or else
+// ${XDG_CONFIG_HOME:-~/.config}/proj02/<hostname>.profile
+std::string profilePath()
+{
+    if (const char *path = std::getenv("PROJ02_PROFILE"))
+        return path;
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    std::filesystem::path dir;
+    if (const char *config = std::getenv("XDG_CONFIG_HOME"))
+        dir = config;
+    else if (const char *home = std::getenv("HOME"))
+        dir = std::filesystem::path(home) / ".config";
+    else
+        return "";
+    return (dir / "proj02" / (std::string(host) + ".profile")).string();
+}
+
+// Tuned band size (bytes per band, so it carries over to other widths) and thread count
+struct Tuning
+{
+    long bandBytes = 0;
+    int threads = 0;
+};
+static std::map<std::string, Tuning> g_tuning;
+
+// Function to load the host profile written by --autotune, if there is one. Lines are
+// "<key> band_bytes=<n> threads=<n>"; '#' starts a comment.
+void loadProfile()
+{
+    std::ifstream file(profilePath());
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key, field;
+        if (!(fields >> key) || key[0] == '#')
+            continue;
+        Tuning tuning;
+        while (fields >> field)
+        {
+            size_t eq = field.find('=');
+            if (eq == std::string::npos)
+                continue;
+            long value = std::atol(field.c_str() + eq + 1);
+            if (field.compare(0, eq, "band_bytes") == 0)
+                tuning.bandBytes = value;
+            else if (field.compare(0, eq, "threads") == 0)
+                tuning.threads = static_cast<int>(value);
+        }
+        g_tuning[key] = tuning;
+    }
+}
+
+// Applies the profile entry for an option to the current thread for its lifetime
+struct ScopedTuning
+{
+    int bandRows = t_bandRows, threads = t_tunedThreads;
+
+    ScopedTuning(const std::string &option, int width)
+    {
+        auto it = g_tuning.find(tuningKey(option));
+        if (it == g_tuning.end() || width <= 0)
+            return;
+        if (it->second.bandBytes > 0)
+            t_bandRows = static_cast<int>(std::max<long>(1, it->second.bandBytes / (width * 3L)));
+        t_tunedThreads = it->second.threads;
+    }
+    ~ScopedTuning()
+    {
+        t_bandRows = bandRows;
+        t_tunedThreads = threads;
+    }
+};
+
+// Function to read one image, apply the options in order and write the result.
+// Returns a non-zero exit code for a bad option; I/O and format errors are thrown.
+int processImage(const std::string &inputFile, const std::string &outputFile, const std::vector<Option> &options)
+{
+    // A lone two-input operation on P6 files streams both mapped inputs to the output
+    CombineOp combineOp;
+    bool resume = false;
+    std::vector<Option> operators;
+    for (const auto &opt : options)
+    {
+        if (opt.name == "--resume")
+            resume = true;
+        else if (!isRunOption(opt.name))
+            operators.push_back(opt);
+    }
+    if (operators.size() == 1 && combineOpFor(operators[0].name, combineOp) && readMagic(inputFile) == "P6")
+    {
+        std::string other = operators[0].value;
+        int weight = (combineOp == CombineOp::Blend) ? parseBlendWeight(other) : 0;
+        ScopedTuning tuning(operators[0].name, probePPM(inputFile).width);
+        try
+        {
+            combineFiles(inputFile, other, outputFile, combineOp, weight, resume);
+        }
+        catch (const OperationCancelled &)
+        {
+            std::cerr << "\nCancelled; rerun with --resume to continue from " << outputFile << ".checkpoint\n";
+            return 130;
+        }
+        return 0;
+    }
+
+    // Labeling a P4 mask, alone, streams it from the mapped file to the label image
+    bool componentsOnly = !operators.empty();
+    bool streamEight = true;
+    for (const auto &opt : operators)
+    {
+        if (opt.name == "--connectivity" && (opt.value == "4" || opt.value == "8"))
+            streamEight = (opt.value == "8");
+        else if (opt.name != "--components")
+            componentsOnly = false;
+    }
+    if (componentsOnly && operators.back().name == "--components" &&
+        std::count_if(operators.begin(), operators.end(), [](const Option &o) { return o.name == "--components"; }) == 1 &&
+        readMagic(inputFile) == "P4")
+    {
+        try
+        {
+            ComponentLabels cl = labelComponentsFile(inputFile, outputFile, streamEight);
+            writeComponentStats(operators.back().value, cl);
+            std::cout << "Found " << cl.components.size() << " components (" << (streamEight ? 8 : 4)
+                      << "-connected); stats written to " << operators.back().value << "\n";
+        }
+        catch (const OperationCancelled &)
+        {
+            std::cerr << "\nCancelled; label image not completed\n";
+            return 130;
+        }
+        return 0;
+    }
+
+    // Bilevel P4 input stays packed until an operator needs RGB pixels. P7 input keeps its
+    // alpha plane through the operators that preserve it; the first one that does not
+    // flattens the image onto black, and then the result cannot be written as PAM.
+    bool pamOutput = outputFile.size() > 4 && outputFile.compare(outputFile.size() - 4, 4, ".pam") == 0;
+    std::vector<std::vector<RGB>> image;
+    std::vector<std::vector<unsigned char>> alpha;
+    IndexedImage indexed;
+    bool haveIndexed = false;
+    if (readMagic(inputFile) == "P4")
+    {
+        indexed = readPBM(inputFile);
+        haveIndexed = true;
+    }
+    else if (readMagic(inputFile) == "P7")
+    {
+        image = splitRGBA(readPAM(inputFile), alpha);
+    }
+    else
+    {
+        image = readPPM(inputFile);
+    }
+    if (!alpha.empty() && pamOutput)
+    {
+        for (const auto &opt : options)
+        {
+            if (!keepsAlpha(opt.name))
+            {
+                std::cerr << "Error: " << opt.name << " does not preserve alpha; write a .ppm output to flatten "
+                          << "the image onto black\n";
+                return 1;
+            }
+        }
+    }
+
+    // LUT settings apply to every --lut that follows them
+    bool lutTetrahedral = false;
+    bool lutBake = false;
+
+    // Likewise --convolve-method for every --convolve, --warp-interp for every warp and
+    // --connectivity for every --components
+    std::string convolveMethod = "auto";
+    bool warpBilinear = true;
+    bool eightConnected = true;
+
+    // Dithering and thresholding leave a packed indexed image; it is expanded again only
+    // if a later operator needs RGB pixels, otherwise it is written out as P4/P5/P6
+    std::string paletteName = "bw";
+
+    // On cancellation the image is written as it stood after the last completed stage.
+    // Operators that build their result separately leave it untouched when interrupted;
+    // the few that work in place clear `consistent` while they run.
+    size_t stagesDone = 0;
+    bool consistent = true;
+    bool cancelled = false;
+    size_t fusedUntil = 0;
+    try
+    {
+        // Apply Options in Order
+        for (const auto &opt : options)  // Applies transformations based on collected options
+        {
+            const std::string &option = opt.name;
+            size_t index = static_cast<size_t>(&opt - options.data());
+            if (index < fusedUntil)
+                continue;  // already applied as part of a fused point chain
+            stagesDone = index;
+            if (cancelRequested())
+                throw OperationCancelled();
+
+            // A run of point operators that includes --matrix goes through the rows in one pass
+            size_t runEnd = index;
+            bool hasMatrix = false;
+            while (runEnd < options.size() && isPointOption(options[runEnd].name))
+                hasMatrix |= options[runEnd++].name == "--matrix";
+            bool fused = hasMatrix && runEnd - index > 1;
+
+            t_stage = fused ? "fused" : option;
+            bool isSetting = isSettingOption(option);
+            StageTimer stageTimer(t_stage, !isSetting);
+            ScopedTuning tuning(option, image.empty() ? (haveIndexed ? indexed.width : 0) : image[0].size());
+            if (haveIndexed && !isSetting && !(option == "--components" && indexed.bits == 1))
+            {
+                image = expandIndexed(indexed);
+                haveIndexed = false;
+            }
+            if (!alpha.empty() && !keepsAlpha(option))
+            {
+                flattenAlpha(image, alpha);
+                alpha.clear();
+                std::cout << "Alpha channel flattened onto black\n";
+            }
+
+            if (fused)
+            {
+                std::vector<Option> chain(options.begin() + index, options.begin() + runEnd);
+                std::cout << "Calling fused point operators (";
+                for (const auto &step : chain)
+                    std::cout << (&step == &chain[0] ? "" : " ") << step.name;
+                std::cout << ")...\n";
+                consistent = false;
+                applyPointChain(image, chain);
+                consistent = true;
+                fusedUntil = runEnd;
+                std::cout << "After Fused Point Operators:\n";
+            }
+            else if (option == "--matrix")
+            {
+                std::cout << "Calling color matrix function...\n";
+                ColorMatrix cm = parseColorMatrix(opt.value);
+                consistent = false;
+                colorMatrix(image, cm);
+                consistent = true;
+                std::cout << "After Color Matrix:\n";
+            }
+            else if (option == "-g")
             {   
                 std::cout << "Calling grayscale function...\n";
                 grayscale(image);
                 std::cout << "After Grayscale:\n";
             }
-            else if (option == "-i")
-            {   
-                std::cout << "Calling invert function...\n";
-                invert(image);
-                std::cout << "After Inversion:\n";
+            else if (option == "-i")
+            {   
+                std::cout << "Calling invert function...\n";
+                invert(image);
+                std::cout << "After Inversion:\n";
+            }
+            else if (option == "-x")
+            {   
+                std::cout << "Calling contrast function...\n";
+                contrast(image, 1.2);
+                std::cout << "After Contrast:\n";
+            }
+            else if (option == "-b")
+            {   
+                std::cout << "Calling blur function...\n";
+                blur(image);
+                std::cout << "After Blurring:\n";
+            }
+            else if (option == "-m")
+            {
+                std::cout << "Calling mirror function...\n";
+                mirror(image);
+                std::cout << "After Mirroring:\n";
+            }
+            else if (option == "-c")
+            {   
+                std::cout << "Calling compress function...\n";
+                compress(image);
+                std::cout << "After Compression:\n";
+            }
+            else if (isRunOption(option))
+            {
+                continue;  // Applied once by main; --resume only affects batch and streamed runs
+            }
+            else if (option == "--lut-interp")
+            {
+                if (opt.value != "trilinear" && opt.value != "tetrahedral")
+                {
+                    std::cerr << "Unknown LUT interpolation: " << opt.value << "\n";
+                    return 1;
+                }
+                lutTetrahedral = (opt.value == "tetrahedral");
+                continue;
+            }
+            else if (option == "--lut-bake")
+            {
+                lutBake = true;
+                continue;
+            }
+            else if (option == "-e")
+            {
+                std::cout << "Calling expression function...\n";
+                Expression expr = compileExpression(opt.value);
+                consistent = false;
+                applyExpression(image, expr);
+                consistent = true;
+                std::cout << "After Expression:\n";
+            }
+            else if (option == "--lut")
+            {
+                std::cout << "Calling applyLUT function...\n";
+                Lut3D lut = loadCubeLUT(opt.value);
+                lut.tetrahedral = lutTetrahedral;
+                if (lutBake)
+                    bakeLUT(lut);
+                consistent = false;  // graded in place, so an interrupted pass leaves mixed rows
+                applyLUT(image, lut);
+                consistent = true;
+                std::cout << "After LUT Grading:\n";
+            }
+            else if (option == "--palette")
+            {
+                paletteName = opt.value;
+                continue;
+            }
+            else if (option == "--dither")
+            {
+                std::cout << "Calling dither function...\n";
+                Palette palette = makePalette(paletteName);
+                if (opt.value == "fs")
+                    indexed = ditherFloydSteinberg(image, palette);
+                else if (opt.value == "bayer")
+                    indexed = ditherBayer(image, palette);
+                else
+                {
+                    std::cerr << "Unknown dither method: " << opt.value << "\n";
+                    return 1;
+                }
+                haveIndexed = true;
+                std::cout << "After Dithering to " << palette.colors.size() << " colors (" << palette.bits
+                          << " bits per pixel)\n";
+                continue;
+            }
+            else if (option == "--threshold")
+            {
+                std::cout << "Calling threshold function...\n";
+                indexed = thresholdGlobal(image, std::stoi(opt.value));
+                haveIndexed = true;
+                std::cout << "After Thresholding at " << opt.value << "\n";
+                continue;
+            }
+            else if (option == "--adaptive-threshold")
+            {
+                size_t colon = opt.value.find(':');
+                int radius = std::stoi(opt.value.substr(0, colon));
+                int offset = (colon == std::string::npos) ? 0 : std::stoi(opt.value.substr(colon + 1));
+                std::cout << "Calling adaptive threshold function (radius " << radius << ", offset " << offset << ")...\n";
+                indexed = thresholdAdaptive(image, radius, offset);
+                haveIndexed = true;
+                std::cout << "After Adaptive Thresholding:\n";
+                continue;
+            }
+            else if (option == "--overlay")
+            {
+                std::string file = opt.value;
+                int x = 0, y = 0;
+                size_t at = file.rfind('@');
+                if (at != std::string::npos)
+                {
+                    std::string position = file.substr(at + 1);
+                    size_t comma = position.find(',');
+                    if (comma == std::string::npos)
+                        throw std::runtime_error("Invalid overlay position: " + position);
+                    x = std::stoi(position.substr(0, comma));
+                    y = std::stoi(position.substr(comma + 1));
+                    file = file.substr(0, at);
+                }
+                std::cout << "Calling overlay function...\n";
+                overlay(image, file, x, y, alpha);
+                std::cout << "After Overlay:\n";
+            }
+            else if (combineOpFor(option, combineOp))
+            {
+                std::string other = opt.value;
+                int weight = (combineOp == CombineOp::Blend) ? parseBlendWeight(other) : 0;
+                std::cout << "Calling combine function (" << option.substr(2) << ")...\n";
+                consistent = false;
+                combineWith(image, other, combineOp, weight);
+                consistent = true;
+                std::cout << "After Combining:\n";
+            }
+            else if (option == "--erode" || option == "--dilate" || option == "--open" || option == "--close")
+            {
+                int w, h;
+                parseSize(opt.value, w, h);
+                std::cout << "Calling morphology function (" << option.substr(2) << " " << w << "x" << h << ")...\n";
+                morphology(image, option.substr(2), w, h);
+                std::cout << "After Morphology:\n";
+            }
+            else if (option == "--nlm")
+            {
+                NlmParams params = parseNlm(opt.value);
+                std::cout << "Calling non-local means function (patch " << params.patch << ", search " << params.search
+                          << ", strength " << params.strength << ")...\n";
+                nonLocalMeans(image, params);
+                std::cout << "After Denoising:\n";
+            }
+            else if (option == "--bilateral")
+            {
+                float sigmaSpatial, sigmaRange;
+                parseBilateral(opt.value, sigmaSpatial, sigmaRange);
+                std::cout << "Calling bilateral filter function (sigma_s " << sigmaSpatial << ", sigma_r " << sigmaRange
+                          << ")...\n";
+                bilateral(image, sigmaSpatial, sigmaRange);
+                std::cout << "After Bilateral Filtering:\n";
+            }
+            else if (option == "--convolve-method")
+            {
+                convolveMethod = opt.value;
+                continue;
+            }
+            else if (option == "--convolve")
+            {
+                Kernel kernel = loadKernel(opt.value);
+                std::cout << "Calling convolve function (" << kernel.w << "x" << kernel.h << " kernel)...\n";
+                std::string used = convolve(image, kernel, convolveMethod);
+                std::cout << "After Convolution (" << used << "):\n";
+            }
+            else if (option == "--gaussian")
+            {
+                float sigma = std::stof(opt.value);
+                std::cout << "Calling Gaussian blur function (sigma " << sigma << ")...\n";
+                gaussianBlur(image, sigma);
+                std::cout << "After Gaussian Blur:\n";
+            }
+            else if (option == "--warp-interp")
+            {
+                if (opt.value != "nearest" && opt.value != "bilinear")
+                {
+                    std::cerr << "Unknown warp interpolation: " << opt.value << "\n";
+                    return 1;
+                }
+                warpBilinear = (opt.value == "bilinear");
+                continue;
+            }
+            else if (option == "--rotate" || option == "--affine")
+            {
+                AffineMap map = (option == "--rotate") ? rotationMap(std::stod(opt.value), image[0].size(), image.size())
+                                                       : parseAffine(opt.value);
+                std::cout << "Calling affine warp function (" << option.substr(2) << " " << opt.value << ", "
+                          << (warpBilinear ? "bilinear" : "nearest") << ")...\n";
+                warpAffine(image, map, warpBilinear);
+                std::cout << "After Warping:\n";
+            }
+            else if (option == "--seam-carve")
+            {
+                int w, h;
+                parseSize(opt.value, w, h);
+                std::cout << "Calling seam carving function (to " << w << "x" << h << ")...\n";
+                seamCarve(image, w, h);
+                std::cout << "After Seam Carving:\n";
+            }
+            else if (option == "--connectivity")
+            {
+                if (opt.value != "4" && opt.value != "8")
+                {
+                    std::cerr << "Connectivity must be 4 or 8: " << opt.value << "\n";
+                    return 1;
+                }
+                eightConnected = (opt.value == "8");
+                continue;
+            }
+            else if (option == "--components")
+            {
+                std::cout << "Calling connected components function (" << (eightConnected ? 8 : 4) << "-connected)...\n";
+                ComponentLabels cl = labelComponents(image, haveIndexed ? &indexed : nullptr, eightConnected);
+                haveIndexed = false;
+                writeComponentStats(opt.value, cl);
+                std::cout << "After Labeling: " << cl.components.size() << " components, stats written to " << opt.value
+                          << "\n";
+            }
+            else
+            {
+                std::cerr << "Unknown option: " << option << "\n";
+                return 1;
+            }
+
+            // Print first few pixels after transformation for debugging
+            for (int i = 0; i < std::min(5, (int)image.size()); ++i)
+            {
+                for (int j = 0; j < std::min(5, (int)image[i].size()); ++j)
+                {
+                    std::cout << "(" << (int)image[i][j].r << ", "
+                              << (int)image[i][j].g << ", "
+                              << (int)image[i][j].b << ") ";
+                }
+                std::cout << "\n";
+            }
+        }
+    }
+    catch (const OperationCancelled &)
+    {
+        std::cerr << "\nCancelled during " << t_stage << " after " << stagesDone << " completed option(s)\n";
+        if (!consistent)
+        {
+            std::cerr << "Output not written: the interrupted stage had modified the image in place\n";
+            return 130;
+        }
+        cancelled = true;
+    }
+
+    if (haveIndexed)
+        writeIndexed(outputFile, indexed);
+    else if (pamOutput)
+        writePAM(outputFile, toRGBA(image, alpha));
+    else
+    {
+        if (!alpha.empty())
+        {
+            flattenAlpha(image, alpha);
+            std::cout << "Alpha channel flattened onto black\n";
+        }
+        writePPM(outputFile, image);
+    }
+    if (cancelled)
+    {
+        std::cerr << "Partial result after " << stagesDone << " option(s) written to " << outputFile << "\n";
+        return 130;
+    }
+    return 0;
+}
+
+// Function to process many images into outputDir with size-aware scheduling. All headers
+// are probed first and jobs run largest first. While the largest job left is more than a
+// fair share of the remaining work it runs alone with every core (intra-image
+// parallelism); the rest run side by side, one thread each (inter-image parallelism),
+// which keeps the makespan close to total work / cores.
+// Each finished image is recorded in "<outputDir>/.proj02.checkpoint" with the checksum of
+// its output. With --resume, images whose input is unchanged and whose output still matches
+// that checksum are skipped.
+int runBatch(const std::vector<std::string> &inputs, const std::string &outputDir, const std::vector<Option> &options)
+{
+    struct Job
+    {
+        std::string input, output;
+        uint64_t work, pixels;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::filesystem::create_directories(outputDir);
+    int cores = workerCount();
+
+    std::vector<Job> jobs;
+    std::map<std::string, std::string> outputOwner;
+    int errors = 0;
+    for (const PPMInfo &info : probePPMFiles(inputs, cores))
+    {
+        if (!info.valid)
+        {
+            std::cerr << "Skipping " << info.filename << ": " << info.error << "\n";
+            errors++;
+            continue;
+        }
+        std::string output = (std::filesystem::path(outputDir) / std::filesystem::path(info.filename).filename()).string();
+        // Outputs are named by file name only, so two inputs with the same name would
+        // overwrite each other; the first one listed keeps the name
+        auto owner = outputOwner.emplace(output, info.filename);
+        if (!owner.second)
+        {
+            std::cerr << "Skipping " << info.filename << ": output " << output << " is already written for "
+                      << owner.first->second << "\n";
+            errors++;
+            continue;
+        }
+        uint64_t pixels = static_cast<uint64_t>(info.width) * info.height;
+        jobs.push_back({info.filename, output, pixels * info.depth, pixels});
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) { return a.work > b.work; });
+
+    bool resume = std::any_of(options.begin(), options.end(), [](const Option &o) { return o.name == "--resume"; });
+    Checkpoint checkpoint((std::filesystem::path(outputDir) / ".proj02.checkpoint").string(), optionsKey(options),
+                          resume);
+    std::vector<std::string> recordedStamp(jobs.size());
+    std::vector<uint64_t> recordedHash(jobs.size());
+    for (const std::string &line : checkpoint.records)
+    {
+        // done <checksum> <input stamp> <input path>
+        std::istringstream record(line);
+        std::string kind, stamp, input;
+        uint64_t hash;
+        if (!(record >> kind >> std::hex >> hash >> stamp) || kind != "done")
+            continue;
+        std::getline(record >> std::ws, input);
+        for (size_t k = 0; k < jobs.size(); ++k)
+        {
+            if (jobs[k].input == input)
+            {
+                recordedStamp[k] = stamp;
+                recordedHash[k] = hash;
+            }
+        }
+    }
+
+    // Verify the recorded outputs side by side; whatever fails is simply redone
+    std::vector<char> verified(jobs.size(), 0);
+    parallelRows(static_cast<int>(jobs.size()), [&](int first, int last)
+    {
+        for (int k = first; k < last; ++k)
+        {
+            uint64_t hash;
+            verified[k] = !recordedStamp[k].empty() && recordedStamp[k] == fileStamp(jobs[k].input) &&
+                          checksumWholeFile(jobs[k].output, hash) && hash == recordedHash[k];
+        }
+    }, 1);
+    size_t skipped = 0;
+    for (size_t k = jobs.size(); k-- > 0;)
+    {
+        if (verified[k])
+        {
+            jobs.erase(jobs.begin() + k);
+            skipped++;
+        }
+    }
+    if (skipped > 0)
+        std::cout << "Skipping " << skipped << " image(s) already finished and verified\n";
+
+    uint64_t remaining = 0;
+    for (const Job &job : jobs)
+        remaining += job.work;
+
+    std::mutex logMutex;
+    double busySeconds = 0;  // core-seconds spent, for the ideal makespan
+    auto runJob = [&](const Job &job, int threads)
+    {
+        if (cancelRequested())
+            return;
+        auto jobStart = std::chrono::steady_clock::now();
+        int status = 1;
+        std::string error;
+        try
+        {
+            status = processImage(job.input, job.output, options);
+            // An image that cannot be checkpointed counts as failed, so --resume redoes it
+            uint64_t hash;
+            if (status == 0 && !checksumWholeFile(job.output, hash))
+            {
+                status = 1;
+                error = "cannot read " + job.output + " back for the checkpoint";
+            }
+            else if (status == 0)
+            {
+                std::ostringstream record;
+                record << "done " << std::hex << hash << " " << fileStamp(job.input) << " " << job.input;
+                checkpoint.record(record.str());
+            }
+        }
+        catch (const std::exception &e)
+        {
+            status = 1;
+            error = e.what();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+        if (status != 130)
+            recordImage(seconds, job.pixels, status == 0);
+
+        std::lock_guard<std::mutex> lock(logMutex);
+        busySeconds += seconds * threads;
+        if (status != 0 && status != 130)
+        {
+            std::cerr << "Error: " << job.input << (error.empty() ? "" : ": " + error) << "\n";
+            errors++;
+        }
+    };
+
+    size_t next = 0;
+    int intra = 0;
+    while (next < jobs.size() && jobs[next].work * cores > remaining)
+    {
+        runJob(jobs[next], cores);
+        remaining -= jobs[next].work;
+        next++;
+        intra++;
+    }
+
+    std::atomic<size_t> queue(next);
+    auto worker = [&]()
+    {
+        t_workerLimit = 1;
+        for (size_t k; (k = queue.fetch_add(1)) < jobs.size();)
+        {
+            runJob(jobs[k], 1);
+        }
+    };
+    std::vector<std::thread> pool;
+    int workers = std::min<int>(cores, static_cast<int>(jobs.size() - next));
+    for (int t = 0; t < workers; ++t)
+    {
+        pool.emplace_back(worker);
+    }
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+
+    if (cancelRequested())
+    {
+        std::cerr << "Batch cancelled; rerun with --resume to skip the finished images\n";
+        return 130;
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Batch: " << jobs.size() << " images on " << cores << " cores (" << intra << " split across cores, "
+              << jobs.size() - intra << " one per core), " << errors << " errors\n"
+              << "Makespan " << wall << " s, ideal " << busySeconds / cores << " s\n";
+    if (errors == 0)
+        checkpoint.remove();
+    return errors == 0 ? 0 : 1;
+}
+
+// Function to find how many rows of context a shard needs so that the options give the same
+// rows as on the whole image. Returns false if an option is not row-local (it moves rows,
+// changes the size or reads other files by position) and so cannot run on shards.
+bool shardHalo(const std::vector<Option> &options, int &halo)
+{
+    halo = 0;
+    for (const auto &opt : options)
+    {
+        const std::string &option = opt.name;
+        if (option == "-b")
+        {
+            halo += 1;  // each 3x3 pass reads one row above and below
+        }
+        else if (option == "--erode" || option == "--dilate" || option == "--open" || option == "--close")
+        {
+            int w, h;
+            parseSize(opt.value, w, h);
+            halo += (option == "--open" || option == "--close") ? 2 * h : h;
+        }
+        else if (option == "--nlm")
+        {
+            NlmParams params = parseNlm(opt.value);
+            halo += params.patch + params.search;
+        }
+        else if (option == "--convolve")
+        {
+            Kernel kernel = loadKernel(opt.value);
+            halo += std::max(kernel.h / 2, kernel.h - 1 - kernel.h / 2);
+        }
+        else if (option != "-g" && option != "-i" && option != "-x" && option != "-m" && option != "-e" &&
+                 option != "--matrix" && option != "--lut" && option != "--lut-interp" && option != "--lut-bake" && option != "--convolve-method" && option != "--shards" &&
+                 !isRunOption(option))
+        {
+            std::cerr << "Option not supported with --shards: " << option << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to apply the row-local options accepted by shardHalo to one shard
+static void applyShardOptions(std::vector<std::vector<RGB>> &image, const std::vector<Option> &options)
+{
+    bool lutTetrahedral = false;
+    bool lutBake = false;
+    std::string convolveMethod = "auto";
+    for (const auto &opt : options)
+    {
+        const std::string &option = opt.name;
+        if (cancelRequested())
+            throw OperationCancelled();
+        if (option == "-g")
+            grayscale(image);
+        else if (option == "-i")
+            invert(image);
+        else if (option == "-x")
+            contrast(image, 1.2);
+        else if (option == "-b")
+            blur(image);
+        else if (option == "-m")
+            mirror(image);
+        else if (option == "-e")
+            applyExpression(image, compileExpression(opt.value));
+        else if (option == "--matrix")
+            colorMatrix(image, parseColorMatrix(opt.value));
+        else if (option == "--lut-interp")
+            lutTetrahedral = (opt.value == "tetrahedral");
+        else if (option == "--lut-bake")
+            lutBake = true;
+        else if (option == "--lut")
+        {
+            Lut3D lut = loadCubeLUT(opt.value);
+            lut.tetrahedral = lutTetrahedral;
+            if (lutBake)
+                bakeLUT(lut);
+            applyLUT(image, lut);
+        }
+        else if (option == "--erode" || option == "--dilate" || option == "--open" || option == "--close")
+        {
+            int w, h;
+            parseSize(opt.value, w, h);
+            morphology(image, option.substr(2), w, h);
+        }
+        else if (option == "--nlm")
+            nonLocalMeans(image, parseNlm(opt.value));
+        else if (option == "--convolve-method")
+            convolveMethod = opt.value;
+        else if (option == "--convolve")
+            convolve(image, loadKernel(opt.value), convolveMethod);
+    }
+}
+
+// Function to process one P6 image in row shards, one worker process per shard. The output
+// file is preallocated by the coordinator; each worker maps the input, loads only its rows
+// plus the halo the options need, and pwrites its finished rows at their final offset.
+// No worker ever holds more than its shard, and the coordinator only checks that every
+// worker succeeded and the file has its full size. At most one worker per core runs at a
+// time, so with more shards than cores finished shards accumulate in the checkpoint
+// "<output>.checkpoint" and --resume reruns only the shards that do not verify.
+int runSharded(const std::string &inputFile, const std::string &outputFile, const std::vector<Option> &options,
+               int shards)
+{
+    int halo;
+    if (!shardHalo(options, halo))
+        return 1;
+
+    MappedPPM input(inputFile);
+    std::error_code ec;
+    if (std::filesystem::equivalent(outputFile, inputFile, ec))
+    {
+        throw std::runtime_error("Output file must differ from the input: " + outputFile);
+    }
+    int width = input.width, height = input.height;
+    shards = std::max(1, std::min(shards, height));
+    size_t rowBytes = static_cast<size_t>(width) * 3;
+
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    off_t fileSize = static_cast<off_t>(header.size() + rowBytes * height);
+    bool resume = std::any_of(options.begin(), options.end(), [](const Option &o) { return o.name == "--resume"; });
+    Checkpoint checkpoint(outputFile + ".checkpoint",
+                          optionsKey(options) + fileStamp(inputFile) + " " + std::to_string(width) + "x" +
+                              std::to_string(height),
+                          resume);
+
+    // Shards whose recorded rows still match the output are kept
+    std::vector<char> done(shards, 0);
+    auto shardRows = [&](int s, int &y0, int &y1)
+    {
+        y0 = static_cast<int>(static_cast<int64_t>(height) * s / shards);
+        y1 = static_cast<int>(static_cast<int64_t>(height) * (s + 1) / shards);
+    };
+    for (const std::string &line : checkpoint.records)
+    {
+        // band <y0> <y1> <checksum>
+        std::istringstream record(line);
+        std::string kind;
+        int r0, r1;
+        uint64_t recorded, actual;
+        if (!(record >> kind >> r0 >> r1 >> std::hex >> recorded) || kind != "band")
+            continue;
+        for (int s = 0; s < shards; ++s)
+        {
+            int y0, y1;
+            shardRows(s, y0, y1);
+            if (y0 == r0 && y1 == r1 &&
+                checksumFile(outputFile, header.size() + rowBytes * y0, rowBytes * (y1 - y0), actual) &&
+                actual == recorded)
+                done[s] = 1;
+        }
+    }
+    int kept = static_cast<int>(std::count(done.begin(), done.end(), 1));
+
+    int fd = open(outputFile.c_str(), O_WRONLY | O_CREAT | (kept > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open file: " + outputFile);
+    }
+    // Reserve the blocks up front so a full disk fails here rather than in a worker
+    if (pwrite(fd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size()) ||
+        ftruncate(fd, fileSize) != 0 || posix_fallocate(fd, 0, fileSize) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot preallocate output file: " + outputFile);
+    }
+
+    // Up to one worker process per core runs at a time whatever --threads says; --threads
+    // only sets each worker's thread count, which otherwise splits the cores between them
+    int cores = availableCores();
+    int running = std::max(1, std::min(shards - kept, cores));
+    int threadsPerShard = g_threads > 0 ? g_threads : std::max(1, cores / running);
+    std::cout << "Sharding " << width << "x" << height << " image into " << shards << " worker processes ("
+              << running << " at a time, " << threadsPerShard << " threads each, halo " << halo << " rows)\n";
+    if (kept > 0)
+        std::cout << "Keeping " << kept << " shard(s) verified from " << checkpoint.path << "\n";
+    std::cout.flush();
+
+    int failed = 0, active = 0;
+    bool cancelled = false;
+    auto reap = [&]()
+    {
+        int status;
+        while (waitpid(-1, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+                return;
+        }
+        active--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 130)
+            cancelled = true;
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    };
+    for (int s = 0; s < shards; ++s)
+    {
+        if (done[s])
+            continue;
+        if (active == running)
+            reap();
+        if (cancelRequested() || cancelled)
+        {
+            cancelled = true;
+            break;
+        }
+        int y0, y1;
+        shardRows(s, y0, y1);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            std::cerr << "Cannot start worker " << s << "\n";
+            failed++;
+            break;
+        }
+        if (pid > 0)
+        {
+            active++;
+            continue;
+        }
+
+        // Worker: report through the exit status only
+        int status = 0;
+        try
+        {
+            std::cout.setstate(std::ios::failbit);
+            setProgressCallback(nullptr);
+            g_threads = threadsPerShard;
+            int h0 = std::max(0, y0 - halo), h1 = std::min(height, y1 + halo);
+            std::vector<std::vector<RGB>> shard(h1 - h0, std::vector<RGB>(width));
+            for (int i = h0; i < h1; ++i)
+            {
+                std::memcpy(shard[i - h0].data(), input.row(i), rowBytes);
+            }
+            applyShardOptions(shard, options);
+            uint64_t hash = checksumBytes(nullptr, 0);
+            for (int i = y0; i < y1; ++i)
+            {
+                const unsigned char *row = reinterpret_cast<const unsigned char *>(shard[i - h0].data());
+                off_t offset = static_cast<off_t>(header.size() + rowBytes * i);
+                if (pwrite(fd, row, rowBytes, offset) != static_cast<ssize_t>(rowBytes))
+                    throw std::runtime_error("Error writing pixel data at row " + std::to_string(i));
+                hash = checksumBytes(row, rowBytes, hash);
             }
-            else if (option == "-x")
-            {   
-                std::cout << "Calling contrast function...\n";
-                contrast(image, 1.2);
-                std::cout << "After Contrast:\n";
+            // The rows must be on disk before the checkpoint says they are
+            if (fdatasync(fd) != 0)
+                throw std::runtime_error("Cannot sync output file: " + outputFile);
+            std::ostringstream record;
+            record << "band " << y0 << " " << y1 << " " << std::hex << hash;
+            checkpoint.record(record.str());
+        }
+        catch (const OperationCancelled &)
+        {
+            status = 130;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error in worker " << s << ": " << e.what() << "\n";
+            status = 1;
+        }
+        _exit(status);
+    }
+    while (active > 0)
+    {
+        reap();
+    }
+
+    struct stat st;
+    bool complete = fstat(fd, &st) == 0 && st.st_size == fileSize;
+    close(fd);
+
+    if (cancelled || failed > 0 || !complete)
+    {
+        std::cerr << "Sharded run incomplete (" << failed << " worker(s) failed" << (cancelled ? ", cancelled" : "")
+                  << "); " << outputFile << " is not valid. Rerun with --resume to keep the finished shards\n";
+        return cancelled && failed == 0 ? 130 : 1;
+    }
+    checkpoint.remove();
+    std::cout << "PPM file successfully written: " << outputFile << "\n";
+    return 0;
+}
+
+// Function to find the size in bytes of the data (or unified) cache at a level, from
+// sysconf or else from sysfs; 0 if unknown
+long cacheSize(int level)
+{
+    long size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return size;
+    for (int index = 0;; ++index)
+    {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::ifstream levelFile(dir + "level");
+        int cacheLevel;
+        if (!(levelFile >> cacheLevel))
+            return 0;
+        std::string type, text;
+        std::ifstream(dir + "type") >> type;
+        std::ifstream(dir + "size") >> text;
+        if (cacheLevel == level && type != "Instruction" && !text.empty())
+        {
+            size = std::stol(text);
+            if (text.back() == 'K')
+                size <<= 10;
+            else if (text.back() == 'M')
+                size <<= 20;
+            return size;
+        }
+    }
+}
+
+// Function to make a deterministic noise image for benchmarks
+std::vector<std::vector<RGB>> syntheticImage(int width, int height)
+{
+    std::vector<std::vector<RGB>> image(height, std::vector<RGB>(width));
+    uint32_t seed = 12345;
+    for (auto &row : image)
+    {
+        for (auto &pixel : row)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            pixel = {static_cast<unsigned char>(seed >> 24), static_cast<unsigned char>(seed >> 16),
+                     static_cast<unsigned char>(seed >> 8)};
+        }
+    }
+    return image;
+}
+
+// Peak streaming bandwidth in GB/s from the four STREAM kernels
+struct StreamResult
+{
+    double copy = 0, scale = 0, add = 0, triad = 0;
+
+    double peak() const
+    {
+        return std::max(std::max(copy, scale), std::max(add, triad));
+    }
+};
+
+// Function to measure sustainable memory bandwidth the way STREAM does: copy, scale, add and
+// triad over three arrays of n doubles, best of `reps`, with as many threads as workerCount().
+// Bytes are counted as STREAM counts them (no write-allocate traffic).
+StreamResult streamProbe(size_t n, int reps)
+{
+    const size_t chunk = 1 << 16;
+    int chunks = static_cast<int>((n + chunk - 1) / chunk);
+    std::unique_ptr<double[]> a(new double[n]), b(new double[n]), c(new double[n]);
+
+    // Pages are first touched by the threads that will stream them
+    auto forChunks = [&](const std::function<void(size_t, size_t)> &kernel)
+    {
+        parallelRows(chunks, [&](int first, int last)
+        {
+            kernel(first * chunk, std::min(n, last * chunk));
+        }, 1);
+    };
+    forChunks([&](size_t i0, size_t i1)
+    {
+        for (size_t i = i0; i < i1; ++i)
+        {
+            a[i] = 1.0;
+            b[i] = 2.0;
+            c[i] = 0.0;
+        }
+    });
+
+    auto best = [&](double bytesPerElement, const std::function<void(size_t, size_t)> &kernel)
+    {
+        double fastest = std::numeric_limits<double>::max();
+        for (int r = 0; r < reps; ++r)
+        {
+            auto start = std::chrono::steady_clock::now();
+            forChunks(kernel);
+            fastest = std::min(fastest, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return bytesPerElement * n / fastest / 1e9;
+    };
+
+    const double q = 3.0;
+    StreamResult result;
+    result.copy = best(16, [&](size_t i0, size_t i1) { for (size_t i = i0; i < i1; ++i) c[i] = a[i]; });
+    result.scale = best(16, [&](size_t i0, size_t i1) { for (size_t i = i0; i < i1; ++i) b[i] = q * c[i]; });
+    result.add = best(24, [&](size_t i0, size_t i1) { for (size_t i = i0; i < i1; ++i) c[i] = a[i] + b[i]; });
+    result.triad = best(24, [&](size_t i0, size_t i1) { for (size_t i = i0; i < i1; ++i) a[i] = b[i] + q * c[i]; });
+    if (a[n / 2] != b[n / 2] + q * c[n / 2])
+        throw std::runtime_error("Bandwidth probe failed its self-check");
+    return result;
+}
+
+// Function to benchmark the point filters against the machine's streaming bandwidth. Each
+// filter reads and writes every byte of a width x height image once, so its achieved
+// bandwidth is 6 bytes per pixel over its best time; arithmetic intensity counts the
+// integer or float operations per pixel in the scalar code over those 6 bytes.
+void runBench(int width, int height)
+{
+    long l1 = cacheSize(1), l2 = cacheSize(2), l3 = cacheSize(3);
+    int threads = workerCount();
+    // Each array is four times the last-level cache, as STREAM asks, within 32..256 MiB
+    size_t n = static_cast<size_t>(std::max(l3, l2)) * 4 / sizeof(double);
+    n = std::min(std::max(n, size_t(4) << 20), size_t(32) << 20);
+    std::cout << "Caches: L1d " << (l1 >> 10) << " KiB, L2 " << (l2 >> 10) << " KiB, L3 " << (l3 >> 10) << " KiB; "
+              << threads << " threads\n"
+              << "Bandwidth probe: 3 arrays of " << (n * sizeof(double) >> 20) << " MiB\n";
+
+    t_workerLimit = 1;
+    StreamResult single = streamProbe(n, 5);
+    t_workerLimit = 0;
+    StreamResult all = streamProbe(n, 5);
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(5) << 1 << " thread(s): copy " << single.copy << "  scale " << single.scale << "  add "
+              << single.add << "  triad " << single.triad << " GB/s\n"
+              << std::setw(5) << threads << " thread(s): copy " << all.copy << "  scale " << all.scale << "  add "
+              << all.add << "  triad " << all.triad << " GB/s\n\n";
+
+    struct Kernel
+    {
+        const char *name;
+        double opsPerPixel;
+        std::function<void(std::vector<std::vector<RGB>> &)> run;
+    };
+    // Mirror rewrites every byte but only moves them, so it has no arithmetic at all
+    const Kernel kernels[] = {
+        {"invert", 3, [](std::vector<std::vector<RGB>> &im) { invert(im); }},
+        {"grayscale", 3, [](std::vector<std::vector<RGB>> &im) { grayscale(im); }},
+        {"contrast", 18, [](std::vector<std::vector<RGB>> &im) { contrast(im, 1.2); }},
+        {"mirror", 0, [](std::vector<std::vector<RGB>> &im)
+         {
+             for (auto &row : im)
+                 std::reverse(row.begin(), row.end());
+         }},
+        {"blur", 30, [](std::vector<std::vector<RGB>> &im) { blur(im); }},
+    };
+
+    std::vector<std::vector<RGB>> source = syntheticImage(width, height), image;
+    double bytes = 6.0 * width * height;
+    std::cout << "Filters on " << width << "x" << height << " (" << bytes / 2 / (1 << 20) << " MiB), best of 5:\n"
+              << std::left << std::setw(12) << "kernel" << std::right << std::setw(10) << "ms" << std::setw(10) << "GB/s"
+              << std::setw(14) << "% 1-thr peak" << std::setw(14) << "% all peak" << std::setw(10) << "ops/B" << "\n";
+    for (const Kernel &kernel : kernels)
+    {
+        double fastest = std::numeric_limits<double>::max();
+        for (int r = 0; r < 5; ++r)
+        {
+            image = source;  // a fresh copy also evicts the previous run's output
+            auto start = std::chrono::steady_clock::now();
+            kernel.run(image);
+            fastest = std::min(fastest, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        double gbs = bytes / fastest / 1e9;
+        std::cout << std::left << std::setw(12) << kernel.name << std::right << std::setw(10) << fastest * 1e3
+                  << std::setw(10) << gbs << std::setw(13) << 100 * gbs / single.peak() << "%" << std::setw(13)
+                  << 100 * gbs / all.peak() << "%" << std::setw(10) << kernel.opsPerPixel / 6 << "\n";
+    }
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+}
+
+// Function to run the option chain on synthetic P6 images at 1..maxThreads threads. Strong
+// scaling keeps the image at width x height; weak scaling gives each thread its own
+// width x height slab, so the image grows with the thread count. Every point is the best of
+// three runs of processImage, I/O included. Load imbalance is the busiest worker's time in
+// parallelRows over the mean of the workers that ran (small images may start fewer than t),
+// minus one. Results go to <prefix>.csv and <prefix>.json.
+void runScaling(int maxThreads, int width, int height, const std::string &prefix, const std::vector<Option> &chain)
+{
+    if (maxThreads < 1)
+        throw std::runtime_error("Invalid thread count for --scaling: " + std::to_string(maxThreads));
+
+    struct Point
+    {
+        std::string mode;
+        int threads, width, height;
+        double seconds, speedup, efficiency, imbalance;
+    };
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("proj02-scaling-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    std::string input = (dir / "input.ppm").string(), output = (dir / "output.ppm").string();
+    std::vector<Point> points;
+    std::vector<double> busy;
+
+    std::cout << std::left << std::setw(8) << "mode" << std::right << std::setw(8) << "threads" << std::setw(14) << "size"
+              << std::setw(12) << "seconds" << std::setw(10) << "speedup" << std::setw(12) << "efficiency"
+              << std::setw(11) << "imbalance" << "\n";
+    try
+    {
+        for (const std::string mode : {"strong", "weak"})
+        {
+            double base = 0;
+            for (int t = 1; t <= maxThreads; ++t)
+            {
+                int rows = (mode == "weak") ? height * t : height;
+                std::cout.setstate(std::ios::failbit);
+                if (t == 1 || mode == "weak")
+                    writePPM(input, syntheticImage(width, rows));
+
+                g_threads = t;
+                double fastest = std::numeric_limits<double>::max(), imbalance = 0;
+                for (int r = 0; r < 3; ++r)
+                {
+                    busy.assign(t, 0.0);
+                    g_workerBusy = &busy;
+                    auto start = std::chrono::steady_clock::now();
+                    int status = processImage(input, output, chain);
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    g_workerBusy = nullptr;
+                    if (status != 0)
+                        throw std::runtime_error("Option chain failed");
+                    if (seconds < fastest)
+                    {
+                        fastest = seconds;
+                        double total = 0, most = 0;
+                        int used = 0;
+                        for (double b : busy)
+                        {
+                            total += b;
+                            most = std::max(most, b);
+                            used += b > 0;
+                        }
+                        imbalance = total > 0 ? most / (total / used) - 1 : 0;
+                    }
+                }
+                std::cout.clear();
+
+                if (t == 1)
+                    base = fastest;
+                // Weak scaling does t times the work, so ideal time stays flat
+                double speedup = (mode == "weak") ? t * base / fastest : base / fastest;
+                points.push_back({mode, t, width, rows, fastest, speedup, speedup / t, imbalance});
+                const Point &p = points.back();
+                std::cout << std::left << std::setw(8) << p.mode << std::right << std::setw(8) << t << std::setw(14)
+                          << (std::to_string(width) + "x" + std::to_string(rows)) << std::fixed << std::setprecision(4)
+                          << std::setw(12) << p.seconds << std::setprecision(2) << std::setw(10) << p.speedup
+                          << std::setw(11) << p.efficiency * 100 << "%" << std::setw(10) << p.imbalance * 100 << "%\n";
+                std::cout.unsetf(std::ios::floatfield);
             }
-            else if (option == "-b")
-            {   
-                std::cout << "Calling blur function...\n";
-                blur(image);
-                std::cout << "After Blurring:\n";
+        }
+    }
+    catch (...)
+    {
+        g_workerBusy = nullptr;
+        std::cout.clear();
+        std::filesystem::remove_all(dir);
+        throw;
+    }
+    std::filesystem::remove_all(dir);
+    std::cout << std::setprecision(6);
+
+    std::ofstream csv(prefix + ".csv"), json(prefix + ".json");
+    csv << "mode,threads,width,height,seconds,speedup,efficiency,imbalance\n";
+    json << "[";
+    for (size_t k = 0; k < points.size(); ++k)
+    {
+        const Point &p = points[k];
+        csv << p.mode << "," << p.threads << "," << p.width << "," << p.height << "," << p.seconds << "," << p.speedup
+            << "," << p.efficiency << "," << p.imbalance << "\n";
+        json << (k ? "," : "") << "\n  {\"mode\": \"" << p.mode << "\", \"threads\": " << p.threads << ", \"width\": "
+             << p.width << ", \"height\": " << p.height << ", \"seconds\": " << p.seconds << ", \"speedup\": "
+             << p.speedup << ", \"efficiency\": " << p.efficiency << ", \"imbalance\": " << p.imbalance << "}";
+    }
+    json << "\n]\n";
+    if (!csv || !json)
+        throw std::runtime_error("Cannot write scaling results: " + prefix);
+    std::cout << "Results written to " << prefix << ".csv and " << prefix << ".json\n";
+}
+
+// Function to benchmark band heights and thread counts for each tunable operator on this
+// machine and write the fastest to the host profile. Band candidates are seeded from the
+// cache sizes: bands whose input and output rows fill about L1, a quarter, half or all of
+// L2, or an equal share of the last-level cache. Thread counts are powers of two up to the
+// core count (or just --threads when given). Each configuration is the best of three runs.
+void runAutotune(int width, int height)
+{
+    long l1 = cacheSize(1), l2 = cacheSize(2), l3 = cacheSize(3);
+    int cores = g_threads > 0 ? g_threads : availableCores();
+    long rowBytes = width * 3L;
+
+    std::vector<int> threadCounts;
+    for (int t = g_threads > 0 ? g_threads : 1; t < cores; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(cores);
+
+    std::vector<int> bands = {g_bandRows};
+    for (long bytes : {l1, l2 / 4, l2 / 2, l2, l3 / cores})
+    {
+        if (bytes > 0)
+            bands.push_back(static_cast<int>(std::min<long>(height, std::max<long>(1, bytes / (2 * rowBytes)))));
+    }
+    std::sort(bands.begin(), bands.end());
+    bands.erase(std::unique(bands.begin(), bands.end()), bands.end());
+
+    std::cout << "Autotuning on " << width << "x" << height << ": L1d " << (l1 >> 10) << " KiB, L2 " << (l2 >> 10)
+              << " KiB, L3 " << (l3 >> 10) << " KiB, " << cores << " cores\n";
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("proj02-autotune-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    std::string fileA = (dir / "a.ppm").string(), fileB = (dir / "b.ppm").string(), out = (dir / "out.ppm").string();
+    std::vector<std::vector<RGB>> source = syntheticImage(width, height), image;
+    std::cout.setstate(std::ios::failbit);
+    writePPM(fileA, source);
+    invert(source);
+    writePPM(fileB, source);
+    std::cout.clear();
+
+    struct Candidate
+    {
+        const char *key;
+        std::function<void()> prepare, run;
+    };
+    const Candidate candidates[] = {
+        {"blur", [&] { image = source; }, [&] { blur(image); }},
+        {"morphology", [&] { image = source; }, [&] { morphology(image, "open", 5, 5); }},
+        {"combine", [] {}, [&] { combineFiles(fileA, fileB, out, CombineOp::Diff, 0); }},
+    };
+
+    std::ostringstream profile;
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    profile << "# proj02 autotune profile for " << host << ": L1d " << l1 << ", L2 " << l2 << ", L3 " << l3 << ", "
+            << cores << " cores, tuned on " << width << "x" << height << "\n";
+    for (const Candidate &candidate : candidates)
+    {
+        double best = std::numeric_limits<double>::max(), baseline = 0;
+        int bestBand = g_bandRows, bestThreads = cores;
+        for (int threads : threadCounts)
+        {
+            for (int band : bands)
+            {
+                t_bandRows = band;
+                t_tunedThreads = threads;
+                double fastest = std::numeric_limits<double>::max();
+                for (int r = 0; r < 3; ++r)
+                {
+                    candidate.prepare();
+                    std::cout.setstate(std::ios::failbit);
+                    auto start = std::chrono::steady_clock::now();
+                    candidate.run();
+                    fastest = std::min(fastest, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                    std::cout.clear();
+                }
+                if (band == g_bandRows && threads == cores)
+                    baseline = fastest;
+                if (fastest < best)
+                {
+                    best = fastest;
+                    bestBand = band;
+                    bestThreads = threads;
+                }
             }
-            else if (option == "-m")
+        }
+        t_bandRows = 0;
+        t_tunedThreads = 0;
+        std::cout << "  " << std::left << std::setw(12) << candidate.key << std::right << "band " << std::setw(5)
+                  << bestBand << " rows, " << std::setw(3) << bestThreads << " threads: " << best * 1e3 << " ms (default "
+                  << baseline * 1e3 << " ms)\n";
+        profile << candidate.key << " band_bytes=" << bestBand * rowBytes << " threads=" << bestThreads << "\n";
+    }
+    std::filesystem::remove_all(dir);
+
+    std::string path = profilePath();
+    if (path.empty())
+        throw std::runtime_error("No place for the profile; set PROJ02_PROFILE");
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty())
+        std::filesystem::create_directories(parent);
+    std::ofstream file(path);
+    file << profile.str();
+    if (!file)
+        throw std::runtime_error("Cannot write profile: " + path);
+    std::cout << "Profile written to " << path << "\n";
+}
+
+// Main function
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {     
+        std::cerr << "Program expects: " << argv[0] << " <input.ppm> <output.ppm> [options]\n"
+                  << "          or: " << argv[0] << " --batch <output_dir> [options] <inputs...>\n"
+                  << "          or: " << argv[0] << " --mosaic <columns> [--tile WxH] [--downsample area|stride] <output.ppm> <inputs...>\n"
+                  << "Supported options are: -g (grayscale), -i (invert), -x (contrast), -b (blur), -m (mirror), -c (compress)\n"
+                  << "  -e <\"r=255-g; g=(r+b)/2\"> (per-pixel expression; + - * / % < > <= >= == != ?: min max clamp abs)\n"
+                  << "  --matrix <sepia|luma|red|green|blue|bgr|...|m00,...,m22[,o0,o1,o2]> (3x3 color matrix; runs of\n"
+                  << "    point options around it, -g -i -x -e --matrix, are fused into one pass)\n"
+                  << "  --lut <file.cube> (3D LUT grading), --lut-interp <trilinear|tetrahedral>, --lut-bake\n"
+                  << "  --palette <bw|gray4|gray16|gray256|rgb8|rgb332>, --dither <fs|bayer> (writes P4/P5/P6 by palette)\n"
+                  << "  --threshold <level>, --adaptive-threshold <radius[:offset]> (bilevel P4 output; P4 input accepted)\n"
+                  << "  --erode, --dilate, --open, --close <WxH> (rectangular morphology)\n"
+                  << "  --nlm <patch:search[:strength]> (non-local means denoising; patch and search are radii,\n"
+                  << "    strength defaults to 10)\n"
+                  << "  --bilateral <sigma_s:sigma_r> (edge-preserving smoothing on a bilateral grid; sigma_s >= 2\n"
+                  << "    pixels, sigma_r >= 4 gray levels)\n"
+                  << "  --convolve <kernel.txt|disk:R> (convolve with a kernel file, one row of weights per line,\n"
+                  << "    or a normalized disk; large kernels run as FFT overlap-save)\n"
+                  << "  --convolve-method <auto|direct|fft> (for following --convolve options; default auto)\n"
+                  << "  --gaussian <sigma> (recursive Gaussian blur, sigma 0.5-100, same cost for any sigma)\n"
+                  << "  --rotate <degrees> (rotate counterclockwise about the centre, keeping the size)\n"
+                  << "  --affine <a,b,c,d,e,f> (warp by x' = a x + b y + c, y' = d x + e y + f; uncovered pixels are black)\n"
+                  << "  --warp-interp <nearest|bilinear> (for following --rotate/--affine; default bilinear)\n"
+                  << "  --seam-carve <WxH> (content-aware shrink to WxH by removing low-energy seams)\n"
+                  << "  --components <stats.json> (label connected ink regions: set PBM bits, or pixels darker than\n"
+                  << "    mid-gray; the image becomes labels r * 65536 + g * 256 + b and per-component area, bbox\n"
+                  << "    and centroid go to stats.json; alone on a P4 input it is streamed in bounded memory)\n"
+                  << "  --connectivity <4|8> (for following --components; default 8)\n"
+                  << "  --overlay <file.pam[@x,y]> (alpha-composite a PAM image; P7 input/output via .pam, whose alpha\n"
+                  << "    is kept through point operators, --lut and --overlay; others flatten it onto black)\n"
+                  << "  --diff, --add, --sub, --min, --max <other.ppm>, --blend <other.ppm[:weight]> (two-input;\n"
+                  << "    streamed without loading either image when it is the only option)\n"
+                  << "  --threads <n> (worker threads, 0 = all cores), --progress (rows done per stage on stderr)\n"
+                  << "  --shards <n> (split rows across n worker processes writing one output file; row-local\n"
+                  << "    options only: -g -i -x -b -m -e --matrix --lut --erode --dilate --open --close --nlm --convolve)\n"
+                  << "  --resume (--batch, --shards and streamed two-input runs record finished work in a checkpoint;\n"
+                  << "    rerun with --resume to skip what still verifies)\n"
+                  << "  --metrics <prefix> (latency percentiles per image size and per stage, throughput and errors,\n"
+                  << "    written every 10 s and at exit to <prefix>.prom for Prometheus and <prefix>.json)\n"
+                  << "  --bench <WxH> (measure peak memory bandwidth, then each point filter's GB/s against it)\n"
+                  << "  --scaling <n> [--scaling-size WxH] [--scaling-out prefix] <options> (strong and weak scaling of\n"
+                  << "    the option chain at 1..n threads; speedup, efficiency and load imbalance to CSV and JSON)\n"
+                  << "  --autotune <WxH> (time band heights and thread counts per operator and save the fastest to\n"
+                  << "    $PROJ02_PROFILE or ~/.config/proj02/<host>.profile, which every run loads at startup)\n"
+                  << "  Ctrl-C stops at the next row band and writes the result of the options completed so far\n";
+  
+        return 1;
+    }
+
+    std::string inputFile, outputFile;
+    std::vector<Option> options;
+    std::vector<std::string> files;
+
+    // Flexible Argument Parsing Loop
+    for (int i = 1; i < argc; ++i)  // Iterates over all arguments from index 1
+    {
+        std::string arg = argv[i];  // Current argument being evaluated
+        if (arg[0] == '-')  // Identifies options (arguments starting with '-')
+        {
+            Option option{arg, ""};
+            if (optionTakesValue(arg))  // Options such as --lut consume the next argument
             {
-                std::cout << "Calling mirror function...\n";
-                mirror(image);
-                std::cout << "After Mirroring:\n";
+                if (i + 1 >= argc)
+                {
+                    std::cerr << "Error: Option " << arg << " expects a value.\n";
+                    return 1;
+                }
+                option.value = argv[++i];
             }
-            else if (option == "-c")
-            {   
-                std::cout << "Calling compress function...\n";
-                compress(image);
-                std::cout << "After Compression:\n";
+            options.push_back(option);  // Adds options to a vector, regardless of position
+        }
+        else
+        {
+            files.push_back(arg);  // Collects non-options: input then output (mosaic: output then inputs)
+        }
+    }
+
+    for (const auto &opt : options)
+    {
+        if (opt.name == "--autotune")  // Like --bench, on a synthetic image
+        {
+            int width, height;
+            try
+            {
+                for (const auto &setting : options)
+                {
+                    if (setting.name == "--threads")
+                        g_threads = std::stoi(setting.value);
+                }
+                parseSize(opt.value, width, height);
+                runAutotune(width, height);
             }
-            else
+            catch (const std::exception &e)
             {
-                std::cerr << "Unknown option: " << option << "\n";
+                std::cerr << "Error: " << e.what() << "\n";
                 return 1;
             }
+            return 0;
+        }
+        if (opt.name == "--bench")  // Runs on a synthetic image, so no files are involved
+        {
+            int width, height;
+            try
+            {
+                parseSize(opt.value, width, height);
+                runBench(width, height);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: " << e.what() << "\n";
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    loadProfile();  // Per-host band and thread settings from --autotune, if any
+
+    auto scaling = std::find_if(options.begin(), options.end(), [](const Option &o) { return o.name == "--scaling"; });
+    if (scaling != options.end())  // Synthetic inputs too; the remaining options form the chain
+    {
+        int width = 2000, height = 1500;
+        std::string prefix = "scaling";
+        std::vector<Option> chain;
+        try
+        {
+            for (const auto &opt : options)
+            {
+                if (opt.name == "--scaling-size")
+                    parseSize(opt.value, width, height);
+                else if (opt.name == "--scaling-out")
+                    prefix = opt.value;
+                else if (opt.name != "--scaling" && !isRunOption(opt.name))
+                    chain.push_back(opt);
+            }
+            runScaling(std::stoi(scaling->value), width, height, prefix, chain);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    bool mosaicMode = std::any_of(options.begin(), options.end(), [](const Option &o) { return o.name == "--mosaic"; });
+    std::string batchDir;
+    for (const auto &opt : options)
+    {
+        if (opt.name == "--batch")
+            batchDir = opt.value;
+    }
+
+    // Validation of File Arguments
+    if (!mosaicMode && batchDir.empty() && files.size() > 2)  // Handles excess non-options
+    {
+        std::cerr << "Error: Too many non-option arguments. Only input and output files are expected.\n";
+        return 1;
+    }
+    if (!batchDir.empty() && files.empty())
+    {
+        std::cerr << "Error: --batch needs at least one input file.\n";
+        return 1;
+    }
+    if (batchDir.empty() && files.size() < 2)  // Ensures at least two non-option arguments (input and output)
+    {
+        std::cerr << "Error: Both input and output file paths must be provided.\n";
+        return 1;
+    }
+    if (batchDir.empty())
+    {
+        inputFile = files[0];  // Assigns the first non-option as input file
+        outputFile = files[1];  // Assigns the second non-option as output file
+    }
+
+    // Ctrl-C asks the running operators to stop at the next band; a second one kills the process
+    std::signal(SIGINT, [](int)
+    {
+        requestCancel();
+        std::signal(SIGINT, SIG_DFL);
+    });
+    if (std::any_of(options.begin(), options.end(), [](const Option &o) { return o.name == "--progress"; }))
+    {
+        setProgressCallback([](const std::string &stage, long rowsDone, long rowsTotal)
+        {
+            std::cerr << "\r" << stage << ": " << rowsDone << "/" << rowsTotal << " rows ("
+                      << rowsDone * 100 / rowsTotal << "%)" << (rowsDone == rowsTotal ? "\n" : "") << std::flush;
+        });
+    }
 
-    // Print first few pixels after transformation for debugging
-    for (int i = 0; i < std::min(5, (int)image.size()); ++i)
+    try
     {
-        for (int j = 0; j < std::min(5, (int)image[i].size()); ++j)
+        for (const auto &opt : options)
         {
-            std::cout << "(" << (int)image[i][j].r << ", "
-                      << (int)image[i][j].g << ", "
-                      << (int)image[i][j].b << ") ";
+            if (opt.name == "--threads")
+                g_threads = std::stoi(opt.value);
         }
-        std::cout << "\n";
     }
-}
+    catch (const std::exception &)
+    {
+        std::cerr << "Error: Invalid thread count.\n";
+        return 1;
+    }
 
-        writePPM(outputFile, image);
+    // Metrics are exported periodically and once more when main returns
+    MetricsExporter exporter;
+    for (const auto &opt : options)
+    {
+        if (opt.name == "--metrics")
+            exporter.start(opt.value, 10);
+    }
+
+    try
+    {
+        if (mosaicMode)
+        {
+            int columns = 4, tileW = 160, tileH = 120;
+            bool area = true;
+            for (const auto &opt : options)
+            {
+                if (opt.name == "--mosaic")
+                    columns = std::stoi(opt.value);
+                else if (opt.name == "--tile")
+                    parseSize(opt.value, tileW, tileH);
+                else if (opt.name == "--downsample")
+                {
+                    if (opt.value != "area" && opt.value != "stride")
+                    {
+                        std::cerr << "Unknown downsample method: " << opt.value << "\n";
+                        return 1;
+                    }
+                    area = (opt.value == "area");
+                }
+                else if (!isRunOption(opt.name))
+                {
+                    std::cerr << "Option not supported with --mosaic: " << opt.name << "\n";
+                    return 1;
+                }
+            }
+            buildMosaic(std::vector<std::string>(files.begin() + 1, files.end()), files[0], columns, tileW, tileH, area);
+            return 0;
+        }
+
+        if (!batchDir.empty())
+        {
+            if (std::any_of(options.begin(), options.end(), [](const Option &o) { return o.name == "--shards"; }))
+            {
+                std::cerr << "Error: --shards applies to a single image, not --batch.\n";
+                return 1;
+            }
+            std::vector<Option> imageOptions;
+            std::copy_if(options.begin(), options.end(), std::back_inserter(imageOptions),
+                         [](const Option &o) { return o.name != "--batch"; });
+            return runBatch(files, batchDir, imageOptions);
+        }
+
+        auto imageStart = std::chrono::steady_clock::now();
+        int status = -1;
+        for (const auto &opt : options)
+        {
+            if (opt.name == "--shards")
+                status = runSharded(inputFile, outputFile, options, std::stoi(opt.value));
+        }
+        if (status < 0)
+            status = processImage(inputFile, outputFile, options);
+        if (g_metricsEnabled && status != 130)
+        {
+            PPMInfo info = probePPM(inputFile);
+            recordImage(std::chrono::duration<double>(std::chrono::steady_clock::now() - imageStart).count(),
+                        static_cast<uint64_t>(info.width) * info.height, status == 0);
+        }
+        if (status != 0)
+            return status;
     }
     catch (const std::exception &e)
     {
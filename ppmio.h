@@ -6,6 +6,8 @@
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <functional>
+#include "ppmprobe.h"
 
 // Structure to represent an RGB pixel
 struct RGB
@@ -13,10 +15,40 @@ struct RGB
     unsigned char r, g, b;
 };
 
+// Structure to represent an RGBA pixel (straight alpha), naturally aligned to 4 bytes
+struct alignas(4) RGBA
+{
+    unsigned char r, g, b, a;
+};
+
 // Function to read a PPM (P6) file and store it in a 2D vector of RGB structs
 std::vector<std::vector<RGB>> readPPM(const std::string &filename);
 
 // Function to write a 2D vector of RGB structs to a PPM (P6) file
 void writePPM(const std::string &filename, const std::vector<std::vector<RGB>> &image);
 
+// Function to read a PAM (P7) file of GRAYSCALE, GRAYSCALE_ALPHA, RGB or RGB_ALPHA tuples as RGBA
+std::vector<std::vector<RGBA>> readPAM(const std::string &filename);
+
+// Function to write a 2D vector of RGBA structs to a PAM (P7) file with RGB_ALPHA tuples
+void writePAM(const std::string &filename, const std::vector<std::vector<RGBA>> &image);
+
+// Callback for progress reports: stage name, rows finished and rows in that pass
+typedef std::function<void(const std::string &stage, long rowsDone, long rowsTotal)> ProgressCallback;
+
+// Function to install a progress callback (empty to disable); it runs at most ~100 times per pass
+void setProgressCallback(const ProgressCallback &callback);
+
+// Functions for cooperative cancellation. requestCancel() only sets an atomic flag, so it is
+// safe to call from a signal handler or another thread; running operators stop at the next
+// row band and throw OperationCancelled.
+void requestCancel();
+bool cancelRequested();
+void clearCancel();
+
+struct OperationCancelled : public std::runtime_error
+{
+    OperationCancelled() : std::runtime_error("Operation cancelled") {}
+};
+
 #endif // PPMIO_H
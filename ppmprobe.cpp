@@ -0,0 +1,278 @@
+#include "ppmprobe.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Function to skip whitespace and comments between header tokens, collecting the comments
+static void skipSpace(const unsigned char *data, size_t size, size_t &pos, PPMInfo &info)
+{
+    while (pos < size && (std::isspace(data[pos]) || data[pos] == '#'))
+    {
+        if (data[pos] != '#')
+        {
+            ++pos;
+            continue;
+        }
+        size_t start = ++pos;
+        while (pos < size && data[pos] != '\n')
+            ++pos;
+        if (pos < size)
+        {
+            std::string text(reinterpret_cast<const char *>(data + start), pos - start);
+            text.erase(0, text.find_first_not_of(" \t"));
+            if (!text.empty() && text.back() == '\r')
+                text.pop_back();
+            info.comments.push_back(text);
+        }
+    }
+}
+
+// Function to read one decimal header token
+static bool readNumber(const unsigned char *data, size_t size, size_t &pos, int &value)
+{
+    if (pos >= size || !std::isdigit(data[pos]))
+        return false;
+    long v = 0;
+    while (pos < size && std::isdigit(data[pos]))
+    {
+        v = v * 10 + (data[pos++] - '0');
+        if (v > 0x7FFFFFFF)
+            return false;
+    }
+    value = static_cast<int>(v);
+    return pos < size;  // a token running into the end of the buffer may be cut short
+}
+
+// Function to parse the line-based P7 header after the magic number
+static bool parsePAMHeader(const unsigned char *data, size_t size, size_t pos, PPMInfo &info)
+{
+    for (;;)
+    {
+        size_t end = pos;
+        while (end < size && data[end] != '\n')
+            ++end;
+        if (end >= size)
+        {
+            info.error = "Header does not end within the bytes read";
+            return false;
+        }
+        std::string line(reinterpret_cast<const char *>(data + pos), end - pos);
+        pos = end + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        if (line[0] == '#')
+        {
+            size_t text = line.find_first_not_of("# \t");
+            info.comments.push_back(text == std::string::npos ? "" : line.substr(text));
+            continue;
+        }
+
+        size_t split = line.find_first_of(" \t");
+        std::string key = line.substr(0, split);
+        std::string value = (split == std::string::npos) ? "" : line.substr(line.find_first_not_of(" \t", split));
+        if (key == "ENDHDR")
+            break;
+        try
+        {
+            if (key == "WIDTH") info.width = std::stoi(value);
+            else if (key == "HEIGHT") info.height = std::stoi(value);
+            else if (key == "DEPTH") info.depth = std::stoi(value);
+            else if (key == "MAXVAL") info.maxVal = std::stoi(value);
+            else if (key == "TUPLTYPE") info.tupleType = value;
+            else
+            {
+                info.error = "Unknown PAM header field: " + key;
+                return false;
+            }
+        }
+        catch (const std::exception &)
+        {
+            info.error = "Invalid PAM header value: " + line;
+            return false;
+        }
+    }
+    info.headerSize = pos;
+    return true;
+}
+
+bool parsePNMHeader(const unsigned char *data, size_t size, PPMInfo &info)
+{
+    info.comments.clear();
+    info.error.clear();
+    if (size < 2 || data[0] != 'P' || data[1] < '1' || data[1] > '7')
+    {
+        info.error = "Not a PNM/PAM file";
+        return false;
+    }
+    info.magic = std::string(reinterpret_cast<const char *>(data), 2);
+    char kind = static_cast<char>(data[1]);
+
+    if (kind == '7')
+    {
+        if (size < 3 || (data[2] != '\n' && data[2] != '\r'))
+        {
+            info.error = "Invalid PAM magic line";
+            return false;
+        }
+        if (!parsePAMHeader(data, size, 3, info))
+            return false;
+    }
+    else
+    {
+        size_t pos = 2;
+        bool bitmap = (kind == '1' || kind == '4');
+        int fields = bitmap ? 2 : 3;
+        int values[3] = {0, 0, 1};
+        for (int f = 0; f < fields; ++f)
+        {
+            skipSpace(data, size, pos, info);
+            if (!readNumber(data, size, pos, values[f]))
+            {
+                info.error = (pos >= size) ? "Header does not end within the bytes read" : "Invalid header token";
+                return false;
+            }
+        }
+        if (!std::isspace(data[pos]))
+        {
+            info.error = "Invalid header token";
+            return false;
+        }
+        // The last token is followed by a single whitespace character; a CR LF line end
+        // counts as one, so files written with DOS line ends read the same everywhere
+        size_t end = pos + 1;
+        if (data[pos] == '\r')
+        {
+            if (end >= size)
+            {
+                info.error = "Header does not end within the bytes read";
+                return false;
+            }
+            if (data[end] == '\n')
+                ++end;
+        }
+        info.width = values[0];
+        info.height = values[1];
+        info.maxVal = values[2];
+        info.depth = (kind == '3' || kind == '6') ? 3 : 1;
+        info.headerSize = end;
+    }
+
+    if (info.width <= 0 || info.height <= 0 || info.depth <= 0 || info.maxVal <= 0 || info.maxVal > 65535)
+    {
+        info.error = "Invalid dimensions, depth or maxval";
+        return false;
+    }
+
+    // ASCII formats (P1-P3) have no fixed payload size
+    uint64_t bytesPerSample = (info.maxVal > 255) ? 2 : 1;
+    uint64_t payload = 0;
+    if (kind == '4')
+        payload = (static_cast<uint64_t>(info.width) + 7) / 8 * info.height;
+    else if (kind >= '5')
+        payload = static_cast<uint64_t>(info.width) * info.height * info.depth * bytesPerSample;
+    info.expectedSize = (payload > 0) ? info.headerSize + payload : 0;
+    return true;
+}
+
+PPMInfo probePPM(const std::string &filename)
+{
+    PPMInfo info;
+    info.filename = filename;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        info.error = "Cannot open file";
+        return info;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        info.error = "Cannot stat file";
+        return info;
+    }
+    info.fileSize = static_cast<uint64_t>(st.st_size);
+
+    // Nearly every header fits in the first read; long comment blocks get a bigger one
+    std::vector<unsigned char> buffer;
+    bool parsed = false;
+    for (size_t want = 512; !parsed && want <= 65536; want *= 8)
+    {
+        buffer.resize(std::min<uint64_t>(want, info.fileSize));
+        ssize_t got = pread(fd, buffer.data(), buffer.size(), 0);
+        if (got < 0)
+        {
+            info.error = "Cannot read file";
+            break;
+        }
+        parsed = parsePNMHeader(buffer.data(), static_cast<size_t>(got), info);
+        if (static_cast<uint64_t>(got) >= info.fileSize)
+            break;
+    }
+    close(fd);
+
+    if (parsed)
+    {
+        if (info.expectedSize > 0 && info.fileSize < info.expectedSize)
+        {
+            info.error = "Truncated: expected " + std::to_string(info.expectedSize) + " bytes, file has " +
+                         std::to_string(info.fileSize);
+        }
+        else if (info.expectedSize == 0 && info.fileSize <= info.headerSize)
+        {
+            info.error = "No pixel data";
+        }
+        else
+        {
+            info.valid = true;
+        }
+    }
+    return info;
+}
+
+std::vector<PPMInfo> probePPMFiles(const std::vector<std::string> &filenames, int threads)
+{
+    std::vector<PPMInfo> results(filenames.size());
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1, std::min<int>(threads, static_cast<int>(filenames.size())));
+
+    // Files are claimed in small batches; each probe is a few syscalls, so contention on
+    // a single counter per file would dominate.
+    const size_t batch = 64;
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+        for (;;)
+        {
+            size_t first = next.fetch_add(batch);
+            if (first >= filenames.size())
+                break;
+            size_t last = std::min(filenames.size(), first + batch);
+            for (size_t k = first; k < last; ++k)
+            {
+                results[k] = probePPM(filenames[k]);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+    {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+    return results;
+}
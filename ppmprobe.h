@@ -0,0 +1,36 @@
+#ifndef PPMPROBE_H
+#define PPMPROBE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Header metadata of a PNM (P1-P6) or PAM (P7) file, read without touching pixel data
+struct PPMInfo
+{
+    std::string filename;
+    std::string magic;                  // "P1" .. "P7"
+    int width = 0, height = 0;
+    int depth = 0;                      // channels per pixel
+    int maxVal = 0;                     // 1 for bitmaps
+    std::string tupleType;              // P7 only
+    std::vector<std::string> comments;
+    uint64_t headerSize = 0;            // offset of the first pixel byte
+    uint64_t expectedSize = 0;          // header + payload (binary formats only)
+    uint64_t fileSize = 0;
+    bool valid = false;
+    std::string error;                  // why the file is not valid
+};
+
+// Function to parse a header held in memory. Returns false with info.error set when the
+// header is malformed or does not end within size bytes (read more and try again).
+bool parsePNMHeader(const unsigned char *data, size_t size, PPMInfo &info);
+
+// Function to probe one file: reads only the first few hundred bytes and checks the
+// payload size against fstat. Problems are reported in the result rather than thrown.
+PPMInfo probePPM(const std::string &filename);
+
+// Function to probe many files on worker threads (0 = one per core); results keep input order
+std::vector<PPMInfo> probePPMFiles(const std::vector<std::string> &filenames, int threads = 0);
+
+#endif // PPMPROBE_H
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <chrono>
+#include "ppmprobe.h"
 
 struct RGB {
     int r, g, b;
@@ -65,9 +67,48 @@ void printPPMPixels(const std::vector<std::vector<RGB>>& image) {
     std::cout << "--------------------------\n";
 }
 
+// Function to print header metadata for many files without reading their pixels
+int printInfo(const std::vector<std::string>& files) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<PPMInfo> infos = probePPMFiles(files);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int invalid = 0;
+    for (const auto& info : infos) {
+        std::cout << info.filename << ": ";
+        if (info.magic.empty()) {
+            std::cout << "error: " << info.error << "\n";
+            invalid++;
+            continue;
+        }
+        std::cout << info.magic << " " << info.width << "x" << info.height << " depth " << info.depth
+                  << " maxval " << info.maxVal;
+        if (!info.tupleType.empty()) {
+            std::cout << " " << info.tupleType;
+        }
+        std::cout << ", header " << info.headerSize << " bytes, file " << info.fileSize << " bytes, "
+                  << (info.valid ? "ok" : "error: " + info.error) << "\n";
+        for (const auto& comment : info.comments) {
+            std::cout << "  # " << comment << "\n";
+        }
+        if (!info.valid) {
+            invalid++;
+        }
+    }
+
+    std::cerr << "Probed " << infos.size() << " files in " << seconds << " s ("
+              << (seconds > 0 ? infos.size() / seconds : 0) << " files/s), " << invalid << " invalid\n";
+    return invalid == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc >= 3 && std::string(argv[1]) == "--info") {
+        return printInfo(std::vector<std::string>(argv + 2, argv + argc));
+    }
+
     if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <ppm_file>\n";
+        std::cerr << "Usage: " << argv[0] << " <ppm_file>\n"
+                  << "       " << argv[0] << " --info <ppm_file>...  (header metadata only)\n";
         return 1;
     }
 
@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Reproducible checks for the newer operators. Each check runs ./proj02 on small
+# synthetic images and compares the result with a pure-Python reference or with another
+# execution path that must agree exactly. Usage: python3 test_features.py [path/to/proj02]
+
+PROJ = "./proj02"
+TMP = None
+
+
+def run(args):
+    """
+    Runs proj02 with the given arguments; raises with its stderr if it fails.
+    """
+    result = subprocess.run([PROJ] + args, capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError("{} failed: {}".format(" ".join(args), result.stderr.strip()))
+    return result
+
+
+def path(name):
+    return os.path.join(TMP, name)
+
+
+def read_pnm(filename):
+    """
+    Reads a binary P4 or P6 file and returns (magic, width, height, pixel bytes). The header
+    ends at the single whitespace after its last token, with CR LF counting as one.
+    """
+    with open(filename, "rb") as f:
+        data = f.read()
+    magic = data[:2].decode()
+    tokens, pos = [], 2
+    count = 2 if magic == "P4" else 3
+    while len(tokens) < count:
+        while data[pos:pos + 1].isspace() or data[pos:pos + 1] == b"#":
+            if data[pos:pos + 1] == b"#":
+                pos = data.index(b"\n", pos)
+            pos += 1
+        start = pos
+        while data[pos:pos + 1].isdigit():
+            pos += 1
+        tokens.append(int(data[start:pos]))
+    pos += 2 if data[pos:pos + 2] == b"\r\n" else 1
+    return magic, tokens[0], tokens[1], data[pos:]
+
+
+def write_ppm(filename, width, height, pixels):
+    with open(filename, "wb") as f:
+        f.write(b"P6\n%d %d\n255\n" % (width, height) + bytes(pixels))
+
+
+def random_image(width, height, seed):
+    """
+    Returns pixel bytes with smooth gradients, flat areas and noise, so that every
+    operator has both edges and ties to deal with.
+    """
+    rng = random.Random(seed)
+    pixels = bytearray()
+    for y in range(height):
+        for x in range(width):
+            if (x // 16 + y // 16) % 3 == 0:
+                pixels += bytes((rng.randrange(256), rng.randrange(256), rng.randrange(256)))
+            elif (x // 16 + y // 16) % 3 == 1:
+                pixels += bytes(((x * 7) % 256, (y * 5) % 256, (x + y) % 256))
+            else:
+                pixels += bytes((200, 40, 90))
+    return pixels
+
+
+def check(name, ok, detail=""):
+    print("{}: {}{}".format(name, "Passed" if ok else "Failed", "" if ok or not detail else " (" + detail + ")"))
+    return ok
+
+
+# ---------------------------------------------------------------------------------------
+# Connected components: label image and stats against a flood fill
+
+def flood_labels(bits, eight):
+    """
+    Labels set bits in raster order of first pixel, as proj02 numbers its components.
+    """
+    height, width = len(bits), len(bits[0])
+    labels = [[0] * width for _ in range(height)]
+    stats = []
+    for y in range(height):
+        for x in range(width):
+            if not bits[y][x] or labels[y][x]:
+                continue
+            n = len(stats) + 1
+            labels[y][x] = n
+            stack, area, box = [(y, x)], 0, [x, y, x, y]
+            while stack:
+                cy, cx = stack.pop()
+                area += 1
+                box = [min(box[0], cx), min(box[1], cy), max(box[2], cx), max(box[3], cy)]
+                for dy in (-1, 0, 1):
+                    for dx in (-1, 0, 1):
+                        if (dy or dx) and (eight or not (dy and dx)):
+                            ny, nx = cy + dy, cx + dx
+                            if 0 <= ny < height and 0 <= nx < width and bits[ny][nx] and not labels[ny][nx]:
+                                labels[ny][nx] = n
+                                stack.append((ny, nx))
+            stats.append((area, box))
+    return labels, stats
+
+
+def check_components():
+    # Taller than several 64-row label bands, with a snake that crosses all of them
+    width, height = 97, 230
+    rng = random.Random(7)
+    bits = [[1 if rng.random() < 0.45 else 0 for _ in range(width)] for _ in range(height)]
+    for y in range(height):
+        bits[y][width // 2] = 1
+    for x in range(width):
+        bits[64][x] = 0
+
+    row_bytes = (width + 7) // 8
+    packed = bytearray()
+    rgb = bytearray()
+    for row in bits:
+        line = bytearray(row_bytes)
+        for x, b in enumerate(row):
+            if b:
+                line[x >> 3] |= 0x80 >> (x & 7)
+            rgb += b"\x00\x00\x00" if b else b"\xff\xff\xff"
+        packed += line
+    # CR LF header, so the streamed reader has to agree with the in-memory one
+    with open(path("mask.pbm"), "wb") as f:
+        f.write(b"P4\r\n%d %d\r\n" % (width, height) + packed)
+    write_ppm(path("mask.ppm"), width, height, rgb)
+
+    ok = True
+    for eight in (False, True):
+        labels, stats = flood_labels(bits, eight)
+        connectivity = "8" if eight else "4"
+        runs = {
+            "streamed P4": [path("mask.pbm"), path("l1.ppm"), "--connectivity", connectivity, "--components", path("s1.json")],
+            "in-memory P6": [path("mask.ppm"), path("l2.ppm"), "--connectivity", connectivity, "--components", path("s2.json")],
+        }
+        for (kind, args), out, stats_file in zip(runs.items(), ("l1.ppm", "l2.ppm"), ("s1.json", "s2.json")):
+            run(args)
+            _, _, _, data = read_pnm(path(out))
+            same = all((data[k * 3] << 16 | data[k * 3 + 1] << 8 | data[k * 3 + 2]) == labels[k // width][k % width]
+                       for k in range(width * height))
+            with open(path(stats_file)) as f:
+                report = json.load(f)
+            same_stats = report["components"] == len(stats) and all(
+                item["area"] == area and item["bbox"] == box for item, (area, box) in zip(report["items"], stats))
+            ok &= check("components {}-connected, {}".format(connectivity, kind), same and same_stats,
+                        "labels {} stats {}".format(same, same_stats))
+    return ok
+
+
+# ---------------------------------------------------------------------------------------
+# Seam carving: incremental energy and cost updates against a full recompute per seam
+
+def carve_reference(pixels, width, height, target_width):
+    rows = [[tuple(pixels[(y * width + x) * 3:(y * width + x) * 3 + 3]) for x in range(width)] for y in range(height)]
+    while width > target_width:
+        s = [[sum(p) for p in row] for row in rows]
+        energy = [[abs(s[y][min(width - 1, x + 1)] - s[y][max(0, x - 1)]) +
+                   abs(s[min(height - 1, y + 1)][x] - s[max(0, y - 1)][x]) for x in range(width)] for y in range(height)]
+        cost = [energy[0][:]]
+        for y in range(1, height):
+            above = cost[-1]
+            cost.append([energy[y][x] + min(above[max(0, x - 1)], above[x], above[min(width - 1, x + 1)])
+                         for x in range(width)])
+        x = min(range(width), key=lambda j: (cost[-1][j], j))
+        seam = [0] * height
+        seam[-1] = x
+        for y in range(height - 2, -1, -1):
+            best = x
+            if x > 0 and cost[y][x - 1] < cost[y][best]:
+                best = x - 1
+            if x + 1 < width and cost[y][x + 1] < cost[y][best]:
+                best = x + 1
+            seam[y] = x = best
+        for y in range(height):
+            del rows[y][seam[y]]
+        width -= 1
+    return bytes(c for row in rows for p in row for c in p)
+
+
+def check_seam_carve():
+    width, height = 61, 43
+    pixels = random_image(width, height, 11)
+    write_ppm(path("seam.ppm"), width, height, pixels)
+    run([path("seam.ppm"), path("seam_out.ppm"), "--seam-carve", "{}x{}".format(width - 25, height)])
+    _, w, h, data = read_pnm(path("seam_out.ppm"))
+    expected = carve_reference(pixels, width, height, width - 25)
+    return check("seam carving 25 seams vs full recompute", (w, h) == (width - 25, height) and data == expected)
+
+
+# ---------------------------------------------------------------------------------------
+# Per-pixel expressions against Python evaluation. The operands stay integers below 2^24,
+# so float32 and Python arithmetic agree exactly.
+
+def trunc_div(a, b):
+    return 0 if b == 0 else a / b
+
+
+def trunc_mod(a, b):
+    return 0 if b == 0 else a - b * int(a / b)
+
+
+EXPRESSIONS = [
+    ("r=255-g; g=r; b=g",
+     lambda r, g, b: (255 - g, r, g)),
+    ("r=(r+b)/2; g=r>128 ? 255-g : g*2; b=clamp(abs(r-g)*3, 20, 230)",
+     lambda r, g, b: (trunc_div(r + b, 2), 255 - g if r > 128 else g * 2, min(max(abs(r - g) * 3, 20), 230))),
+    ("r=r%7*30 + g/0; g=min(r, b) - max(g, 10) + -b; b=(r<=g) + (g>=b)*2 + (r==b)*4 + (r!=g)*8",
+     lambda r, g, b: (trunc_mod(r, 7) * 30 + 0, min(r, b) - max(g, 10) - b,
+                      (r <= g) + (g >= b) * 2 + (r == b) * 4 + (r != g) * 8)),
+    ("g=-(-r) % (b+1) * 3; b=r*g/255 < 40 ? 0 : (r < g ? r*2 : g*2)",
+     lambda r, g, b: (r, trunc_mod(r, b + 1) * 3, 0 if trunc_div(r * g, 255) < 40 else (r * 2 if r < g else g * 2))),
+]
+
+
+def check_expressions():
+    width, height = 53, 37
+    pixels = random_image(width, height, 3)
+    write_ppm(path("expr.ppm"), width, height, pixels)
+    ok = True
+    for text, reference in EXPRESSIONS:
+        run([path("expr.ppm"), path("expr_out.ppm"), "-e", text])
+        _, _, _, data = read_pnm(path("expr_out.ppm"))
+        expected = bytearray()
+        for k in range(width * height):
+            for v in reference(*pixels[k * 3:k * 3 + 3]):
+                expected.append(int(min(max(v, 0), 255)))
+        ok &= check("expression " + text, data == bytes(expected))
+    return ok
+
+
+# ---------------------------------------------------------------------------------------
+# Convolution: FFT overlap-save against direct, and direct against a brute-force sum
+
+def check_convolve():
+    width, height = 150, 90
+    pixels = random_image(width, height, 5)
+    write_ppm(path("conv.ppm"), width, height, pixels)
+    rng = random.Random(9)
+    kernel = [[rng.uniform(-0.05, 0.12) for _ in range(13)] for _ in range(9)]
+    with open(path("kernel.txt"), "w") as f:
+        f.write("# asymmetric 13x9 kernel\n")
+        for row in kernel:
+            f.write(" ".join("{:.6f}".format(v) for v in row) + "\n")
+
+    ok = True
+    for spec in ("disk:6", path("kernel.txt")):
+        run([path("conv.ppm"), path("direct.ppm"), "--convolve-method", "direct", "--convolve", spec])
+        run([path("conv.ppm"), path("fft.ppm"), "--convolve-method", "fft", "--convolve", spec])
+        direct = read_pnm(path("direct.ppm"))[3]
+        fft = read_pnm(path("fft.ppm"))[3]
+        worst = max(abs(a - b) for a, b in zip(direct, fft))
+        ok &= check("convolve {} fft vs direct".format(os.path.basename(spec)), worst <= 1, "max diff {}".format(worst))
+
+    # Brute-force convolution (kernel flipped, edge pixels replicated) on a sample of the
+    # asymmetric kernel's output
+    direct = read_pnm(path("direct.ppm"))[3]
+    kh, kw = len(kernel), len(kernel[0])
+    worst = 0
+    for y in range(0, height, 7):
+        for x in range(0, width, 5):
+            for c in range(3):
+                acc = 0.0
+                for i in range(kh):
+                    for j in range(kw):
+                        sy = min(height - 1, max(0, y + kh // 2 - i))
+                        sx = min(width - 1, max(0, x + kw // 2 - j))
+                        acc += kernel[i][j] * pixels[(sy * width + sx) * 3 + c]
+                expected = int(min(255.0, max(0.0, acc)) + 0.5)
+                worst = max(worst, abs(expected - direct[(y * width + x) * 3 + c]))
+    ok &= check("convolve direct vs brute force", worst <= 1, "max diff {}".format(worst))
+    return ok
+
+
+# ---------------------------------------------------------------------------------------
+# Execution paths that must agree exactly
+
+def check_paths(repo):
+    width, height = 120, 77
+    write_ppm(path("paths.ppm"), width, height, random_image(width, height, 13))
+    # The repository's car.ppm has a CR LF header
+    car = os.path.join(repo, "car.ppm")
+    ok = True
+    for source in (path("paths.ppm"), car):
+        for options in (["-i", "-g"], ["-b", "-x"], ["--nlm", "1:3"], ["--convolve", "disk:3", "-e", "r=g"],
+                        ["--erode", "3x5", "--matrix", "sepia"]):
+            run([source, path("whole.ppm")] + options)
+            for shards in (2, 5):
+                run([source, path("sharded.ppm"), "--shards", str(shards)] + options)
+                same = read_pnm(path("whole.ppm")) == read_pnm(path("sharded.ppm"))
+                ok &= check("{} --shards {} {}".format(os.path.basename(source), shards, " ".join(options)), same)
+
+        # Two-input operators alone are streamed from mapped files; a point operator first
+        # forces the in-memory path. The second input also gets a CR LF header.
+        _, w, h, data = read_pnm(source)
+        with open(path("other.ppm"), "wb") as f:
+            f.write(b"P6\r\n%d %d\r\n255\r\n" % (w, h) + data[::-1])
+        for op in (["--diff", path("other.ppm")], ["--blend", path("other.ppm") + ":0.3"]):
+            streamed = run([source, path("streamed.ppm")] + op).stdout
+            run([source, path("memory.ppm"), "--matrix", "1,0,0,0,1,0,0,0,1"] + op)
+            same = "Streaming" in streamed and read_pnm(path("streamed.ppm")) == read_pnm(path("memory.ppm"))
+            ok &= check("{} {} streamed vs in-memory".format(os.path.basename(source), op[0]), same)
+    return ok
+
+
+def main():
+    global PROJ, TMP
+    if len(sys.argv) > 1:
+        PROJ = sys.argv[1]
+    PROJ = os.path.abspath(PROJ)
+    repo = os.path.dirname(os.path.abspath(__file__))
+    TMP = tempfile.mkdtemp(prefix="proj02-tests-")
+    try:
+        results = [check_components(), check_seam_carve(), check_expressions(), check_convolve(), check_paths(repo)]
+    finally:
+        shutil.rmtree(TMP, ignore_errors=True)
+    if all(results):
+        print("All checks passed.")
+    else:
+        print("Some checks failed.")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()